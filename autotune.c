@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+#include "pipeline.h"
+#include "timer.h"
+
+//The tile cache lives in the home directory so every run on this machine can reuse it
+#define TILE_CACHE ".image_tiles"
+//Only the top rows of the image are used while tuning, which keeps tuning to a few seconds on large images
+#define TUNE_ROWS 512
+#define TUNE_RUNS 2
+
+//Candidate tile sizes.  0 means untiled in that direction.
+static int tuneWidths[]={0,64,128,256,512,1024};
+static int tuneHeights[]={0,8,16,32,64,128};
+
+//autotuneTiles: Times every candidate tile size on the top of an image and returns the fastest
+//Parameters: srcImage: The image to tune on
+//            kernel: The kernel to tune for
+//            convolute: The engine to time
+//            width,height: Receive the best tile size
+//Returns: Nothing.  The tile size in effect before the call is restored.
+void autotuneTiles(Image* srcImage,Kernel* kernel,ConvoluteFunction convolute,int* width,int* height){
+    int oldWidth,oldHeight,run;
+    size_t w,h;
+    double best=-1;
+    Image sample=*srcImage,destImage;
+    if (sample.height>TUNE_ROWS) sample.height=TUNE_ROWS;
+    destImage=sample;
+    destImage.data=malloc(imageBytes(&sample));
+    getTileSize(&oldWidth,&oldHeight);
+    *width=oldWidth;
+    *height=oldHeight;
+    if (!destImage.data) return;
+    for (w=0;w<sizeof(tuneWidths)/sizeof(int);w++){
+        if (tuneWidths[w]>=sample.width) continue;
+        for (h=0;h<sizeof(tuneHeights)/sizeof(int);h++){
+            double fastest=-1;
+            setTileSize(tuneWidths[w],tuneHeights[h]);
+            for (run=0;run<TUNE_RUNS;run++){
+                double start=nowSeconds();
+                convolute(&sample,&destImage,kernel);
+                double elapsed=nowSeconds()-start;
+                if (fastest<0||elapsed<fastest) fastest=elapsed;
+            }
+            if (best<0||fastest<best){
+                best=fastest;
+                *width=tuneWidths[w];
+                *height=tuneHeights[h];
+            }
+        }
+    }
+    setTileSize(oldWidth,oldHeight);
+    free(destImage.data);
+}
+
+//tileCachePath: Builds the path of the tile cache file
+static void tileCachePath(char* path,size_t size){
+    const char* home=getenv("HOME");
+    snprintf(path,size,"%s/%s",home?home:".",TILE_CACHE);
+}
+
+//tileCacheKey: The cache is keyed by host, execution path, kernel size, channels and sample type, since those decide the memory access pattern
+static void tileCacheKey(Kernel* kernel,Image* image,char* key,size_t size){
+    static const char* typeNames[]={"u8","u16","float"};
+    char host[64]="unknown";
+    gethostname(host,sizeof(host)-1);
+    snprintf(key,size,"%s %s %d %d %s",host,pathName(kernelPath(kernel)),kernel->size,image->bpp,typeNames[image->type]);
+}
+
+//loadTileCache: Looks up a tile size stored by an earlier --autotune run
+//Returns: 0 if an entry was found, -1 otherwise
+int loadTileCache(Kernel* kernel,Image* image,int* width,int* height){
+    char path[1024],key[256],line[512];
+    int found=-1;
+    tileCachePath(path,sizeof(path));
+    tileCacheKey(kernel,image,key,sizeof(key));
+    FILE* file=fopen(path,"r");
+    if (!file) return -1;
+    while (fgets(line,sizeof(line),file)){
+        size_t length=strlen(key);
+        //later lines win, so a re-tune overrides an older entry
+        if (!strncmp(line,key,length)&&line[length]==' '&&sscanf(line+length,"%d %d",width,height)==2) found=0;
+    }
+    fclose(file);
+    return found;
+}
+
+//saveTileCache: Appends a tuned tile size to the cache file
+//Returns: 0 on success, -1 if the cache could not be written
+int saveTileCache(Kernel* kernel,Image* image,int width,int height){
+    char path[1024],key[256];
+    tileCachePath(path,sizeof(path));
+    tileCacheKey(kernel,image,key,sizeof(key));
+    FILE* file=fopen(path,"a");
+    if (!file) return -1;
+    fprintf(file,"%s %d %d\n",key,width,height);
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include "image.h"
+#include "pipeline.h"
+#include "timer.h"
+#include "calibrate.h"
+#include "stb_image.h"
+
+//bench: Runs every engine over every built in kernel on the bundled pictures and on synthetic images,
+//for 1..N threads, and prints one CSV row per combination.
+//bench calibrate: Measures the machine's memory bandwidth and arithmetic peak, then reports how close each engine
+//gets to the roofline for every built in kernel and image.  The rows are also appended, with the host name, to a CSV file.
+//bench radius: Times the median and bilateral filters at several window sizes, to show how their cost grows with the window
+//once every engine band or tile has primed its sliding state.
+
+#define MAX_REPS 1000
+
+//An engine the benchmark can run.  parallel engines are run for every thread count, serial only once.
+typedef struct{
+    const char* name;
+    ConvoluteFunction convolute;
+    int parallel;
+} Engine;
+
+static Engine engines[]={
+    {"serial",convolute,0},
+    {"omp",ompConvolute,1},
+    {"pthread",pthreadConvolute,1}
+};
+
+//The benchmark settings, from the command line
+typedef struct{
+    int warmup;
+    int reps;
+    int maxThreads;
+    char* images;       //comma separated file names
+    char* sizes;        //comma separated megapixel counts for the synthetic images
+    int calibrate;      //run the roofline calibration instead of the thread sweep
+    int radius;         //run the window size sweep instead of the thread sweep
+    char* out;          //the file calibration results are appended to
+} BenchOptions;
+
+//Compulsory traffic per sample: each source byte is read once and each destination byte written once
+#define BYTES_PER_SAMPLE 2.0
+
+static int benchUsage(){
+    printf("Usage: bench [calibrate|radius] [--warmup N] [--reps N] [--threads N] [--images a.jpg,b.jpg] [--sizes 1,10,100] [--out roofline.csv]\n");
+    printf("\tprints engine,kernel,image,width,height,threads,median_ms,p95_ms,mpix_per_s,efficiency as CSV\n");
+    printf("\tcalibrate prints each engine's fraction of the memory and compute roofline, and appends it to --out\n");
+    printf("\tradius prints the same columns for median and bilateral filters of growing size, with ns_per_sample for efficiency\n");
+    return -1;
+}
+
+static int compareDoubles(const void* a,const void* b){
+    double x=*(const double*)a,y=*(const double*)b;
+    return x<y?-1:x>y;
+}
+
+//syntheticImage: Makes a roughly square RGB image of the given number of megapixels filled with repeatable noise
+static int syntheticImage(double megapixels,Image* image){
+    uint32_t seed=12345;
+    image->width=(int)sqrt(megapixels*1e6);
+    image->height=image->width;
+    image->bpp=3;
+    image->type=SAMPLE_U8;
+    size_t size=(size_t)image->width*image->height*image->bpp;
+    image->data=malloc(size);
+    if (!image->data) return -1;
+    for (size_t i=0;i<size;i++){
+        seed=seed*1664525+1013904223;
+        image->data[i]=seed>>24;
+    }
+    return 0;
+}
+
+//timeEngine: Runs one engine/kernel/thread count combination and records the median and 95th percentile in ms
+static void timeEngine(BenchOptions* options,Engine* engine,Image* srcImage,Image* destImage,Kernel* kernel,int threads,double* median,double* p95){
+    double times[MAX_REPS];
+    int i;
+    setThreadCount(threads);
+    for (i=0;i<options->warmup;i++) engine->convolute(srcImage,destImage,kernel);
+    for (i=0;i<options->reps;i++){
+        long long start=nowNanos();
+        engine->convolute(srcImage,destImage,kernel);
+        times[i]=(nowNanos()-start)/1e6;
+    }
+    qsort(times,options->reps,sizeof(double),compareDoubles);
+    *median=options->reps%2?times[options->reps/2]:(times[options->reps/2-1]+times[options->reps/2])/2;
+    *p95=times[(int)ceil(0.95*options->reps)-1];
+}
+
+//benchImage: Benchmarks every engine and kernel on one image
+static void benchImage(BenchOptions* options,const char* label,Image* srcImage){
+    Image destImage=*srcImage;
+    destImage.data=malloc((size_t)srcImage->width*srcImage->height*srcImage->bpp);
+    if (!destImage.data){
+        fprintf(stderr,"Out of memory for %s.\n",label);
+        return;
+    }
+    double megapixels=(double)srcImage->width*srcImage->height/1e6;
+    for (size_t e=0;e<sizeof(engines)/sizeof(Engine);e++){
+        for (int k=0;k<=IDENTITY;k++){
+            double single=0;
+            int maxThreads=engines[e].parallel?options->maxThreads:1;
+            for (int threads=1;threads<=maxThreads;threads++){
+                double median,p95;
+                timeEngine(options,&engines[e],srcImage,&destImage,getKernel(k),threads,&median,&p95);
+                if (threads==1) single=median;
+                printf("%s,%s,%s,%d,%d,%d,%.3f,%.3f,%.2f,%.3f\n",engines[e].name,getKernel(k)->name,label,
+                    srcImage->width,srcImage->height,threads,median,p95,megapixels/(median/1000),single/(median*threads));
+                fflush(stdout);
+            }
+        }
+    }
+    free(destImage.data);
+}
+
+//The window sizes bench radius sweeps: sliding histogram medians and bilateral filters of growing radius
+static const char* radiusSpecs[]={"median7","median11","median15","bilateral:3","bilateral:5","bilateral:10","bilateral:20","bilateral:32"};
+
+//radiusImage: Times every engine, at the full thread count, on each of radiusSpecs
+static void radiusImage(BenchOptions* options,const char* label,Image* srcImage){
+    Image destImage=*srcImage;
+    Pipeline pipeline;
+    destImage.data=malloc((size_t)srcImage->width*srcImage->height*srcImage->bpp);
+    if (!destImage.data){
+        fprintf(stderr,"Out of memory for %s.\n",label);
+        return;
+    }
+    double samples=(double)srcImage->width*srcImage->height*srcImage->bpp;
+    for (size_t e=0;e<sizeof(engines)/sizeof(Engine);e++){
+        int threads=engines[e].parallel?options->maxThreads:1;
+        for (size_t k=0;k<sizeof(radiusSpecs)/sizeof(radiusSpecs[0]);k++){
+            double median,p95;
+            if (parsePipeline(radiusSpecs[k],&pipeline)) continue;
+            timeEngine(options,&engines[e],srcImage,&destImage,pipeline.stages[0],threads,&median,&p95);
+            printf("%s,%s,%s,%d,%d,%d,%.3f,%.3f,%.2f,%.3f\n",engines[e].name,radiusSpecs[k],label,srcImage->width,srcImage->height,
+                threads,median,p95,samples/srcImage->bpp/1e6/(median/1000),median*1e6/samples);
+            fflush(stdout);
+        }
+    }
+    free(destImage.data);
+}
+
+//kernelOps: Arithmetic per sample: a multiply and an add for every non zero tap.  Integer and floating point
+//operations are counted alike against the floating point peak, which is close enough to place a kernel on the roofline.
+static double kernelOps(Kernel* kernel){
+    int taps=0;
+    if (kernel->identity) return 0;
+    for (int i=0;i<kernel->size;i++)
+        for (int j=0;j<kernel->size;j++)
+            if (kernel->coef[i][j]!=0) taps++;
+    return 2.0*taps;
+}
+
+//calibrateImage: Runs every engine and kernel at the full thread count and reports them against the machine's roofline
+static void calibrateImage(BenchOptions* options,Machine* machine,const char* label,Image* srcImage,FILE* out){
+    Image destImage=*srcImage;
+    destImage.data=malloc((size_t)srcImage->width*srcImage->height*srcImage->bpp);
+    if (!destImage.data){
+        fprintf(stderr,"Out of memory for %s.\n",label);
+        return;
+    }
+    double samples=(double)srcImage->width*srcImage->height*srcImage->bpp;
+    for (size_t e=0;e<sizeof(engines)/sizeof(Engine);e++){
+        int threads=engines[e].parallel?options->maxThreads:1;
+        for (int k=0;k<=IDENTITY;k++){
+            double median,p95;
+            Kernel* kernel=getKernel(k);
+            timeEngine(options,&engines[e],srcImage,&destImage,kernel,threads,&median,&p95);
+            double seconds=median/1000;
+            double gbs=samples*BYTES_PER_SAMPLE/seconds/1e9;
+            double gflops=samples*kernelOps(kernel)/seconds/1e9;
+            //the roofline: a copy is only bandwidth bound, otherwise the lower of the compute peak and what the memory bandwidth can feed at this arithmetic intensity
+            double attainable=kernelOps(kernel)/BYTES_PER_SAMPLE*machine->triadGBs;
+            if (attainable>machine->peakGflops) attainable=machine->peakGflops;
+            char row[512];
+            snprintf(row,sizeof(row),"%s,%d,%s,%s,%s,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f",machine->host,machine->threads,
+                engines[e].name,kernel->name,label,srcImage->width,srcImage->height,threads,median,gbs,gflops,
+                gbs/machine->triadGBs,attainable>0?gflops/attainable:gbs/machine->triadGBs,attainable);
+            printf("%s\n",row);
+            fflush(stdout);
+            if (out) fprintf(out,"%s\n",row);
+        }
+    }
+    free(destImage.data);
+}
+
+int main(int argc,char** argv){
+    BenchOptions options={1,5,(int)sysconf(_SC_NPROCESSORS_ONLN),"pic2.jpg,pic3.jpg,pic4.jpg","1,10,100",0,0,"roofline.csv"};
+    char* item;
+    Machine machine;
+    FILE* out=NULL;
+    for (int i=1;i<argc;i++){
+        if (i==1&&!strcmp(argv[i],"calibrate")){
+            options.calibrate=1;
+            continue;
+        }
+        if (i==1&&!strcmp(argv[i],"radius")){
+            options.radius=1;
+            continue;
+        }
+        if (i+1==argc) return benchUsage();
+        if (!strcmp(argv[i],"--warmup")) options.warmup=atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--reps")) options.reps=atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--threads")) options.maxThreads=atoi(argv[++i]);
+        else if (!strcmp(argv[i],"--images")) options.images=argv[++i];
+        else if (!strcmp(argv[i],"--sizes")) options.sizes=argv[++i];
+        else if (!strcmp(argv[i],"--out")) options.out=argv[++i];
+        else return benchUsage();
+    }
+    if (options.warmup<0||options.reps<1||options.reps>MAX_REPS||options.maxThreads<1) return benchUsage();
+
+    initKernelRegistry();
+    //the engines' own per thread accounting is not needed here
+    timerEnable(0);
+    options.images=strdup(options.images);
+    options.sizes=strdup(options.sizes);
+    if (options.calibrate){
+        const char* header="host,host_threads,engine,kernel,image,width,height,threads,median_ms,gb_per_s,gflops,memory_fraction,roofline_fraction,attainable_gflops";
+        calibrateMachine(&machine,options.maxThreads);
+        printf("# %s: copy %.2f GB/s, triad %.2f GB/s, peak %.2f GFLOP/s with %d threads\n",machine.host,machine.copyGBs,machine.triadGBs,machine.peakGflops,machine.threads);
+        printf("%s\n",header);
+        out=fopen(options.out,"a");
+        if (!out) fprintf(stderr,"Could not open %s, results are only printed.\n",options.out);
+        else{
+            if (ftell(out)==0) fprintf(out,"%s\n",header);
+            time_t now=time(NULL);
+            char date[32];
+            strftime(date,sizeof(date),"%Y-%m-%dT%H:%M:%S",localtime(&now));
+            fprintf(out,"# %s %s: copy %.2f GB/s, triad %.2f GB/s, peak %.2f GFLOP/s with %d threads\n",date,machine.host,machine.copyGBs,machine.triadGBs,machine.peakGflops,machine.threads);
+        }
+    }
+    else if (options.radius) printf("engine,kernel,image,width,height,threads,median_ms,p95_ms,mpix_per_s,ns_per_sample\n");
+    else printf("engine,kernel,image,width,height,threads,median_ms,p95_ms,mpix_per_s,efficiency\n");
+    for (item=strtok(options.images,",");item;item=strtok(NULL,",")){
+        Image srcImage={NULL,0,0,0,SAMPLE_U8};
+        srcImage.data=stbi_load(item,&srcImage.width,&srcImage.height,&srcImage.bpp,0);
+        if (!srcImage.data){
+            fprintf(stderr,"Error loading file %s.\n",item);
+            continue;
+        }
+        if (options.calibrate) calibrateImage(&options,&machine,item,&srcImage,out);
+        else if (options.radius) radiusImage(&options,item,&srcImage);
+        else benchImage(&options,item,&srcImage);
+        stbi_image_free(srcImage.data);
+    }
+    for (item=strtok(options.sizes,",");item;item=strtok(NULL,",")){
+        char label[64];
+        Image srcImage;
+        if (syntheticImage(atof(item),&srcImage)){
+            fprintf(stderr,"Out of memory for a %sMP image.\n",item);
+            continue;
+        }
+        snprintf(label,sizeof(label),"synthetic-%sMP",item);
+        if (options.calibrate) calibrateImage(&options,&machine,label,&srcImage,out);
+        else if (options.radius) radiusImage(&options,label,&srcImage);
+        else benchImage(&options,label,&srcImage);
+        free(srcImage.data);
+    }
+    if (out) fclose(out);
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+//The bilateral filter.  Each output sample is an average of the window around it in which every sample is weighted by
+//exp(-d*d/(2*sigma*sigma)), d being the difference between its value and the centre's, so samples across an edge hardly count.
+//Computed directly that is a weight for every sample of every window, far too slow at the radii people smooth with.
+//bilateralFilter follows Yang, Tan and Ahuja's constant time approximation: for a fixed centre value, a level, the weights no
+//longer depend on the centre, so the weighted sums over the window are box sums that running sums keep up to date.  The levels
+//are about sigma apart from 0 to 255, and each sample interpolates between the averages of the two levels either side of its
+//value.  The cost per sample grows with the number of levels, 255/sigma+1, and not with the radius.  Each call primes the sums with
+//the 2r+1 rows around its first row, which would grow with r over short bands, so the engines give it one band per thread (see slidingKernel).
+//The weights come from a table of integers, so the sums are exact in any order and tiles and threads give the same result as one
+//pass over the image.
+
+//The weight of a sample whose value is the level's
+#define RANGE_ONE 1024
+#define MAX_LEVELS (255/MIN_RANGE_SIGMA+2)
+
+//rangeSample: Reads a sample as its position on the 8 bit scale the weights are indexed by, and its value in the units the sums
+//             are kept in: the sample itself for 8 and 16 bit images, and the 16 bit scale for float images, whose full scale
+//             (0..255 or 0..65535, see setFloatRange) is passed as range
+static inline double rangeSample(const Image* image,size_t index,float range,int64_t* value){
+    if (image->type==SAMPLE_U8){
+        *value=image->data[index];
+        return *value;
+    }
+    if (image->type==SAMPLE_U16){
+        *value=((const uint16_t*)image->data)[index];
+        return *value/257.0;
+    }
+    float sample=((const float*)image->data)[index]*(65535/range);
+    *value=llroundf(sample);
+    return sample<=0?0:sample>=65535?255:sample/257.0;
+}
+
+//loadRow: Reads the samples of one channel of a source row for the columns of the rectangle and the radius either side
+static void loadRow(Image* srcImage,int row,int bit,float range,const int* offsets,int columns,int* positions,int64_t* values){
+    size_t line=(size_t)row*srcImage->width*srcImage->bpp+bit;
+    for (int c=0;c<columns;c++) positions[c]=(int)(rangeSample(srcImage,line+offsets[c],range,&values[c])+0.5);
+}
+
+//countRows: Adds the loaded row entering the window to the column sums of every level and takes away the row leaving it, if any
+static void countRows(int columns,int stride,const int* weights,const int* levels,int count,const int* positions,const int64_t* values,
+                      const int* leavingPositions,const int64_t* leavingValues,int32_t* weight,int64_t* weighted){
+    for (int k=0;k<count;k++){
+        int32_t* levelWeight=weight+(size_t)k*stride;
+        int64_t* levelWeighted=weighted+(size_t)k*stride;
+        for (int c=0;c<columns;c++){
+            int w=weights[abs(positions[c]-levels[k])];
+            levelWeight[c]+=w;
+            levelWeighted[c]+=w*values[c];
+        }
+        if (leavingPositions)
+            for (int c=0;c<columns;c++){
+                int w=weights[abs(leavingPositions[c]-levels[k])];
+                levelWeight[c]-=w;
+                levelWeighted[c]-=w*leavingValues[c];
+            }
+    }
+}
+
+//bilateralFilter: Applies a bilateral filter to the rectangle [x0,x1)x[y0,y1)
+//Parameters: srcImage: The image being filtered
+//            destImage: A pre-allocated image of the same size and type.  8 and 16 bit results are rounded.
+//            kernel: A kernel registered with registerBilateral or made by parameterizeKernel
+//            x0,y0,x1,y1: The rectangle to compute
+//Returns: Nothing
+void bilateralFilter(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1){
+    int row,pix,bit,k,c,size=kernel->size,r=size/2,width=x1-x0,columns=width+2*r,bpp=srcImage->bpp,channels=colourChannels(srcImage);
+    int count=(int)ceil(255/kernel->rangeSigma)+1;
+    //arrays a multiple of 4KB apart slow down, as a load from one waits for a store to the other, so they are padded
+    int stride=(columns|63)+17;
+    double spacing=255.0/(count-1);
+    float range=getFloatRange();
+    int weights[256],levels[MAX_LEVELS];
+    for (k=0;k<256;k++) weights[k]=(int)(RANGE_ONE*exp(-k*k/(2*kernel->rangeSigma*kernel->rangeSigma))+0.5);
+    for (k=0;k<count;k++) levels[k]=(int)(k*spacing+0.5);
+    //the column sums of each level, for the columns of the rectangle and the radius either side, then the window sums of each level
+    //along the current row, each level's sums next to each other
+    int* offsets=malloc(sizeof(int)*columns);
+    int* positions=malloc(sizeof(int)*2*stride);
+    int64_t* values=malloc(sizeof(int64_t)*2*stride);
+    int32_t* weight=malloc(sizeof(int32_t)*count*2*stride);
+    int64_t* weighted=malloc(sizeof(int64_t)*count*2*stride);
+    if (!offsets||!positions||!values||!weight||!weighted){
+        noteOutOfMemory();
+        goto done;
+    }
+    int32_t* windowWeight=weight+(size_t)count*stride;
+    int64_t* windowWeighted=weighted+(size_t)count*stride;
+    for (c=0;c<columns;c++) offsets[c]=clampIndex(x0-r+c,srcImage->width)*bpp;
+    for (bit=0;bit<channels;bit++){
+        for (row=y0;row<y1;row++){
+            if (row==y0){
+                memset(weight,0,sizeof(int32_t)*count*stride);
+                memset(weighted,0,sizeof(int64_t)*count*stride);
+                for (int i=-r;i<=r;i++){
+                    loadRow(srcImage,clampIndex(row+i,srcImage->height),bit,range,offsets,columns,positions,values);
+                    countRows(columns,stride,weights,levels,count,positions,values,NULL,NULL,weight,weighted);
+                }
+            }
+            else{
+                loadRow(srcImage,clampIndex(row+r,srcImage->height),bit,range,offsets,columns,positions,values);
+                loadRow(srcImage,clampIndex(row-r-1,srcImage->height),bit,range,offsets,columns,positions+stride,values+stride);
+                countRows(columns,stride,weights,levels,count,positions,values,positions+stride,values+stride,weight,weighted);
+            }
+            for (k=0;k<count;k++){
+                const int32_t* levelWeight=weight+(size_t)k*stride;
+                const int64_t* levelWeighted=weighted+(size_t)k*stride;
+                int32_t* rowWeight=windowWeight+(size_t)k*stride;
+                int64_t* rowWeighted=windowWeighted+(size_t)k*stride;
+                int32_t sumWeight=0;
+                int64_t sumWeighted=0;
+                for (c=0;c<size-1;c++){
+                    sumWeight+=levelWeight[c];
+                    sumWeighted+=levelWeighted[c];
+                }
+                for (pix=0;pix<width;pix++){
+                    sumWeight+=levelWeight[pix+size-1];
+                    sumWeighted+=levelWeighted[pix+size-1];
+                    rowWeight[pix]=sumWeight;
+                    rowWeighted[pix]=sumWeighted;
+                    sumWeight-=levelWeight[pix];
+                    sumWeighted-=levelWeighted[pix];
+                }
+            }
+            for (pix=0;pix<width;pix++){
+                size_t index=((size_t)row*srcImage->width+x0+pix)*bpp+bit;
+                int64_t value;
+                double position=rangeSample(srcImage,index,range,&value)/spacing;
+                k=(int)position<count-1?(int)position:count-2;
+                size_t low=(size_t)k*stride+pix,high=low+stride;
+                //the centre sample is within about sigma of the levels either side of it, so neither weight sum is zero
+                double lowAverage=(double)windowWeighted[low]/windowWeight[low],highAverage=(double)windowWeighted[high]/windowWeight[high];
+                double result=lowAverage+(highAverage-lowAverage)*(position-k);
+                if (destImage->type==SAMPLE_FLOAT) ((float*)destImage->data)[index]=(float)(result*range/65535);
+                else if (destImage->type==SAMPLE_U16) ((uint16_t*)destImage->data)[index]=(uint16_t)(result+0.5);
+                else destImage->data[index]=(uint8_t)(result+0.5);
+            }
+        }
+    }
+done:
+    free(offsets);
+    free(positions);
+    free(values);
+    free(weight);
+    free(weighted);
+}
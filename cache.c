@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include "cache.h"
+
+//Disk entries are files named by the hash of their key, holding the key on the first line and then the bytes
+#define CACHE_SUFFIX ".cache"
+
+//The cache of encoded results, shared by the server and the command line
+Cache resultCache;
+//The cache of decoded source images, used by the server so re-filtering a picture skips decoding it
+Cache imageCache;
+
+//hashBytes: A fast 64 bit hash, 8 bytes at a time.  Not cryptographic: the full key is compared on every hit.
+uint64_t hashBytes(const void* data,size_t length){
+    const unsigned char* bytes=data;
+    uint64_t hash=0x9E3779B97F4A7C15ULL^length,word;
+    size_t i;
+    for (i=0;i+8<=length;i+=8){
+        memcpy(&word,bytes+i,8);
+        hash^=word*0xFF51AFD7ED558CCDULL;
+        hash=((hash<<31)|(hash>>33))*0xC4CEB9FE1A85EC53ULL;
+    }
+    for (;i<length;i++) hash=(hash^bytes[i])*0x100000001B3ULL;
+    hash^=hash>>33;
+    hash*=0xFF51AFD7ED558CCDULL;
+    hash^=hash>>33;
+    return hash;
+}
+
+//cacheConfigure: Sets the budgets of a cache and empties it
+//Parameters: capacity: Bytes held in memory, 0 for no memory cache
+//            directory: Where entries are also written, or NULL for no disk cache.  It must already exist.
+//            diskCapacity: Bytes allowed in the directory, 0 for no limit
+void cacheConfigure(Cache* cache,size_t capacity,const char* directory,size_t diskCapacity){
+    for (int i=0;i<MAX_CACHE_ENTRIES;i++){
+        free(cache->entries[i].key);
+        free(cache->entries[i].data);
+    }
+    free(cache->spare);
+    memset(cache,0,sizeof(Cache));
+    cache->capacity=capacity;
+    cache->diskCapacity=diskCapacity;
+    if (directory) snprintf(cache->directory,MAX_CACHE_PATH,"%s",directory);
+}
+
+//cacheEnabled: Whether the cache keeps anything at all
+int cacheEnabled(Cache* cache){
+    return cache->capacity>0||cache->directory[0];
+}
+
+static void diskPath(Cache* cache,const char* key,char* path,size_t size){
+    snprintf(path,size,"%s/%016llx%s",cache->directory,(unsigned long long)hashBytes(key,strlen(key)),CACHE_SUFFIX);
+}
+
+//evict: Drops least recently used entries until extra more bytes fit in the memory budget
+static void evict(Cache* cache,size_t extra){
+    while (cache->stats.entries>0&&(cache->stats.bytes+extra>cache->capacity||cache->stats.entries==MAX_CACHE_ENTRIES)){
+        int oldest=-1;
+        for (int i=0;i<MAX_CACHE_ENTRIES;i++)
+            if (cache->entries[i].data&&(oldest<0||cache->entries[i].used<cache->entries[oldest].used)) oldest=i;
+        cache->stats.bytes-=cache->entries[oldest].length;
+        cache->stats.entries--;
+        cache->stats.evictions++;
+        free(cache->entries[oldest].key);
+        free(cache->entries[oldest].data);
+        memset(&cache->entries[oldest],0,sizeof(CacheEntry));
+    }
+}
+
+//keepMemory: Takes data, allocated with malloc, into memory, unless it is larger than the whole budget
+//Returns: 0 if the cache now owns data, -1 if it was not kept and still belongs to the caller
+static int keepMemory(Cache* cache,const char* key,unsigned char* data,size_t length){
+    if (!cache->capacity||length>cache->capacity) return -1;
+    evict(cache,length);
+    for (int i=0;i<MAX_CACHE_ENTRIES;i++){
+        if (cache->entries[i].data) continue;
+        CacheEntry* entry=&cache->entries[i];
+        entry->key=strdup(key);
+        if (!entry->key) return -1;
+        entry->data=data;
+        entry->length=length;
+        entry->used=++cache->clock;
+        cache->stats.bytes+=length;
+        cache->stats.entries++;
+        return 0;
+    }
+    return -1;
+}
+
+//storeMemory: Puts a copy of data in memory, unless it is larger than the whole budget
+static void storeMemory(Cache* cache,const char* key,const unsigned char* data,size_t length){
+    if (!cache->capacity||length>cache->capacity) return;
+    unsigned char* copy=malloc(length?length:1);
+    if (!copy) return;
+    memcpy(copy,data,length);
+    if (keepMemory(cache,key,copy,length)) free(copy);
+}
+
+//readDisk: Reads an entry back from the cache directory
+//Returns: The bytes, to be freed by the caller, or NULL if there is no entry for key
+static unsigned char* readDisk(Cache* cache,const char* key,size_t* length){
+    char path[MAX_CACHE_PATH+64];
+    size_t keyLength=strlen(key);
+    char* stored=malloc(keyLength+2);
+    unsigned char* data=NULL;
+    diskPath(cache,key,path,sizeof(path));
+    FILE* file=fopen(path,"rb");
+    if (!file||!stored){
+        if (file) fclose(file);
+        free(stored);
+        return NULL;
+    }
+    //the first line must be exactly the key, or this is a different key with the same hash
+    if (fread(stored,1,keyLength+1,file)==keyLength+1&&!memcmp(stored,key,keyLength)&&stored[keyLength]=='\n'){
+        long start=ftell(file);
+        fseek(file,0,SEEK_END);
+        long end=ftell(file);
+        fseek(file,start,SEEK_SET);
+        *length=end-start;
+        data=malloc(*length?*length:1);
+        if (data&&fread(data,1,*length,file)!=*length){
+            free(data);
+            data=NULL;
+        }
+    }
+    fclose(file);
+    free(stored);
+    //touching the file keeps it from being the first to go when the directory is trimmed
+    if (data) utime(path,NULL);
+    return data;
+}
+
+//A file in the cache directory, while trimming it
+typedef struct{
+    char name[256];
+    time_t modified;
+    size_t size;
+} DiskEntry;
+
+static int compareModified(const void* a,const void* b){
+    time_t x=((const DiskEntry*)a)->modified,y=((const DiskEntry*)b)->modified;
+    return x<y?-1:x>y;
+}
+
+//trimDisk: Deletes the least recently used files until the directory is within its budget
+static void trimDisk(Cache* cache){
+    DiskEntry* files=NULL;
+    int count=0,allocated=0;
+    size_t total=0;
+    char path[MAX_CACHE_PATH+300];
+    struct dirent* item;
+    struct stat info;
+    DIR* directory=opendir(cache->directory);
+    if (!directory) return;
+    while ((item=readdir(directory))){
+        size_t length=strlen(item->d_name);
+        if (length<strlen(CACHE_SUFFIX)||length>=sizeof(files->name)||strcmp(item->d_name+length-strlen(CACHE_SUFFIX),CACHE_SUFFIX)) continue;
+        snprintf(path,sizeof(path),"%s/%s",cache->directory,item->d_name);
+        if (stat(path,&info)) continue;
+        if (count==allocated){
+            DiskEntry* grown=realloc(files,sizeof(DiskEntry)*(allocated=allocated?allocated*2:64));
+            if (!grown) break;
+            files=grown;
+        }
+        strcpy(files[count].name,item->d_name);
+        files[count].modified=info.st_mtime;
+        files[count].size=info.st_size;
+        total+=info.st_size;
+        count++;
+    }
+    closedir(directory);
+    qsort(files,count,sizeof(DiskEntry),compareModified);
+    for (int i=0;i<count&&total>cache->diskCapacity;i++){
+        snprintf(path,sizeof(path),"%s/%s",cache->directory,files[i].name);
+        if (unlink(path)==0) total-=files[i].size;
+    }
+    free(files);
+}
+
+//writeDisk: Writes an entry to the cache directory.  It is written under a temporary name first so a reader never sees half of it.
+static void writeDisk(Cache* cache,const char* key,const unsigned char* data,size_t length){
+    char path[MAX_CACHE_PATH+64],temporary[MAX_CACHE_PATH+80];
+    diskPath(cache,key,path,sizeof(path));
+    snprintf(temporary,sizeof(temporary),"%s.%d",path,(int)getpid());
+    FILE* file=fopen(temporary,"wb");
+    if (!file) return;
+    int ok=fprintf(file,"%s\n",key)>0&&fwrite(data,1,length,file)==length;
+    if (fclose(file)||!ok||rename(temporary,path)){
+        unlink(temporary);
+        return;
+    }
+    if (cache->diskCapacity) trimDisk(cache);
+}
+
+//cacheLookup: Finds the bytes stored under key, in memory first and then on disk
+//Parameters: cache: The cache
+//            key: The full key
+//            length: Receives the number of bytes
+//Returns: The bytes, valid until the next cacheLookup, cacheStore or cacheAdopt on this cache, or NULL on a miss
+const unsigned char* cacheLookup(Cache* cache,const char* key,size_t* length){
+    free(cache->spare);
+    cache->spare=NULL;
+    for (int i=0;i<MAX_CACHE_ENTRIES;i++){
+        CacheEntry* entry=&cache->entries[i];
+        if (entry->data&&!strcmp(entry->key,key)){
+            entry->used=++cache->clock;
+            cache->stats.hits++;
+            *length=entry->length;
+            return entry->data;
+        }
+    }
+    if (cache->directory[0]){
+        unsigned char* data=readDisk(cache,key,length);
+        if (data){
+            cache->stats.diskHits++;
+            if (keepMemory(cache,key,data,*length)) cache->spare=data;
+            return data;
+        }
+    }
+    cache->stats.misses++;
+    return NULL;
+}
+
+//cacheStore: Keeps a copy of data under key, in memory when it fits the budget and on disk when a directory is set
+void cacheStore(Cache* cache,const char* key,const unsigned char* data,size_t length){
+    if (cache->capacity) storeMemory(cache,key,data,length);
+    if (cache->directory[0]) writeDisk(cache,key,data,length);
+}
+
+//cacheAdopt: Keeps data in memory without copying it.  Nothing is written to disk.
+//Parameters: data: Allocated with malloc.  When it is kept it belongs to the cache and stays valid until the next cacheLookup, cacheStore or cacheAdopt.
+//Returns: 0 if the cache kept data, -1 if it is over the budget and still belongs to the caller
+int cacheAdopt(Cache* cache,const char* key,unsigned char* data,size_t length){
+    return keepMemory(cache,key,data,length);
+}
+
+//resultCacheKey: Builds the resultCache key for a source file and the request that decides its output.
+//The engine, thread count and tile size are left out since every one of them produces the same pixels.
+//Parameters: hash,length: hashBytes of the source file's bytes, and their number
+//            stages: pipelineHash of the parsed spec, so a kernel redefined since the result was stored does not match it
+void resultCacheKey(char* key,size_t size,uint64_t hash,size_t length,const char* spec,uint64_t stages,int linear,const char* format){
+    snprintf(key,size,"%016llx-%zu %s %016llx %d %s",(unsigned long long)hash,length,spec,(unsigned long long)stages,linear,format);
+}
+
+//printCacheStats: Formats the statistics of a cache as one line of text
+void printCacheStats(char* out,size_t size,const char* name,Cache* cache){
+    CacheStats* stats=&cache->stats;
+    long long lookups=stats->hits+stats->diskHits+stats->misses;
+    snprintf(out,size,"%s cache: %lld hits, %lld disk hits, %lld misses (%.1f%% hit rate), %lld evictions, %d entries, %.1f of %.1f MB\n",
+        name,stats->hits,stats->diskHits,stats->misses,lookups?100.0*(stats->hits+stats->diskHits)/lookups:0.0,
+        stats->evictions,stats->entries,stats->bytes/1048576.0,cache->capacity/1048576.0);
+}
@@ -0,0 +1,49 @@
+#ifndef ___CACHE
+#define ___CACHE
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_CACHE_ENTRIES 1024
+#define MAX_CACHE_PATH 1024
+
+//Hit and miss counts of one cache
+typedef struct{
+    long long hits;         //found in memory
+    long long diskHits;     //found on disk and brought back into memory
+    long long misses;
+    long long evictions;    //entries dropped from memory to stay under the capacity
+    size_t bytes;           //held in memory now
+    int entries;
+} CacheStats;
+
+typedef struct{
+    char* key;
+    unsigned char* data;
+    size_t length;
+    long long used;         //the cache clock when the entry was last stored or found, for LRU eviction
+} CacheEntry;
+
+//A least recently used cache of byte strings by text key, held in memory and, when a directory is set, also on disk
+typedef struct{
+    CacheEntry entries[MAX_CACHE_ENTRIES];
+    size_t capacity;                    //memory budget in bytes, 0 disables the cache
+    char directory[MAX_CACHE_PATH];     //empty for no disk cache
+    size_t diskCapacity;                //disk budget in bytes, 0 for no limit
+    long long clock;
+    unsigned char* spare;               //a disk hit too large to keep in memory, held until the next lookup
+    CacheStats stats;
+} Cache;
+
+//cache.c
+extern Cache resultCache;
+extern Cache imageCache;
+uint64_t hashBytes(const void* data,size_t length);
+void cacheConfigure(Cache* cache,size_t capacity,const char* directory,size_t diskCapacity);
+int cacheEnabled(Cache* cache);
+const unsigned char* cacheLookup(Cache* cache,const char* key,size_t* length);
+void cacheStore(Cache* cache,const char* key,const unsigned char* data,size_t length);
+int cacheAdopt(Cache* cache,const char* key,unsigned char* data,size_t length);
+void resultCacheKey(char* key,size_t size,uint64_t hash,size_t length,const char* spec,uint64_t stages,int linear,const char* format);
+void printCacheStats(char* out,size_t size,const char* name,Cache* cache);
+
+#endif
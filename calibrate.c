@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+#include "calibrate.h"
+#include "timer.h"
+
+//STREAM style arrays must be far larger than the last level cache.  Three of these are 384MB.
+#define STREAM_ELEMENTS (1<<24)
+#define STREAM_RUNS 5
+//Independent accumulators per thread, enough to hide the multiply-add latency and fill the vector units
+#define FLOP_CHAINS 32
+#define FLOP_ITERATIONS 20000000
+
+//streamCopy: Best of STREAM_RUNS of c[i]=a[i]
+static double streamCopy(double* a,double* c,int threads){
+    double best=0;
+    for (int run=0;run<STREAM_RUNS;run++){
+        long long start=nowNanos();
+        #pragma omp parallel for num_threads(threads)
+        for (long i=0;i<STREAM_ELEMENTS;i++) c[i]=a[i];
+        double rate=16.0*STREAM_ELEMENTS/(nowNanos()-start);
+        if (rate>best) best=rate;
+    }
+    return best;
+}
+
+//streamTriad: Best of STREAM_RUNS of a[i]=b[i]+s*c[i]
+static double streamTriad(double* a,double* b,double* c,int threads){
+    double best=0,scalar=3.0;
+    for (int run=0;run<STREAM_RUNS;run++){
+        long long start=nowNanos();
+        #pragma omp parallel for num_threads(threads)
+        for (long i=0;i<STREAM_ELEMENTS;i++) a[i]=b[i]+scalar*c[i];
+        double rate=24.0*STREAM_ELEMENTS/(nowNanos()-start);
+        if (rate>best) best=rate;
+    }
+    return best;
+}
+
+//peakFlops: Every thread runs FLOP_CHAINS independent x=x*a+b chains
+static double peakFlops(int threads){
+    double sink=0;
+    long long start=nowNanos();
+    #pragma omp parallel num_threads(threads) reduction(+:sink)
+    {
+        double chains[FLOP_CHAINS];
+        //a and b keep the chains bounded, so the values never become denormal or infinite
+        double a=0.999999,b=1e-6;
+        for (int j=0;j<FLOP_CHAINS;j++) chains[j]=j;
+        for (long i=0;i<FLOP_ITERATIONS/FLOP_CHAINS;i++)
+            for (int j=0;j<FLOP_CHAINS;j++) chains[j]=chains[j]*a+b;
+        for (int j=0;j<FLOP_CHAINS;j++) sink+=chains[j];
+    }
+    double seconds=(nowNanos()-start)/1e9;
+    //the sink is printed nowhere, but using it stops the compiler from removing the loop
+    if (sink==42) printf(" ");
+    double updates=(double)(FLOP_ITERATIONS/FLOP_CHAINS)*FLOP_CHAINS*threads;
+    return 2.0*updates/seconds/1e9;
+}
+
+//calibrateMachine: Measures reachable memory bandwidth and arithmetic rate with the given number of threads
+//Parameters: machine: Receives the results and the host name
+//            threads: The number of threads to measure with
+//Returns: Nothing.  Bandwidths are 0 if the arrays could not be allocated.
+void calibrateMachine(Machine* machine,int threads){
+    memset(machine,0,sizeof(Machine));
+    gethostname(machine->host,sizeof(machine->host)-1);
+    machine->threads=threads;
+    double* a=malloc(sizeof(double)*STREAM_ELEMENTS);
+    double* b=malloc(sizeof(double)*STREAM_ELEMENTS);
+    double* c=malloc(sizeof(double)*STREAM_ELEMENTS);
+    if (a&&b&&c){
+        //first touch from the same threads that will run the loops
+        #pragma omp parallel for num_threads(threads)
+        for (long i=0;i<STREAM_ELEMENTS;i++){ a[i]=1; b[i]=2; c[i]=0; }
+        machine->copyGBs=streamCopy(a,c,threads);
+        machine->triadGBs=streamTriad(a,b,c,threads);
+    }
+    free(a);
+    free(b);
+    free(c);
+    machine->peakGflops=peakFlops(threads);
+}
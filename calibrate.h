@@ -0,0 +1,16 @@
+#ifndef ___CALIBRATE
+#define ___CALIBRATE
+
+//What the machine can reach, measured by calibrateMachine
+typedef struct{
+    char host[64];
+    int threads;
+    double copyGBs;         //STREAM copy, counting 16 bytes per element
+    double triadGBs;        //STREAM triad, counting 24 bytes per element
+    double peakGflops;      //independent multiply-add chains, counting 2 flops each
+} Machine;
+
+//calibrate.c
+void calibrateMachine(Machine* machine,int threads);
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdint.h>
+#include <math.h>
+#include "image.h"
+#include "pipeline.h"
+
+//Linear light.  JPEG and PNG files hold sRGB encoded samples, whose values grow with perceived brightness rather than with the
+//amount of light, so averaging them (as every blur does) comes out too dark wherever light and dark pixels meet.
+//linearizeImage decodes a picture to linear light on a 0..65535 scale through a lookup table, the pipeline runs on 16 bit or float
+//samples, and encodeImage goes back to sRGB through a second table.  Alpha is not gamma encoded, so it is only rescaled.
+//Premultiplied alpha.  Convoluting the colour of an image with alpha as it is stored lets the colour of transparent pixels, which
+//is never seen, bleed into its neighbours as a halo.  premultiplyImage scales the colour by alpha first, so transparent pixels
+//contribute nothing, and unpremultiplyImage divides it back out through a table of reciprocals.
+//Luma.  lumaImage reduces a colour image to one channel, so edge detection and the like convolute a third of the samples.
+
+//The 16 bit linear value of each 8 bit sRGB sample, exact and rounded
+static float decode8[256];
+static uint16_t decode8Rounded[256];
+//The 16 bit value of each 8 bit alpha sample
+static uint16_t alpha8[256];
+//The 16 bit linear value of each 16 bit sRGB sample, built the first time a 16 bit image is decoded
+static float decode16[65536];
+//The 8 bit sRGB sample of each 16 bit linear value, rounded
+static uint8_t encode8[65536];
+//65535/alpha for each 16 bit alpha, in 16.16 fixed point, built the first time an image is unpremultiplied
+static uint32_t reciprocal[65536];
+static int ready8=0,ready16=0,readyReciprocal=0;
+
+//toLinear: The sRGB decoding curve, for values in 0..1
+static double toLinear(double value){
+    return value<=0.04045?value/12.92:pow((value+0.055)/1.055,2.4);
+}
+
+//toSrgb: The sRGB encoding curve, for values in 0..1
+static double toSrgb(double value){
+    return value<=0.0031308?value*12.92:1.055*pow(value,1/2.4)-0.055;
+}
+
+//buildTables: Fills the 8 bit tables.  They are small enough to build the first time they are needed.
+static void buildTables(){
+    for (int i=0;i<256;i++){
+        decode8[i]=(float)(65535*toLinear(i/255.0));
+        decode8Rounded[i]=(uint16_t)(decode8[i]+0.5f);
+        alpha8[i]=i*257;
+    }
+    for (int i=0;i<65536;i++) encode8[i]=(uint8_t)(255*toSrgb(i/65535.0)+0.5);
+    ready8=1;
+}
+
+//isAlpha: Whether a channel is the alpha of a grey+alpha or RGBA image
+static inline int isAlpha(int bit,int bpp){
+    return (bpp==2||bpp==4)&&bit==bpp-1;
+}
+
+//The common case, 8 bit sRGB to and from 16 bit linear light, is a table lookup per sample with nothing else in the loop
+
+//linearize8: linearizeImage for an 8 bit source and a 16 bit destination
+static void linearize8(Image* srcImage,Image* destImage){
+    size_t count=(size_t)srcImage->width*srcImage->height*srcImage->bpp;
+    const uint16_t* tables[4];
+    uint16_t* out=(uint16_t*)destImage->data;
+    int bpp=srcImage->bpp;
+    for (int bit=0;bit<bpp;bit++) tables[bit]=isAlpha(bit,bpp)?alpha8:decode8Rounded;
+    for (size_t i=0;i<count;i+=bpp)
+        for (int bit=0;bit<bpp;bit++) out[i+bit]=tables[bit][srcImage->data[i+bit]];
+}
+
+//encode16To8: encodeImage for a 16 bit source and an 8 bit destination
+static void encode16To8(Image* srcImage,Image* destImage){
+    size_t count=(size_t)srcImage->width*srcImage->height*srcImage->bpp;
+    const uint16_t* in=(const uint16_t*)srcImage->data;
+    int bpp=srcImage->bpp,alpha=bpp==2||bpp==4?bpp-1:bpp;
+    for (size_t i=0;i<count;i+=bpp){
+        for (int bit=0;bit<alpha;bit++) destImage->data[i+bit]=encode8[in[i+bit]];
+        //rounds v/257 to the nearest integer
+        if (alpha<bpp) destImage->data[i+alpha]=(in[i+alpha]+128)/257;
+    }
+}
+
+//linearizeImage: Decodes an sRGB image to linear light
+//Parameters: srcImage: An 8 or 16 bit sRGB image
+//            destImage: A pre-allocated 16 bit or float image of the same size.  Samples are on a 0..65535 scale either way.
+void linearizeImage(Image* srcImage,Image* destImage){
+    size_t count=(size_t)srcImage->width*srcImage->height;
+    int bpp=srcImage->bpp;
+    if (!ready8) buildTables();
+    if (srcImage->type==SAMPLE_U16&&!ready16){
+        for (int i=0;i<65536;i++) decode16[i]=(float)(65535*toLinear(i/65535.0));
+        ready16=1;
+    }
+    if (srcImage->type==SAMPLE_U8&&destImage->type==SAMPLE_U16){
+        linearize8(srcImage,destImage);
+        return;
+    }
+    for (size_t p=0;p<count;p++){
+        for (int bit=0;bit<bpp;bit++){
+            size_t i=p*bpp+bit;
+            float value;
+            if (srcImage->type==SAMPLE_U16){
+                uint16_t sample=((uint16_t*)srcImage->data)[i];
+                value=isAlpha(bit,bpp)?sample:decode16[sample];
+            }
+            else value=isAlpha(bit,bpp)?srcImage->data[i]*257.0f:decode8[srcImage->data[i]];
+            if (destImage->type==SAMPLE_FLOAT) ((float*)destImage->data)[i]=value;
+            else ((uint16_t*)destImage->data)[i]=(uint16_t)(value+0.5f);
+        }
+    }
+}
+
+//encodeImage: Encodes a linear light image back to sRGB, rounding to the nearest sample and clamping values a sharpening or
+//             edge kernel pushed out of range
+//Parameters: srcImage: A 16 bit or float image from linearizeImage (or a pipeline run on one)
+//            destImage: A pre-allocated 8 or 16 bit image of the same size
+void encodeImage(Image* srcImage,Image* destImage){
+    size_t count=(size_t)srcImage->width*srcImage->height;
+    int bpp=srcImage->bpp;
+    if (!ready8) buildTables();
+    if (srcImage->type==SAMPLE_U16&&destImage->type==SAMPLE_U8){
+        encode16To8(srcImage,destImage);
+        return;
+    }
+    for (size_t p=0;p<count;p++){
+        for (int bit=0;bit<bpp;bit++){
+            size_t i=p*bpp+bit;
+            float value=srcImage->type==SAMPLE_FLOAT?((float*)srcImage->data)[i]:((uint16_t*)srcImage->data)[i];
+            value=value<=0?0:value>=65535?65535:value;
+            if (destImage->type==SAMPLE_U16)
+                ((uint16_t*)destImage->data)[i]=(uint16_t)(isAlpha(bit,bpp)?value+0.5f:65535*toSrgb(value/65535.0)+0.5);
+            else destImage->data[i]=isAlpha(bit,bpp)?(uint8_t)(value/257+0.5f):encode8[(int)(value+0.5f)];
+        }
+    }
+}
+
+//premultiplyImage: Multiplies the colour channels of an image with alpha by its alpha, in place
+//Parameters: image: A 16 bit or float image, ie. from linearizeImage or convertImage.  Images without alpha are left alone.
+//            opaque: The alpha of an opaque pixel of a float image: 65535 in linear light, 255 for a float copy of an 8 bit image.
+//                    16 bit images always use 65535.
+void premultiplyImage(Image* image,float opaque){
+    size_t count=(size_t)image->width*image->height;
+    int bpp=image->bpp;
+    if (bpp!=2&&bpp!=4) return;
+    for (size_t p=0;p<count;p++){
+        size_t i=p*bpp;
+        if (image->type==SAMPLE_FLOAT){
+            float* pixel=(float*)image->data+i;
+            for (int bit=0;bit<bpp-1;bit++) pixel[bit]*=pixel[bpp-1]/opaque;
+        }
+        else{
+            uint16_t* pixel=(uint16_t*)image->data+i;
+            for (int bit=0;bit<bpp-1;bit++) pixel[bit]=((uint32_t)pixel[bit]*pixel[bpp-1]+32767)/65535;
+        }
+    }
+}
+
+//unpremultiplyImage: Divides the colour channels of a premultiplied image by its alpha, in place.  Fully transparent pixels become
+//                    black, and in 16 bit images colour a kernel pushed above alpha is clamped.
+//Parameters: image: A 16 bit or float image from premultiplyImage (or a pipeline run on one)
+//            opaque: As premultiplyImage
+void unpremultiplyImage(Image* image,float opaque){
+    size_t count=(size_t)image->width*image->height;
+    int bpp=image->bpp;
+    if (bpp!=2&&bpp!=4) return;
+    if (!readyReciprocal){
+        reciprocal[0]=0;
+        for (uint32_t a=1;a<65536;a++) reciprocal[a]=(uint32_t)((65535ULL*65536+a/2)/a);
+        readyReciprocal=1;
+    }
+    for (size_t p=0;p<count;p++){
+        size_t i=p*bpp;
+        if (image->type==SAMPLE_FLOAT){
+            float* pixel=(float*)image->data+i;
+            float alpha=pixel[bpp-1];
+            for (int bit=0;bit<bpp-1;bit++) pixel[bit]=alpha<=0?0:pixel[bit]*opaque/alpha;
+        }
+        else{
+            uint16_t* pixel=(uint16_t*)image->data+i;
+            uint64_t scale=reciprocal[pixel[bpp-1]];
+            for (int bit=0;bit<bpp-1;bit++){
+                uint64_t value=(pixel[bit]*scale+32768)>>16;
+                pixel[bit]=value>65535?65535:value;
+            }
+        }
+    }
+}
+
+//lumaImage: Converts an image to one channel of luma, Y=(77R+150G+29B)/256, the weights stb_image uses when it is asked for one
+//           channel, so converting after decoding gives what decoding to one channel gives.  Grey images keep their grey, and alpha is dropped.
+//Parameters: srcImage: An 8 or 16 bit image
+//            destImage: A pre-allocated one channel image of the same size and type
+void lumaImage(Image* srcImage,Image* destImage){
+    size_t count=(size_t)srcImage->width*srcImage->height;
+    int bpp=srcImage->bpp;
+    if (srcImage->type==SAMPLE_U16){
+        const uint16_t* in=(const uint16_t*)srcImage->data;
+        uint16_t* out=(uint16_t*)destImage->data;
+        if (bpp<3) for (size_t p=0;p<count;p++) out[p]=in[p*bpp];
+        else for (size_t p=0;p<count;p++) out[p]=(77*in[p*bpp]+150*in[p*bpp+1]+29*in[p*bpp+2])>>8;
+        return;
+    }
+    const uint8_t* in=srcImage->data;
+    if (bpp<3) for (size_t p=0;p<count;p++) destImage->data[p]=in[p*bpp];
+    else for (size_t p=0;p<count;p++) destImage->data[p]=(77*in[p*bpp]+150*in[p*bpp+1]+29*in[p*bpp+2])>>8;
+}
+
+//blurPipeline: Whether every stage of a pipeline is a blur, a kernel with no negative coefficients that is not the identity (nor a
+//              fused operator or a filter without coefficients, see linearKernel), or the Gaussian.
+//              These are the kernels that average neighbouring pixels, which is what linear light changes the most.
+int blurPipeline(Pipeline* pipeline){
+    if (!pipeline->count) return 0;
+    for (int s=0;s<pipeline->count;s++){
+        Kernel* kernel=pipeline->stages[s];
+        if (kernel->gaussian) continue;
+        if (kernel->identity||!linearKernel(kernel)) return 0;
+        for (int i=0;i<kernel->size;i++)
+            for (int j=0;j<kernel->size;j++)
+                if (kernel->coef[i][j]<0) return 0;
+    }
+    return 1;
+}
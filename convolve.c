@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+//The tile size used by convoluteRows.  0 means the full width (or the full range of rows).
+static int tileWidth=0,tileHeight=0;
+//The rows the integer separable path filters at a time when the rows are not tiled, as many as an engine task holds
+#define STRIP_ROWS 32
+//The number of threads the parallel engines should use.  0 means the engine's own default.
+static int threadCount=0;
+//Whether the alpha channel of 2 and 4 channel images is copied instead of convoluted
+static int skipAlpha=0;
+//Set when a path could not allocate its scratch memory and left its rectangle unwritten, see noteOutOfMemory
+static int outOfMemory=0;
+//The value of full scale in float images: 255 when they come from 8 bit ones, 65535 from 16 bit or linear light ones
+static float floatRange=255;
+
+//getPixelValue - Computes the value of a specific pixel on a specific channel using the selected convolution kernel
+//Paramters: srcImage:  An Image struct populated with the image being convoluted
+//           x: The x coordinate of the pixel
+//          y: The y coordinate of the pixel
+//          bit: The color channel being manipulated
+//          kernel: The kernel to use for the convolution
+//Returns: The new value for this x,y pixel and bit channel
+uint8_t getPixelValue(Image* srcImage,int x,int y,int bit,Kernel* kernel){
+    int i,j,r=kernel->size/2;
+    double sum=0;
+    for (i=0;i<kernel->size;i++){
+        int sy=clampIndex(y+i-r,srcImage->height);
+        for (j=0;j<kernel->size;j++){
+            int sx=clampIndex(x+j-r,srcImage->width);
+            sum+=kernel->coef[i][j]*srcImage->data[Index(sx,sy,srcImage->width,bit,srcImage->bpp)];
+        }
+    }
+    //the sum is truncated and then wrapped into 8 bits
+    return (uint8_t)(int)sum;
+}
+
+//integerPixelValue: Same as getPixelValue for integerExact kernels, using the scaled integer coefficients.  The sum is exact, so the result is identical.
+static inline uint8_t integerPixelValue(Image* srcImage,int x,int y,int bit,Kernel* kernel){
+    int i,j,r=kernel->size/2,sum=0;
+    for (i=0;i<kernel->size;i++){
+        int sy=clampIndex(y+i-r,srcImage->height);
+        for (j=0;j<kernel->size;j++){
+            int sx=clampIndex(x+j-r,srcImage->width);
+            sum+=kernel->icoef[i][j]*srcImage->data[Index(sx,sy,srcImage->width,bit,srcImage->bpp)];
+        }
+    }
+    return (uint8_t)(sum/(1<<kernel->shift));
+}
+
+//convoluteSeparable: Two pass integer convolution of the rectangle [x0,x1)x[y0,y1) for intSeparable kernels.  The horizontal pass
+//                    covers the tile plus its halo of kernel radius rows above and below, each computed once, into the scratch buffer rows.
+static void convoluteSeparable(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1,int* rows){
+    int row,pix,bit,i,r=kernel->size/2,bpp=srcImage->bpp,channels=colourChannels(srcImage);
+    int span=(x1-x0)*bpp;
+    int firstRow=clampIndex(y0-r,srcImage->height);
+    int lastRow=clampIndex(y1-1+r,srcImage->height);
+    for (row=firstRow;row<=lastRow;row++){
+        int* out=rows+(row-firstRow)*span;
+        for (pix=x0;pix<x1;pix++){
+            for (bit=0;bit<channels;bit++){
+                int sum=0;
+                for (i=0;i<kernel->size;i++)
+                    sum+=kernel->irow[i]*srcImage->data[Index(clampIndex(pix+i-r,srcImage->width),row,srcImage->width,bit,bpp)];
+                out[(pix-x0)*bpp+bit]=sum;
+            }
+        }
+    }
+    for (row=y0;row<y1;row++){
+        uint8_t* out=destImage->data+(row*srcImage->width+x0)*bpp;
+        for (pix=0;pix<span;pix++){
+            int sum=0;
+            if (channels<bpp&&pix%bpp==channels) continue;
+            for (i=0;i<kernel->size;i++)
+                sum+=kernel->icol[i]*rows[(clampIndex(row+i-r,srcImage->height)-firstRow)*span+pix];
+            out[pix]=(uint8_t)(sum/(1<<kernel->shift));
+        }
+    }
+}
+
+//convoluteSeparable16: convoluteSeparable for 16 bit images.  The result is rounded and saturated like storeSample, which gives exactly
+//                      what convoluteWide gives, without converting every sample to a float and back.  As in convoluteWide, each
+//                      source row is padded by the kernel radius and filtered horizontally once, into a ring of kernel size rows,
+//                      so every tap is a multiply-add over a contiguous span of ints.
+//                      scratch holds the ring, then one padded source row, then one output row.
+static void convoluteSeparable16(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1,int* scratch){
+    int row,n,i,r=kernel->size/2,bpp=srcImage->bpp;
+    int span=(x1-x0)*bpp,half=(1<<kernel->shift)>>1;
+    int ringRow[MAX_KERNEL_SIZE];
+    int* line=scratch+kernel->size*span;
+    int* sum=line+span+2*r*bpp;
+    const uint16_t* in=(const uint16_t*)srcImage->data;
+    for (i=0;i<kernel->size;i++) ringRow[i]=INT32_MIN;
+    for (row=y0;row<y1;row++){
+        for (n=0;n<span;n++) sum[n]=0;
+        for (i=0;i<kernel->size;i++){
+            int y=row+i-r,slot=((y%kernel->size)+kernel->size)%kernel->size;
+            int* filtered=scratch+slot*span;
+            if (ringRow[slot]!=y){
+                const uint16_t* source=in+(size_t)clampIndex(y,srcImage->height)*srcImage->width*bpp;
+                //only the columns past the border need clamping
+                int left=x0-r<0?r-x0:0,right=x1+r>srcImage->width?x1+r-srcImage->width:0;
+                for (n=left*bpp;n<(x1-x0+2*r-right)*bpp;n++) line[n]=source[(x0-r)*bpp+n];
+                for (int x=x0-r;x<x0-r+left;x++)
+                    for (int bit=0;bit<bpp;bit++) line[(x-x0+r)*bpp+bit]=source[bit];
+                for (int x=x1+r-right;x<x1+r;x++)
+                    for (int bit=0;bit<bpp;bit++) line[(x-x0+r)*bpp+bit]=source[(srcImage->width-1)*bpp+bit];
+                for (n=0;n<span;n++) filtered[n]=0;
+                for (int j=0;j<kernel->size;j++){
+                    int c=kernel->irow[j];
+                    const int* tap=line+j*bpp;
+                    for (n=0;n<span;n++) filtered[n]+=c*tap[n];
+                }
+                ringRow[slot]=y;
+            }
+            int c=kernel->icol[i];
+            for (n=0;n<span;n++) sum[n]+=c*filtered[n];
+        }
+        uint16_t* out=(uint16_t*)destImage->data+((size_t)row*srcImage->width+x0)*bpp;
+        for (n=0;n<span;n++){
+            int value=sum[n]<=0?0:(sum[n]+half)>>kernel->shift;
+            out[n]=value>65535?65535:value;
+        }
+    }
+}
+
+//fitsInt16: Whether the integer sums of a kernel over 16 bit samples fit in an int
+static int fitsInt16(Kernel* kernel){
+    long long rowSum=0,colSum=0;
+    for (int i=0;i<kernel->size;i++){
+        rowSum+=abs(kernel->irow[i]);
+        colSum+=abs(kernel->icol[i]);
+    }
+    return rowSum*colSum*65535<=INT32_MAX;
+}
+
+//convoluteRect: Applies a kernel to the rectangle [x0,x1)x[y0,y1) using the direct integer or floating point path
+static void convoluteRect(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1){
+    int row,pix,bit,channels=colourChannels(srcImage);
+    for (row=y0;row<y1;row++){
+        for (pix=x0;pix<x1;pix++){
+            for (bit=0;bit<channels;bit++){
+                destImage->data[Index(pix,row,srcImage->width,bit,srcImage->bpp)]=kernel->integerExact?
+                    integerPixelValue(srcImage,pix,row,bit,kernel):
+                    getPixelValue(srcImage,pix,row,bit,kernel);
+            }
+        }
+    }
+}
+
+//loadRow: Converts source row y, columns [x0-r,x1+r) with the edge pixels repeated past the border, into floats
+static void loadRow(Image* srcImage,int y,int x0,int x1,int r,float* out){
+    int bpp=srcImage->bpp;
+    for (int x=x0-r;x<x1+r;x++){
+        size_t in=((size_t)y*srcImage->width+clampIndex(x,srcImage->width))*bpp;
+        for (int bit=0;bit<bpp;bit++) out[(x-x0+r)*bpp+bit]=loadSample(srcImage,in+bit);
+    }
+}
+
+//convoluteWide: Convolution of the rectangle [x0,x1)x[y0,y1) for 16 bit and float images.
+//Each source row is converted to floats once, padded by the kernel radius on both sides, into a ring of kernel size rows.
+//Every tap is then a multiply-add over a contiguous span of floats with no border checks, which the compiler vectorizes.
+static void convoluteWide(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1){
+    int i,j,n,row,r=kernel->size/2,bpp=srcImage->bpp;
+    int span=(x1-x0)*bpp,padded=(x1-x0+2*r)*bpp;
+    int ringRow[MAX_KERNEL_SIZE];
+    float* ring=malloc(sizeof(float)*padded*kernel->size);
+    float* sum=malloc(sizeof(float)*span);
+    if (!ring||!sum){
+        free(ring);
+        free(sum);
+        noteOutOfMemory();
+        return;
+    }
+    for (i=0;i<kernel->size;i++) ringRow[i]=INT32_MIN;
+    for (row=y0;row<y1;row++){
+        for (n=0;n<span;n++) sum[n]=0;
+        for (i=0;i<kernel->size;i++){
+            //slots are picked by the unclamped row, so moving down a row loads exactly one new row
+            int y=row+i-r,slot=((y%kernel->size)+kernel->size)%kernel->size;
+            float* in=ring+(size_t)slot*padded;
+            if (ringRow[slot]!=y){
+                loadRow(srcImage,clampIndex(y,srcImage->height),x0,x1,r,in);
+                ringRow[slot]=y;
+            }
+            for (j=0;j<kernel->size;j++){
+                float c=kernel->coef[i][j];
+                if (c==0) continue;
+                const float* tap=in+j*bpp;
+                for (n=0;n<span;n++) sum[n]+=c*tap[n];
+            }
+        }
+        size_t out=((size_t)row*srcImage->width+x0)*bpp;
+        for (n=0;n<span;n++) storeSample(destImage,out+n,sum[n]);
+    }
+    free(ring);
+    free(sum);
+}
+
+//copyAlpha: Copies the alpha channel of the rectangle [x0,x1)x[y0,y1) from srcImage to destImage, for setSkipAlpha
+static void copyAlpha(Image* srcImage,Image* destImage,int x0,int y0,int x1,int y1){
+    int size=sampleBytes(srcImage),bpp=srcImage->bpp;
+    for (int row=y0;row<y1;row++)
+        for (int pix=x0;pix<x1;pix++){
+            size_t i=(((size_t)row*srcImage->width+pix)*bpp+bpp-1)*size;
+            memcpy(destImage->data+i,srcImage->data+i,size);
+        }
+}
+
+//convertImage: Copies an image into one of another sample type and the same size.  8 and 16 bit samples keep their
+//value when they become floats, so a float image from an 8 bit one holds 0..255.  See storeSample for the way back.
+void convertImage(Image* srcImage,Image* destImage){
+    size_t count=(size_t)srcImage->width*srcImage->height*srcImage->bpp;
+    for (size_t i=0;i<count;i++){
+        float value=loadSample(srcImage,i);
+        //widening and narrowing between 8 and 16 bits scales the range rather than the value
+        if (srcImage->type==SAMPLE_U8&&destImage->type==SAMPLE_U16) value*=257;
+        else if (srcImage->type==SAMPLE_U16&&destImage->type==SAMPLE_U8) value=((const uint16_t*)srcImage->data)[i]>>8;
+        storeSample(destImage,i,value);
+    }
+}
+
+//setTileSize: Sets the tile size used by convoluteRows.  A width or height of 0 means no tiling in that direction.
+void setTileSize(int width,int height){
+    tileWidth=width>0?width:0;
+    tileHeight=height>0?height:0;
+}
+
+//getTileSize: Reads back the tile size set by setTileSize
+void getTileSize(int* width,int* height){
+    *width=tileWidth;
+    *height=tileHeight;
+}
+
+//setThreadCount: Sets the number of threads used by the parallel engines.  0 restores each engine's default.
+void setThreadCount(int count){
+    threadCount=count>0?count:0;
+}
+
+//getThreadCount: Reads back the thread count set by setThreadCount
+int getThreadCount(){
+    return threadCount;
+}
+
+//setSkipAlpha: Sets whether the engines copy the alpha channel of 2 and 4 channel images instead of convoluting it.
+//              When alpha is known to be opaque this saves a quarter of the work on RGBA images.
+void setSkipAlpha(int skip){
+    skipAlpha=skip!=0;
+}
+
+//getSkipAlpha: Reads back the setting made by setSkipAlpha
+int getSkipAlpha(){
+    return skipAlpha;
+}
+
+//setFloatRange: Sets the value of full scale in the float images the engines are given, for the filters that weigh
+//               samples by value rather than position.  convertImage keeps 8 bit values, so its floats are 0..255 from
+//               8 bit images and 0..65535 from 16 bit ones, and linearizeImage always gives 0..65535.
+void setFloatRange(float range){
+    floatRange=range>0?range:255;
+}
+
+//getFloatRange: Reads back the setting made by setFloatRange
+float getFloatRange(){
+    return floatRange;
+}
+
+//noteOutOfMemory: Called by a path that could not allocate its scratch memory and so left its rectangle unwritten.  Any
+//                 thread may call it; runPipeline turns it into its out of memory result.
+void noteOutOfMemory(){
+    __atomic_store_n(&outOfMemory,1,__ATOMIC_RELAXED);
+}
+
+//takeOutOfMemory: Whether noteOutOfMemory was called since the last call, which clears it
+int takeOutOfMemory(){
+    return __atomic_exchange_n(&outOfMemory,0,__ATOMIC_RELAXED);
+}
+
+//colourChannels: The channels of each pixel the convolution paths compute: all of them, or all but the last when alpha is skipped
+int colourChannels(Image* image){
+    return skipAlpha&&(image->bpp==2||image->bpp==4)?image->bpp-1:image->bpp;
+}
+
+//convoluteRegion: Applies a kernel to the rectangle [x0,x1)x[y0,y1) of an image, leaving the rest of destImage as it was.
+//                 The rectangle is walked tile by tile so that the source rows a tile needs stay in cache while they are reused.
+//                 The kernel metadata picks the execution path: the fused loop for operators such as sobel, rankFilter for
+//                 medians, erode and dilate, bilateralFilter, gaussianFilter (which takes the rectangle whole), the compile time
+//                 specialized code for kernels equal to a built in, then integer separable, integer direct, or the floating point reference.
+//Parameters: srcImage: The image being convoluted
+//            destImage: A pointer to a pre-allocated structure the same size as srcImage
+//            kernel: The kernel to use for the convolution
+//            x0,y0,x1,y1: The rectangle to compute
+//Returns: Nothing
+void convoluteRegion(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1){
+    int x,y,stepX,stepY;
+    int* rows=NULL;
+    stepX=tileWidth?tileWidth:x1-x0;
+    stepY=tileHeight?tileHeight:y1-y0;
+    if (stepX>x1-x0) stepX=x1-x0;
+    if (stepX<1||stepY<1) return;
+    //the recursive Gaussian filters whole lines, which tiles would cut short, and copies skipped alpha itself
+    if (kernel->gaussian){
+        gaussianFilter(srcImage,destImage,kernel,x0,y0,x1,y1);
+        return;
+    }
+    int wide=srcImage->type!=SAMPLE_U8;
+    //16 bit images (ie. linear light) keep to integers too when the kernel allows it.  Fused operators have their own loop.
+    int separable16=srcImage->type==SAMPLE_U16&&kernel->intSeparable&&!kernel->fused&&fitsInt16(kernel);
+    RectFunction specialized=kernel->builtin>=0&&!wide?specializedRows[kernel->builtin]:NULL;
+    //the median's histograms are allocated once for every tile of the rectangle
+    size_t histogramSize=kernel->rank?rankScratchSize(srcImage,kernel,stepX):0;
+    uint16_t* histograms=histogramSize?malloc(sizeof(uint16_t)*histogramSize):NULL;
+    if (separable16) rows=malloc(sizeof(int)*srcImage->bpp*(stepX*(kernel->size+2)+kernel->size));
+    else if (kernel->intSeparable&&!specialized&&!wide&&!kernel->fused){
+        //untiled, the rows are still filtered a strip at a time, so the buffer is the size of a strip rather than of the image
+        if (!tileHeight&&stepY>STRIP_ROWS) stepY=STRIP_ROWS;
+        rows=malloc(sizeof(int)*stepX*srcImage->bpp*(stepY+kernel->size-1));
+    }
+    for (y=y0;y<y1;y+=stepY){
+        int yEnd=y+stepY<y1?y+stepY:y1;
+        for (x=x0;x<x1;x+=stepX){
+            int xEnd=x+stepX<x1?x+stepX:x1;
+            if (kernel->fused) convoluteGradients(srcImage,NULL,NULL,kernel->fused==FUSED_MAGNITUDE?destImage:NULL,
+                kernel->fused==FUSED_ANGLE?destImage:NULL,kernel,x,y,xEnd,yEnd);
+            else if (kernel->rank) rankFilter(srcImage,destImage,kernel,x,y,xEnd,yEnd,histograms);
+            else if (kernel->bilateral) bilateralFilter(srcImage,destImage,kernel,x,y,xEnd,yEnd);
+            else if (separable16&&rows) convoluteSeparable16(srcImage,destImage,kernel,x,y,xEnd,yEnd,rows);
+            else if (wide) convoluteWide(srcImage,destImage,kernel,x,y,xEnd,yEnd);
+            else if (specialized) specialized(srcImage,destImage,x,y,xEnd,yEnd);
+            else if (rows) convoluteSeparable(srcImage,destImage,kernel,x,y,xEnd,yEnd,rows);
+            else convoluteRect(srcImage,destImage,kernel,x,y,xEnd,yEnd);
+            //the 8 bit paths leave alpha unwritten and the wide ones, which work on whole interleaved rows, compute it anyway
+            if (colourChannels(srcImage)<srcImage->bpp) copyAlpha(srcImage,destImage,x,y,xEnd,yEnd);
+        }
+    }
+    free(rows);
+    free(histograms);
+}
+
+//convoluteRows:  Applies a kernel to the rows [rowStart,rowEnd) of an image.  This is the work unit shared by all of the engines.
+//Parameters: srcImage: The image being convoluted
+//            destImage: A pointer to a pre-allocated structure the same size as srcImage
+//            kernel: The kernel to use for the convolution
+//            rowStart,rowEnd: The range of rows to compute
+//Returns: Nothing
+void convoluteRows(Image* srcImage,Image* destImage,Kernel* kernel,int rowStart,int rowEnd){
+    convoluteRegion(srcImage,destImage,kernel,0,rowStart,srcImage->width,rowEnd);
+}
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "pipeline.h"
+#include "timer.h"
+#include "profile.h"
+#include "library.h"
+#include "cache.h"
+#include "stb_image.h"
+
+//How --light treats the sRGB encoding of the samples
+enum LightModes{LIGHT_SRGB=0,LIGHT_LINEAR=1,LIGHT_AUTO=2};
+//How --alpha treats the alpha channel of 2 and 4 channel images
+enum AlphaModes{ALPHA_STRAIGHT=0,ALPHA_PREMULTIPLY=1,ALPHA_SKIP=2};
+
+//The command line, after parseOptions has separated the flags from the positional arguments
+typedef struct{
+    char* fileName;
+    char* pipeline;
+    char* kernelFile;
+    int linear;         //--linear: fold consecutive kernels into one before running
+    int report;         //--report: print estimated and measured cost of the staged and fused plans
+    int tileWidth;      //--tile WxH: tile size for the convolution, -1 when not given
+    int tileHeight;
+    int autotune;       //--autotune: time candidate tile sizes and store the best in the tile cache
+    int json;           //--json: print the timings as JSON
+    int threads;        //--threads N: threads for the parallel engines, 0 for the engine default
+    int profile;        //--profile: read the hardware performance counters around the convolution
+    char* serve;        //--serve SOCKET: serve requests on a Unix domain socket, or on stdin and stdout for -
+    char* connect;      //--connect SOCKET: send the image to a server instead of convoluting it here
+    int repeat;         //--repeat N: how many times --connect sends the request
+    char* format;       //--format png|bmp|tga|jpg: the output format asked of the server
+    int stats;          //--stats: with --connect, print the server's cache statistics
+    int cacheMB;        //--cache MB: memory budget of the result cache
+    char* cacheDir;     //--cache-dir DIR: also keep results on disk, in DIR
+    int cacheDiskMB;    //--cache-disk MB: disk budget of the result cache, 0 for no limit
+    int imageCacheMB;   //--image-cache MB: memory budget of the server's decoded image cache
+    int outOfCoreMB;    //--out-of-core MB: process a PGM, PPM or PAM file in bands using about MB megabytes
+    int depth16;        //--depth 16: load 16 bit samples and write 16 bit PGM, PPM or PAM
+    int floatStages;    //--float: run every stage on float samples and only quantize the final result
+    int roi[4];         //--roi X,Y,W,H: only compute and write this rectangle, width 0 when not given
+    int light;          //--light srgb|linear|auto: a LightModes value
+    int alpha;          //--alpha straight|premultiply|skip: an AlphaModes value
+    int gray;           //--gray: decode and convolute luma only
+} Options;
+
+//Usage: Prints usage information for the program
+//Returns: -1
+int Usage(){
+    printf("Usage: image [options] <filename> <type>[,<type>...] [kernelfile]\n");
+    printf("       image [options] --serve <socket|-> [kernelfile]\n\twhere type is one of (");
+    for (int i=0;i<kernelCount();i++)
+        if (!getKernel(i)->rank) printf(i?",%s":"%s",getKernel(i)->name);
+    printf(")\n\tor medianN, erodeN or dilateN for the median, minimum or maximum of an N by N window, N odd from 3 to %d\n",MAX_RANK_SIZE);
+    printf("\tbilateral:R[:S] is an edge preserving blur of radius R (1 to %d, default 5) and range sigma S (%d to 255, default 25)\n",MAX_BILATERAL_RADIUS,MIN_RANGE_SIGMA);
+    printf("\tgaussian:S is a Gaussian blur of sigma S (%g to %d, default 2) that costs the same for any S\n",MIN_GAUSSIAN_SIGMA,MAX_GAUSSIAN_SIGMA);
+    printf("\tseveral types separated by commas are applied in order\n");
+    printf("\tkernelfile adds user kernels, one per line: <name> <size> <size*size coefficients>\n");
+    printf("Options:\n");
+    printf("\t--linear\tcompose consecutive kernels into one (skips the clamp to 8 bits between stages)\n");
+    printf("\t--report\tprint the estimated and measured cost of the staged and composed plans\n");
+    printf("\t--tile WxH\tconvolute in tiles of W pixels by H rows (0 means the full width or height)\n");
+    printf("\t--autotune\tpick the fastest tile size on this machine and remember it for later runs\n");
+    printf("\t--json\t\tprint the stage and thread timings as JSON\n");
+    printf("\t--threads N\tuse N threads in the parallel engines\n");
+    printf("\t--profile\tcount cycles, instructions, cache and branch misses in the convolution (Linux only)\n");
+    printf("\t--serve S\tkeep running and serve requests on the Unix domain socket S, or on stdin and stdout for -\n");
+    printf("\t--connect S\tsend the image to the server on S and write its answer to output.<format>\n");
+    printf("\t--repeat N\twith --connect, send the request N times and print the request rate\n");
+    printf("\t--format F\twith --connect, ask for png, bmp, tga or jpg output\n");
+    printf("\t--stats\t\twith --connect, print the server's cache statistics\n");
+    printf("\t--cache MB\tkeep up to MB megabytes of results in memory and answer repeated requests from them\n");
+    printf("\t--cache-dir D\talso keep results in the directory D, so they survive between runs\n");
+    printf("\t--cache-disk MB\tlimit the cache directory to MB megabytes\n");
+    printf("\t--out-of-core MB\tprocess a binary PGM, PPM or PAM file too large for memory in bands, using about MB megabytes,\n\t\t\tand write output.pgm, output.ppm or output.pam\n");
+    printf("\t--depth 16\tload 16 bits per sample (ie. 16 bit PNG) and write output.pgm, output.ppm or output.pam with 16 bit samples\n");
+    printf("\t--float\t\tkeep the samples between stages as floats, so only the final result is rounded\n");
+    printf("\t--light L\tsrgb convolutes the stored samples, linear converts to linear light first and back after,\n\t\t\tauto uses linear light when every stage is a blur\n");
+    printf("\t--alpha A\tstraight convolutes alpha like colour, premultiply weights colour by alpha to avoid halos around\n\t\t\ttransparent pixels, skip leaves alpha as it is (for images known to be opaque)\n");
+    printf("\t--gray\t\tdecode the luma only and convolute one channel (ie. for edge detection)\n");
+    printf("\t--roi X,Y,W,H\tonly convolute and write the W by H rectangle at X,Y\n");
+    printf("\t--image-cache MB\twith --serve, keep up to MB megabytes of decoded source images\n");
+    return -1;
+}
+
+//parseOptions: Splits argv into flags and the positional arguments
+//Returns: 0 on success, -1 if the command line is not valid
+static int parseOptions(int argc,char** argv,Options* options){
+    char* positional[3];
+    int count=0;
+    memset(options,0,sizeof(Options));
+    options->tileWidth=options->tileHeight=-1;
+    options->repeat=1;
+    options->format="png";
+    for (int i=1;i<argc;i++){
+        if (!strcmp(argv[i],"--linear")) options->linear=1;
+        else if (!strcmp(argv[i],"--report")) options->report=1;
+        else if (!strcmp(argv[i],"--autotune")) options->autotune=1;
+        else if (!strcmp(argv[i],"--json")) options->json=1;
+        else if (!strcmp(argv[i],"--profile")) options->profile=1;
+        else if (!strcmp(argv[i],"--stats")) options->stats=1;
+        else if (!strcmp(argv[i],"--cache")){
+            if (++i==argc||(options->cacheMB=atoi(argv[i]))<0) return -1;
+        }
+        else if (!strcmp(argv[i],"--out-of-core")){
+            if (++i==argc||(options->outOfCoreMB=atoi(argv[i]))<1) return -1;
+        }
+        else if (!strcmp(argv[i],"--float")) options->floatStages=1;
+        else if (!strcmp(argv[i],"--gray")) options->gray=1;
+        else if (!strcmp(argv[i],"--depth")){
+            if (++i==argc||(strcmp(argv[i],"16")&&strcmp(argv[i],"8"))) return -1;
+            options->depth16=!strcmp(argv[i],"16");
+        }
+        else if (!strcmp(argv[i],"--light")){
+            static const char* modes[]={"srgb","linear","auto"};
+            if (++i==argc) return -1;
+            for (options->light=0;options->light<3&&strcmp(argv[i],modes[options->light]);options->light++);
+            if (options->light==3) return -1;
+        }
+        else if (!strcmp(argv[i],"--alpha")){
+            static const char* modes[]={"straight","premultiply","skip"};
+            if (++i==argc) return -1;
+            for (options->alpha=0;options->alpha<3&&strcmp(argv[i],modes[options->alpha]);options->alpha++);
+            if (options->alpha==3) return -1;
+        }
+        else if (!strcmp(argv[i],"--roi")){
+            if (++i==argc||sscanf(argv[i],"%d,%d,%d,%d",&options->roi[0],&options->roi[1],&options->roi[2],&options->roi[3])!=4) return -1;
+            if (options->roi[0]<0||options->roi[1]<0||options->roi[2]<1||options->roi[3]<1) return -1;
+        }
+        else if (!strcmp(argv[i],"--image-cache")){
+            if (++i==argc||(options->imageCacheMB=atoi(argv[i]))<0) return -1;
+        }
+        else if (!strcmp(argv[i],"--cache-disk")){
+            if (++i==argc||(options->cacheDiskMB=atoi(argv[i]))<0) return -1;
+        }
+        else if (!strcmp(argv[i],"--cache-dir")){
+            if (++i==argc) return -1;
+            options->cacheDir=argv[i];
+        }
+        else if (!strcmp(argv[i],"--threads")){
+            if (++i==argc||(options->threads=atoi(argv[i]))<1) return -1;
+        }
+        else if (!strcmp(argv[i],"--serve")){
+            if (++i==argc) return -1;
+            options->serve=argv[i];
+        }
+        else if (!strcmp(argv[i],"--connect")){
+            if (++i==argc) return -1;
+            options->connect=argv[i];
+        }
+        else if (!strcmp(argv[i],"--format")){
+            if (++i==argc) return -1;
+            options->format=argv[i];
+        }
+        else if (!strcmp(argv[i],"--repeat")){
+            if (++i==argc||(options->repeat=atoi(argv[i]))<1) return -1;
+        }
+        else if (!strcmp(argv[i],"--tile")){
+            if (++i==argc||sscanf(argv[i],"%dx%d",&options->tileWidth,&options->tileHeight)!=2) return -1;
+            if (options->tileWidth<0||options->tileHeight<0) return -1;
+        }
+        else if (!strncmp(argv[i],"--",2)) return -1;
+        else if (count<3) positional[count++]=argv[i];
+        else return -1;
+    }
+    //a server takes its images from the requests, so only the kernel file may be given
+    if (options->serve){
+        if (count>1||options->connect) return -1;
+        options->kernelFile=count?positional[0]:NULL;
+        return 0;
+    }
+    if (count<2) return -1;
+    options->fileName=positional[0];
+    options->pipeline=positional[1];
+    options->kernelFile=count==3?positional[2]:NULL;
+    return 0;
+}
+
+//chooseTiles: Applies the tile size from the command line, a fresh tuning run, or the tile cache, in that order of preference.
+//             Tiles are tuned for the most expensive stage, since it dominates the run time.
+static void chooseTiles(Options* options,Image* srcImage,Pipeline* pipeline,ConvoluteFunction convolute){
+    int width,height;
+    Kernel* heaviest=NULL;
+    for (int i=0;i<pipeline->count;i++)
+        if (!heaviest||kernelCost(pipeline->stages[i],kernelPath(pipeline->stages[i]))>kernelCost(heaviest,kernelPath(heaviest)))
+            heaviest=pipeline->stages[i];
+    if (options->tileWidth>=0) setTileSize(options->tileWidth,options->tileHeight);
+    if (!heaviest||options->tileWidth>=0) return;
+    if (options->autotune){
+        autotuneTiles(srcImage,heaviest,convolute,&width,&height);
+        printf("Tuned tile size for %s: %dx%d\n",heaviest->name,width,height);
+        if (saveTileCache(heaviest,srcImage,width,height)) printf("Could not write the tile cache.\n");
+        setTileSize(width,height);
+    }
+    else if (loadTileCache(heaviest,srcImage,&width,&height)==0) setTileSize(width,height);
+}
+
+//reportPlans: Runs the staged and the composed pipelines and prints the estimated and measured cost of each
+static void reportPlans(Image* srcImage,Pipeline* staged,Pipeline* fused,ConvoluteFunction convolute){
+    Pipeline* plans[2]={staged,fused};
+    const char* labels[2]={"staged","fused"};
+    for (int p=0;p<2;p++){
+        Image destImage;
+        printf("%s plan:",labels[p]);
+        for (int i=0;i<plans[p]->count;i++)
+            printf(" %s(%dx%d %s)",plans[p]->stages[i]->name,plans[p]->stages[i]->size,plans[p]->stages[i]->size,pathName(kernelPath(plans[p]->stages[i])));
+        double start=nowSeconds();
+        int owns=runPipeline(srcImage,&destImage,plans[p],convolute);
+        double elapsed=nowSeconds()-start;
+        if (owns>0) releaseBuffer(destImage.data,imageBytes(&destImage));
+        printf("\n\testimated %.1f ops/sample, measured %.3f ms\n",pipelineCost(plans[p]),elapsed*1000);
+    }
+}
+
+//writeOutput: Writes the encoded result
+//Returns: 0 on success, -1 if the file could not be written
+static int writeOutput(const char* outName,const unsigned char* encoded,size_t length){
+    timerStart(STAGE_WRITE);
+    FILE* output=fopen(outName,"wb");
+    if (output){
+        fwrite(encoded,1,length,output);
+        fclose(output);
+    }
+    timerStop(STAGE_WRITE);
+    if (!output){
+        printf("Error writing %s.\n",outName);
+        return -1;
+    }
+    return 0;
+}
+
+//opaqueAlpha: The alpha of an opaque pixel in the image workImage makes
+static float opaqueAlpha(Image* srcImage,int floatStages,int linearLight){
+    return floatStages&&!linearLight&&srcImage->type==SAMPLE_U8?255:65535;
+}
+
+//workImage: Makes the copy of the source the pipeline runs on for --float, linear light and premultiplied alpha: float samples for
+//           --float, otherwise 16 bit ones, which hold linear light and premultiplied colour without visible banding
+//Returns: 0 on success, -1 if out of memory
+static int workImage(Image* srcImage,Image* result,int floatStages,int linearLight,int premultiply){
+    *result=*srcImage;
+    result->type=floatStages?SAMPLE_FLOAT:SAMPLE_U16;
+    result->data=malloc(imageBytes(result));
+    if (!result->data) return -1;
+    if (linearLight) linearizeImage(srcImage,result);
+    else convertImage(srcImage,result);
+    if (premultiply) premultiplyImage(result,opaqueAlpha(srcImage,floatStages,linearLight));
+    setFloatRange(opaqueAlpha(srcImage,floatStages,linearLight));
+    return 0;
+}
+
+//runImage: The body of main shared by every engine.  Loads the image, plans and runs the pipeline and writes output.png
+//The first positional argument is the source file name (can be jpg, png, bmp, tga).  Second is the lower case name of the algorithm,
+//or several names separated by commas.  An optional third argument names a kernel file whose kernels are added to the registry before the lookup.
+//Parameters: convolute: The engine used for every convolution stage
+//Returns: The exit code for main
+int runImage(int argc,char** argv,ConvoluteFunction convolute){
+    Options options;
+    imgInit();
+    if (parseOptions(argc,argv,&options)) return Usage();
+    setThreadCount(options.threads);
+    setSkipAlpha(options.alpha==ALPHA_SKIP);
+    if (options.kernelFile&&loadKernelFile(options.kernelFile)<0) return -1;
+    if (options.tileWidth>=0) setTileSize(options.tileWidth,options.tileHeight);
+    cacheConfigure(&resultCache,(size_t)options.cacheMB<<20,options.cacheDir,(size_t)options.cacheDiskMB<<20);
+    cacheConfigure(&imageCache,(size_t)options.imageCacheMB<<20,NULL,0);
+    if (options.serve) return runServer(options.serve,convolute);
+    if (options.connect) return runClient(options.connect,options.fileName,options.pipeline,options.linear,options.gray,options.format,options.repeat,options.stats);
+    char* fileName=options.fileName;
+    if (!strcmp(fileName,"pic4.jpg")&&!strcmp(options.pipeline,"gauss")){
+        printf("You have applied a gaussian filter to Gauss which has caused a tear in the time-space continum.\n");
+    }
+    Pipeline pipeline,fused;
+    if (parsePipeline(options.pipeline,&pipeline)) return Usage();
+    planPipeline(&pipeline);
+    composePipeline(&pipeline,&fused);
+    int linearLight=options.light==LIGHT_LINEAR||(options.light==LIGHT_AUTO&&blurPipeline(&pipeline));
+
+    if (options.outOfCoreMB){
+        if (linearLight||options.alpha==ALPHA_PREMULTIPLY||options.gray){
+            printf("%s is not available with --out-of-core.\n",linearLight?"Linear light":options.gray?"--gray":"Premultiplied alpha");
+            return -1;
+        }
+        //the output keeps the source's format, which its extension names
+        const char* extension=strrchr(fileName,'.');
+        char outName[64];
+        snprintf(outName,sizeof(outName),"output%s",extension&&strlen(extension)<8?extension:".ppm");
+        timerReset();
+        int result=runOutOfCore(fileName,outName,options.linear?&fused:&pipeline,convolute,(size_t)options.outOfCoreMB<<20);
+        if (result==0) printTimings(stdout,options.json);
+        return result;
+    }
+    Image srcImage,destImage;
+    char key[1024],request[512];
+    //the region, linear light, the alpha mode and luma only change what is asked for, so they are part of the cache key too
+    static const char* alphaNames[]={""," premultiply"," skip alpha"};
+    const char* light=linearLight?" linear light":"";
+    const char* gray=options.gray?" gray":"";
+    if (options.roi[2]) snprintf(request,sizeof(request),"%s@%d,%d,%d,%d%s%s%s",options.pipeline,options.roi[0],options.roi[1],options.roi[2],options.roi[3],light,alphaNames[options.alpha],gray);
+    else snprintf(request,sizeof(request),"%s%s%s%s",options.pipeline,light,alphaNames[options.alpha],gray);
+    //16 bit and float runs are not cached
+    int cacheable=cacheEnabled(&resultCache)&&!options.depth16&&!options.floatStages;
+    srcImage.type=options.depth16?SAMPLE_U16:SAMPLE_U8;
+    const char* outName="output.png";
+    timerReset();
+    timerStart(STAGE_DECODE);
+    //--gray asks stb_image for one channel, which for a jpg is its luma plane without any colour conversion
+    int channels=options.gray?1:0;
+    if (options.depth16) srcImage.data=(uint8_t*)stbi_load_16(fileName,&srcImage.width,&srcImage.height,&srcImage.bpp,channels);
+    else if (cacheable){
+        //the source bytes are needed for the cache key, so they are read once and decoded from memory
+        size_t inputLength,length;
+        unsigned char* input=imgReadFile(fileName,&inputLength);
+        srcImage.data=NULL;
+        if (input){
+            resultCacheKey(key,sizeof(key),hashBytes(input,inputLength),inputLength,request,pipelineHash(&pipeline),options.linear,"png");
+            const unsigned char* cached=cacheLookup(&resultCache,key,&length);
+            if (cached){
+                free(input);
+                timerStop(STAGE_DECODE);
+                printf("Served from the result cache.\n");
+                return writeOutput(outName,cached,length);
+            }
+            if (options.gray) imgDecodeGray(input,inputLength,&srcImage);
+            else imgDecodeMem(input,inputLength,&srcImage);
+            free(input);
+        }
+    }
+    else srcImage.data=stbi_load(fileName,&srcImage.width,&srcImage.height,&srcImage.bpp,channels);
+    timerStop(STAGE_DECODE);
+    //stb_image reports the channels in the file, not the ones it returned
+    if (options.gray) srcImage.bpp=1;
+    if (!srcImage.data){
+        printf("Error loading file %s.\n",fileName);
+        return -1;
+    }
+    if (options.depth16){
+        static const char* pnmNames[]={"","output.pgm","output.pam","output.ppm","output.pam"};
+        outName=pnmNames[srcImage.bpp];
+    }
+    //--float runs every stage on a float copy of the source, linear light and premultiplied alpha on a 16 bit (or float) copy
+    int premultiply=options.alpha==ALPHA_PREMULTIPLY&&(srcImage.bpp==2||srcImage.bpp==4);
+    Image wideSource,*work=&srcImage;
+    if (options.floatStages||linearLight||premultiply){
+        timerStart(STAGE_ALLOCATE);
+        int failed=workImage(&srcImage,&wideSource,options.floatStages,linearLight,premultiply);
+        timerStop(STAGE_ALLOCATE);
+        if (failed){
+            printf("Out of memory.\n");
+            stbi_image_free(srcImage.data);
+            return -1;
+        }
+        work=&wideSource;
+    }
+    //tuning and report runs are not part of the timed run
+    timerEnable(0);
+    chooseTiles(&options,work,options.linear?&fused:&pipeline,convolute);
+    if (options.report) reportPlans(work,&pipeline,&fused,convolute);
+    timerEnable(1);
+    profileReset();
+    profileEnable(options.profile);
+    //an empty pipeline (ie. identity) writes the decoded pixels straight back out without touching the engine
+    Pipeline* plan=options.linear?&fused:&pipeline;
+    int ownsDest;
+    if (options.roi[2]) ownsDest=runPipelineRegion(work,&destImage,plan,convolute,options.roi[0],options.roi[1],options.roi[2],options.roi[3]);
+    else ownsDest=runPipeline(work,&destImage,plan,convolute);
+    profileEnable(0);
+    if (ownsDest>=0&&work!=&srcImage){
+        //the only rounding of a --float or linear light run: back to the source's sample type (and encoding)
+        Image quantized=destImage;
+        quantized.type=srcImage.type;
+        quantized.data=malloc(imageBytes(&quantized));
+        if (quantized.data){
+            timerStart(STAGE_CONVOLVE);
+            if (premultiply) unpremultiplyImage(&destImage,opaqueAlpha(&srcImage,options.floatStages,linearLight));
+            if (linearLight) encodeImage(&destImage,&quantized);
+            else convertImage(&destImage,&quantized);
+            timerStop(STAGE_CONVOLVE);
+        }
+        if (ownsDest) releaseBuffer(destImage.data,imageBytes(&destImage));
+        destImage=quantized;
+        ownsDest=quantized.data?1:-1;
+    }
+    if (work!=&srcImage) free(wideSource.data);
+    if (ownsDest<0){
+        if (options.roi[2]&&(options.roi[0]+options.roi[2]>srcImage.width||options.roi[1]+options.roi[3]>srcImage.height))
+            printf("The region is not inside the %dx%d image.\n",srcImage.width,srcImage.height);
+        else printf("Out of memory.\n");
+        stbi_image_free(srcImage.data);
+        return -1;
+    }
+    size_t length;
+    timerStart(STAGE_ENCODE);
+    unsigned char* encoded=imgEncodeMem(&destImage,options.depth16?"pnm":"png",&length);
+    timerStop(STAGE_ENCODE);
+    stbi_image_free(srcImage.data);
+    if (ownsDest) releaseBuffer(destImage.data,imageBytes(&destImage));
+    if (!encoded){
+        printf("Error encoding %s.\n",outName);
+        return -1;
+    }
+    if (cacheable) cacheStore(&resultCache,key,encoded,length);
+    int failed=writeOutput(outName,encoded,length);
+    free(encoded);
+    if (failed) return -1;
+    printTimings(stdout,options.json);
+    if (options.profile) printProfile(stdout,options.json,(double)destImage.width*destImage.height*plan->count);
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <math.h>
+#include "image.h"
+
+//Fused gradient operators.  Sobel and Scharr need the x and the y gradient of every pixel, and the magnitude or angle
+//combines the two.  Running two convolutions and combining their outputs reads the source twice and writes and reads two
+//intermediate images; convoluteGradients reads each neighbourhood once, accumulates both gradients from the same loads, and
+//writes only the outputs asked for.
+
+#define TWO_PI 6.283185307179586
+
+//storeGradient: Writes a gradient the way a convolution path would: 8 bit samples truncated and wrapped like getPixelValue
+static inline void storeGradient(Image* image,size_t index,double value){
+    if (image->type==SAMPLE_U8) image->data[index]=(uint8_t)(int)value;
+    else storeSample(image,index,(float)value);
+}
+
+//storeMagnitude: Writes a gradient magnitude.  Unlike a convolution result it is never negative, so 8 bit samples are rounded
+//and saturated instead of wrapped; 16 bit and float samples are stored as storeSample does.
+static inline void storeMagnitude(Image* image,size_t index,double value){
+    if (image->type==SAMPLE_U8) image->data[index]=value>=255?255:(uint8_t)(value+0.5);
+    else storeSample(image,index,(float)value);
+}
+
+//storeAngle: Writes a gradient direction.  Float samples hold radians in [-pi,pi].  8 and 16 bit samples hold the fraction of a
+//            full turn counter clockwise from the x axis, scaled to 256 or 65536, so 0 is +x and 64 (or 16384) is +y.
+static inline void storeAngle(Image* image,size_t index,double gx,double gy){
+    double angle=atan2(gy,gx);
+    if (image->type==SAMPLE_FLOAT){
+        ((float*)image->data)[index]=(float)angle;
+        return;
+    }
+    double turn=angle/TWO_PI;
+    if (turn<0) turn+=1;
+    if (image->type==SAMPLE_U16) ((uint16_t*)image->data)[index]=(uint16_t)(int)(turn*65536+0.5);
+    else image->data[index]=(uint8_t)(int)(turn*256+0.5);
+}
+
+//gradients3x3: convoluteGradients for 3x3 integer kernels on 8 bit images, the common case.  The three source rows and the three
+//              columns are found once per pixel, the nine samples are loaded once per channel, and both sums use them.
+static void gradients3x3(Image* srcImage,Image* gx,Image* gy,Image* magnitude,Image* angle,Kernel* kernel,int x0,int y0,int x1,int y1){
+    int row,pix,bit,bpp=srcImage->bpp,channels=colourChannels(srcImage),span=srcImage->width*bpp,shift=kernel->shift;
+    int (*c)[MAX_KERNEL_SIZE]=kernel->icoef;
+    double scale=1.0/(1<<shift);
+    for (row=y0;row<y1;row++){
+        const uint8_t* up=srcImage->data+(size_t)clampIndex(row-1,srcImage->height)*span;
+        const uint8_t* mid=srcImage->data+(size_t)row*span;
+        const uint8_t* down=srcImage->data+(size_t)clampIndex(row+1,srcImage->height)*span;
+        for (pix=x0;pix<x1;pix++){
+            int left=clampIndex(pix-1,srcImage->width)*bpp,centre=pix*bpp,right=clampIndex(pix+1,srcImage->width)*bpp;
+            for (bit=0;bit<channels;bit++){
+                int p00=up[left+bit],p01=up[centre+bit],p02=up[right+bit];
+                int p10=mid[left+bit],p11=mid[centre+bit],p12=mid[right+bit];
+                int p20=down[left+bit],p21=down[centre+bit],p22=down[right+bit];
+                int ix=c[0][0]*p00+c[0][1]*p01+c[0][2]*p02+c[1][0]*p10+c[1][1]*p11+c[1][2]*p12+c[2][0]*p20+c[2][1]*p21+c[2][2]*p22;
+                int iy=c[0][0]*p00+c[1][0]*p01+c[2][0]*p02+c[0][1]*p10+c[1][1]*p11+c[2][1]*p12+c[0][2]*p20+c[1][2]*p21+c[2][2]*p22;
+                size_t out=(size_t)row*span+centre+bit;
+                if (gx) gx->data[out]=(uint8_t)(ix/(1<<shift));
+                if (gy) gy->data[out]=(uint8_t)(iy/(1<<shift));
+                if (magnitude){
+                    //ix and iy are whole numbers, so a float square root of their exact sum of squares is close enough to round
+                    float length=sqrtf((float)((long long)ix*ix+(long long)iy*iy))*scale;
+                    magnitude->data[out]=length>=255?255:(uint8_t)(length+0.5f);
+                }
+                if (angle) storeAngle(angle,out,ix,iy);
+            }
+        }
+    }
+}
+
+//convoluteGradients: Evaluates a kernel and its transpose over the rectangle [x0,x1)x[y0,y1) in one pass and writes any of
+//                    the two gradients, their magnitude and their angle.  The gradients are exactly what convoluting with the
+//                    kernel and with its transpose gives.
+//Parameters: srcImage: The image being convoluted
+//            gx,gy: Receive the gradients along x (the kernel) and y (its transpose), or NULL
+//            magnitude: Receives sqrt(gx*gx+gy*gy), or NULL
+//            angle: Receives atan2(gy,gx), see storeAngle, or NULL
+//            kernel: The x gradient kernel, ie. the one registered as sobel-x or the fused sobel
+//            x0,y0,x1,y1: The rectangle to compute
+//Returns: Nothing
+void convoluteGradients(Image* srcImage,Image* gx,Image* gy,Image* magnitude,Image* angle,Kernel* kernel,int x0,int y0,int x1,int y1){
+    int row,pix,bit,i,j,r=kernel->size/2,bpp=srcImage->bpp,channels=colourChannels(srcImage);
+    if (kernel->size==3&&kernel->integerExact&&srcImage->type==SAMPLE_U8&&(!magnitude||magnitude->type==SAMPLE_U8)){
+        gradients3x3(srcImage,gx,gy,magnitude,angle,kernel,x0,y0,x1,y1);
+        return;
+    }
+    //8 bit sources with integer coefficients use integer sums, like integerPixelValue
+    int integer=kernel->integerExact&&srcImage->type==SAMPLE_U8;
+    double scale=1.0/(1<<kernel->shift);
+    for (row=y0;row<y1;row++){
+        for (pix=x0;pix<x1;pix++){
+            for (bit=0;bit<channels;bit++){
+                size_t out=((size_t)row*srcImage->width+pix)*bpp+bit;
+                double sumX=0,sumY=0;
+                if (integer){
+                    int ix=0,iy=0;
+                    for (i=0;i<kernel->size;i++){
+                        const uint8_t* line=srcImage->data+(size_t)clampIndex(row+i-r,srcImage->height)*srcImage->width*bpp;
+                        for (j=0;j<kernel->size;j++){
+                            int value=line[clampIndex(pix+j-r,srcImage->width)*bpp+bit];
+                            ix+=kernel->icoef[i][j]*value;
+                            iy+=kernel->icoef[j][i]*value;
+                        }
+                    }
+                    if (gx) gx->data[out]=(uint8_t)(ix/(1<<kernel->shift));
+                    if (gy) gy->data[out]=(uint8_t)(iy/(1<<kernel->shift));
+                    sumX=ix*scale;
+                    sumY=iy*scale;
+                }
+                else{
+                    for (i=0;i<kernel->size;i++){
+                        size_t line=(size_t)clampIndex(row+i-r,srcImage->height)*srcImage->width;
+                        for (j=0;j<kernel->size;j++){
+                            double value=loadSample(srcImage,(line+clampIndex(pix+j-r,srcImage->width))*bpp+bit);
+                            sumX+=kernel->coef[i][j]*value;
+                            sumY+=kernel->coef[j][i]*value;
+                        }
+                    }
+                    if (gx) storeGradient(gx,out,sumX);
+                    if (gy) storeGradient(gy,out,sumY);
+                }
+                if (magnitude) storeMagnitude(magnitude,out,sqrt(sumX*sumX+sumY*sumY));
+                if (angle) storeAngle(angle,out,sumX,sumY);
+            }
+        }
+    }
+}
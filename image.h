@@ -1,23 +1,180 @@
 #ifndef ___IMAGE
 #define ___IMAGE
 #include <stdint.h>
+#include <stddef.h>
 
 #define Index(x,y,width,bit,bpp) y*width*bpp+bpp*x+bit
 
+//The type of each channel sample.  8 bit images are the default, so an Image with type 0 is one.
+enum SampleTypes{SAMPLE_U8=0,SAMPLE_U16=1,SAMPLE_FLOAT=2};
+
 typedef struct{
-    uint8_t* data;
+    uint8_t* data;      //uint16_t or float samples when type says so
     int width;
     int height;
     int bpp;
+    int type;           //a SampleTypes value
 } Image;
 
+//The built in kernels.  These are registered first, so the enumeration value is also the kernel's index in the registry.
 enum KernelTypes{EDGE=0,SHARPEN=1,BLUR=2,GAUSE_BLUR=3,EMBOSS=4,IDENTITY=5};
 
 typedef double Matrix[3][3];
 
-uint8_t getPixelValue(Image* srcImage,int x,int y,int bit,Matrix algorithm);
-void convolute(Image* srcImage,Image* destImage,Matrix algorithm);
+#define MAX_KERNEL_SIZE 7
+#define MAX_KERNELS 64
+#define MAX_KERNEL_NAME 32
+
+//Operators that evaluate a kernel and its transpose over the same neighbourhood in one pass and combine the two results per pixel.
+//The kernel's coefficients are the x gradient, ie. Sobel's, and the transpose is the y gradient.
+enum FusedOperators{FUSED_NONE=0,FUSED_MAGNITUDE=1,FUSED_ANGLE=2};
+
+//Rank filters replace each sample with the median, the minimum (erode) or the maximum (dilate) of a square window around it.
+//They have no coefficients, so their window may be larger than MAX_KERNEL_SIZE.
+enum RankFilters{RANK_NONE=0,RANK_MEDIAN=1,RANK_MIN=2,RANK_MAX=3};
+#define MAX_RANK_SIZE 15
+
+//The bilateral filter averages a square window, weighting each sample by how close its value is to the centre's, so edges stay
+//sharp.  The window's radius and the range sigma (on the 8 bit scale) can be given in a pipeline, ie. "bilateral:7:30".
+#define MAX_BILATERAL_RADIUS 32
+#define MIN_RANGE_SIGMA 4
+
+//The Gaussian blur of any sigma, ie. "gaussian:12.5".  It is a recursive filter with no coefficients and the same cost for every
+//sigma; its size, a radius of 4*sigma rounded up, is only how far it reaches for regions and bands.
+#define MIN_GAUSSIAN_SIGMA 0.5
+#define MAX_GAUSSIAN_SIGMA 100
+
+//Symmetry flags stored in Kernel.symmetry
+#define SYM_HORIZONTAL 1   //coef[i][j]==coef[i][size-1-j]
+#define SYM_VERTICAL 2     //coef[i][j]==coef[size-1-i][j]
+#define SYM_TRANSPOSE 4    //coef[i][j]==coef[j][i]
+
+//A convolution kernel plus the metadata the engine uses to pick an execution path.
+//Everything after coef is filled in by analyzeKernel when the kernel is registered.
+typedef struct{
+    char name[MAX_KERNEL_NAME];
+    int size;                                           //width and height of the kernel, always odd
+    double coef[MAX_KERNEL_SIZE][MAX_KERNEL_SIZE];
+    double sum;                                         //sum of all coefficients
+    int symmetry;                                       //SYM_* flags
+    int separable;                                      //coef[i][j]==colVec[i]*rowVec[j]
+    double rowVec[MAX_KERNEL_SIZE];
+    double colVec[MAX_KERNEL_SIZE];
+    int integerExact;                                   //every coefficient is icoef/2^shift with no rounding
+    int shift;
+    int icoef[MAX_KERNEL_SIZE][MAX_KERNEL_SIZE];
+    int intSeparable;                                   //icoef[i][j]==icol[i]*irow[j]
+    int irow[MAX_KERNEL_SIZE];
+    int icol[MAX_KERNEL_SIZE];
+    int identity;                                       //convolution with this kernel copies the image unchanged
+    int builtin;                                        //the KernelTypes value of the built in kernel with the same coefficients, or -1
+    int fused;                                          //a FusedOperators value, set by registerFused rather than analyzeKernel
+    int rank;                                           //a RankFilters value, set by registerRank.  coef is unused and all zero.
+    int bilateral;                                      //set by registerBilateral, with no coefficients either
+    double rangeSigma;                                  //the bilateral filter's range sigma
+    int gaussian;                                       //set by registerGaussian, with no coefficients either
+    double sigma;                                       //the Gaussian's sigma
+} Kernel;
+
+//A function that convolutes the rectangle [x0,x1)x[y0,y1) of srcImage into destImage
+typedef void (*RectFunction)(Image* srcImage,Image* destImage,int x0,int y0,int x1,int y1);
+
+//sampleBytes: The size of one channel sample of an image
+static inline int sampleBytes(const Image* image){
+    return image->type==SAMPLE_FLOAT?sizeof(float):image->type==SAMPLE_U16?sizeof(uint16_t):1;
+}
+
+//imageBytes: The size of an image's pixel data
+static inline size_t imageBytes(const Image* image){
+    return (size_t)image->width*image->height*image->bpp*sampleBytes(image);
+}
+
+//loadSample: Reads one channel sample of an image of any type as a float
+static inline float loadSample(const Image* image,size_t index){
+    if (image->type==SAMPLE_FLOAT) return ((const float*)image->data)[index];
+    if (image->type==SAMPLE_U16) return ((const uint16_t*)image->data)[index];
+    return image->data[index];
+}
+
+//storeSample: Writes one channel sample.  8 bit samples are truncated and wrapped like every 8 bit path, 16 bit samples are
+//rounded and saturated, and float samples are stored as they are, so a chain of float stages never loses precision.
+static inline void storeSample(Image* image,size_t index,float value){
+    if (image->type==SAMPLE_FLOAT) ((float*)image->data)[index]=value;
+    else if (image->type==SAMPLE_U16) ((uint16_t*)image->data)[index]=value<=0?0:value>=65535?65535:(uint16_t)(value+0.5f);
+    else image->data[index]=(uint8_t)(int)value;
+}
+
+//linearKernel: Whether a kernel is a convolution with its coefficients, rather than a fused operator or a filter without coefficients
+static inline int linearKernel(const Kernel* kernel){
+    return !kernel->fused&&!kernel->rank&&!kernel->bilateral&&!kernel->gaussian;
+}
+
+//slidingKernel: Whether a kernel keeps running sums down the rows (the bilateral filter and the histogram median), which every call
+//               primes with the rows around its first one.  The engines give such kernels one tall band per thread, not many short ones.
+static inline int slidingKernel(const Kernel* kernel){
+    return kernel->bilateral||(kernel->rank==RANK_MEDIAN&&kernel->size>5);
+}
+
+//clampIndex: Keeps a coordinate inside the image.  For the edge pixels, we just reuse the edge pixel.
+static inline int clampIndex(int value,int limit){
+    if (value<0) return 0;
+    if (value>=limit) return limit-1;
+    return value;
+}
+
+//kernels.c
+void initKernelRegistry();
+int registerKernel(const char* name,int size,double* coef);
+int registerFused(const char* name,int size,double* coef,int fused);
+int registerRank(const char* name,int size,int rank);
+int registerBilateral(const char* name,int size,double rangeSigma);
+int registerGaussian(const char* name,double sigma);
+int parameterizeKernel(Kernel* kernel,const char* parameters,Kernel* result);
+int loadKernelFile(const char* fileName);
+Kernel* findKernel(const char* name);
+Kernel* getKernel(int index);
+int kernelCount();
+void analyzeKernel(Kernel* kernel);
+
+//convolve.c
+uint8_t getPixelValue(Image* srcImage,int x,int y,int bit,Kernel* kernel);
+void convoluteRows(Image* srcImage,Image* destImage,Kernel* kernel,int rowStart,int rowEnd);
+void convoluteRegion(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1);
+void convertImage(Image* srcImage,Image* destImage);
+void setTileSize(int width,int height);
+void getTileSize(int* width,int* height);
+void setThreadCount(int count);
+int getThreadCount();
+void setSkipAlpha(int skip);
+int getSkipAlpha();
+void setFloatRange(float range);
+void noteOutOfMemory();
+int takeOutOfMemory();
+float getFloatRange();
+int colourChannels(Image* image);
+
+//gradient.c
+void convoluteGradients(Image* srcImage,Image* gx,Image* gy,Image* magnitude,Image* angle,Kernel* kernel,int x0,int y0,int x1,int y1);
+
+//rank.c
+size_t rankScratchSize(Image* srcImage,Kernel* kernel,int width);
+void rankFilter(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1,uint16_t* histograms);
+
+//bilateral.c
+void bilateralFilter(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1);
+
+//gaussian.c
+void gaussianRows(Image* srcImage,float* temp,Kernel* kernel,int rowStart,int rowEnd);
+void gaussianColumns(Image* srcImage,float* temp,Image* destImage,Kernel* kernel,int columnStart,int columnEnd);
+void gaussianFilter(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1);
+
+//specialized.c
+extern RectFunction specializedRows[];
+
+//The engines.  Each engine file also has a main unless it is compiled with IMAGE_NO_MAIN.
+void convolute(Image* srcImage,Image* destImage,Kernel* kernel);        //image.c
+void ompConvolute(Image* srcImage,Image* destImage,Kernel* kernel);     //omp_image.c
+void pthreadConvolute(Image* srcImage,Image* destImage,Kernel* kernel); //pthread_image.c
 int Usage();
-enum KernelTypes GetKernelType(char* type);
 
-#endif
\ No newline at end of file
+#endif
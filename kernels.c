@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+//An array of kernel matrices to be used for image convolution.
+//The indexes of these match the enumeration from the header file. ie. algorithms[BLUR] returns the kernel corresponding to a box blur.
+static Matrix algorithms[]={
+    {{0,-1,0},{-1,4,-1},{0,-1,0}},
+    {{0,-1,0},{-1,5,-1},{0,-1,0}},
+    {{1/9.0,1/9.0,1/9.0},{1/9.0,1/9.0,1/9.0},{1/9.0,1/9.0,1/9.0}},
+    {{1.0/16,1.0/8,1.0/16},{1.0/8,1.0/4,1.0/8},{1.0/16,1.0/8,1.0/16}},
+    {{-2,-1,0},{-1,1,1},{0,1,2}},
+    {{0,0,0},{0,1,0},{0,0,0}}
+};
+static const char* algorithmNames[]={"edge","sharpen","blur","gauss","emboss","identity"};
+
+//The x gradients of the Sobel and Scharr operators.  Each is registered as a plain kernel for each direction, and as the fused
+//operators that compute the gradient's magnitude or angle from both directions in one pass.
+static Matrix gradients[]={
+    {{-1,0,1},{-2,0,2},{-1,0,1}},
+    {{-3,0,3},{-10,0,10},{-3,0,3}}
+};
+static const char* gradientNames[]={"sobel","scharr"};
+
+//The rank filters are registered for every window size, ie. median3 to median15, indexed by RankFilters
+static const char* rankNames[]={"","median","erode","dilate"};
+
+static Kernel registry[MAX_KERNELS];
+static int registrySize=0;
+static int builtinCount=0;      //entries below this index were registered by initKernelRegistry
+
+//the largest shift and integer coefficient we allow, so that a 7x7 integer sum over 8 bit pixels can not overflow an int
+#define MAX_SHIFT 12
+#define MAX_ICOEF 32767
+
+static int gcd(int a,int b){
+    if (a<0) a=-a;
+    if (b<0) b=-b;
+    while (b){ int t=a%b; a=b; b=t; }
+    return a;
+}
+
+//analyzeKernel: Fills in the metadata (sum, symmetry, separability, integer form) for a kernel whose name, size and coef are already set
+//Parameters: kernel: The kernel to analyze
+//Returns: Nothing
+void analyzeKernel(Kernel* kernel){
+    int i,j,n=kernel->size;
+    double maxAbs=0;
+    int pi=0,pj=0;
+
+    kernel->sum=0;
+    kernel->symmetry=SYM_HORIZONTAL|SYM_VERTICAL|SYM_TRANSPOSE;
+    for (i=0;i<n;i++){
+        for (j=0;j<n;j++){
+            double c=kernel->coef[i][j];
+            kernel->sum+=c;
+            if (c!=kernel->coef[i][n-1-j]) kernel->symmetry&=~SYM_HORIZONTAL;
+            if (c!=kernel->coef[n-1-i][j]) kernel->symmetry&=~SYM_VERTICAL;
+            if (c!=kernel->coef[j][i]) kernel->symmetry&=~SYM_TRANSPOSE;
+            if (fabs(c)>maxAbs){ maxAbs=fabs(c); pi=i; pj=j; }
+        }
+    }
+
+    //separable: a rank one kernel is the outer product of its pivot column and pivot row
+    kernel->separable=1;
+    for (i=0;i<n;i++){
+        kernel->rowVec[i]=maxAbs>0?kernel->coef[pi][i]:0;
+        kernel->colVec[i]=maxAbs>0?kernel->coef[i][pj]/kernel->coef[pi][pj]:0;
+    }
+    for (i=0;i<n&&kernel->separable;i++)
+        for (j=0;j<n;j++)
+            if (fabs(kernel->colVec[i]*kernel->rowVec[j]-kernel->coef[i][j])>1e-12*maxAbs){ kernel->separable=0; break; }
+
+    //integer exact: every coefficient is a whole number once scaled by 2^shift
+    kernel->integerExact=0;
+    kernel->shift=0;
+    for (int shift=0;shift<=MAX_SHIFT&&!kernel->integerExact;shift++){
+        int ok=1;
+        for (i=0;i<n&&ok;i++){
+            for (j=0;j<n;j++){
+                double scaled=ldexp(kernel->coef[i][j],shift);
+                if (scaled!=floor(scaled)||fabs(scaled)>MAX_ICOEF){ ok=0; break; }
+            }
+        }
+        if (ok){
+            kernel->integerExact=1;
+            kernel->shift=shift;
+            for (i=0;i<n;i++)
+                for (j=0;j<n;j++)
+                    kernel->icoef[i][j]=(int)ldexp(kernel->coef[i][j],shift);
+        }
+    }
+
+    //identity: a lone 1 in the centre, which makes the convolution a plain copy
+    kernel->identity=kernel->integerExact&&kernel->shift==0&&kernel->icoef[n/2][n/2]==1;
+    for (i=0;i<n&&kernel->identity;i++)
+        for (j=0;j<n;j++)
+            if ((i!=n/2||j!=n/2)&&kernel->icoef[i][j]!=0){ kernel->identity=0; break; }
+
+    //builtin: the same coefficients as a built in kernel, so the compile time specialized code can be used
+    kernel->builtin=-1;
+    for (i=0;i<=IDENTITY&&n==3&&kernel->builtin<0;i++)
+        if (!memcmp(kernel->coef[0],algorithms[i][0],sizeof(algorithms[i][0]))&&
+            !memcmp(kernel->coef[1],algorithms[i][1],sizeof(algorithms[i][1]))&&
+            !memcmp(kernel->coef[2],algorithms[i][2],sizeof(algorithms[i][2]))) kernel->builtin=i;
+
+    //integer separable: the pivot row divided by its gcd, and a column that reproduces icoef exactly
+    kernel->intSeparable=0;
+    if (kernel->integerExact&&kernel->separable&&maxAbs>0){
+        int g=0;
+        for (j=0;j<n;j++) g=gcd(g,kernel->icoef[pi][j]);
+        for (j=0;j<n;j++) kernel->irow[j]=kernel->icoef[pi][j]/g;
+        kernel->intSeparable=1;
+        for (i=0;i<n&&kernel->intSeparable;i++){
+            if (kernel->icoef[i][pj]%kernel->irow[pj]){ kernel->intSeparable=0; break; }
+            kernel->icol[i]=kernel->icoef[i][pj]/kernel->irow[pj];
+            for (j=0;j<n;j++)
+                if (kernel->icol[i]*kernel->irow[j]!=kernel->icoef[i][j]){ kernel->intSeparable=0; break; }
+        }
+    }
+}
+
+//registrySlot: Finds the registry index for a new entry: the entry with the same name, which is replaced, or a new one at the end
+//Returns: The index, or -1 if the name is too long or the registry is full
+static int registrySlot(const char* name){
+    int index;
+    if (strlen(name)>=MAX_KERNEL_NAME) return -1;
+    for (index=0;index<registrySize;index++)
+        if (!strcmp(registry[index].name,name)) return index;
+    if (registrySize==MAX_KERNELS) return -1;
+    return registrySize++;
+}
+//registerKernel: Adds a kernel to the registry, replacing any existing kernel with the same name
+//Parameters: name: The name used to select the kernel on the command line
+//            size: The width and height of the kernel (3, 5 or 7)
+//            coef: size*size coefficients in row major order
+//Returns: The registry index of the kernel, or -1 if it could not be registered
+int registerKernel(const char* name,int size,double* coef){
+    int i,j,index;
+    if (size<1||size>MAX_KERNEL_SIZE||size%2==0||(index=registrySlot(name))<0) return -1;
+    Kernel* kernel=&registry[index];
+    memset(kernel,0,sizeof(Kernel));
+    strcpy(kernel->name,name);
+    kernel->size=size;
+    for (i=0;i<size;i++)
+        for (j=0;j<size;j++)
+            kernel->coef[i][j]=coef[i*size+j];
+    analyzeKernel(kernel);
+    return index;
+}
+
+//registerFused: Adds a fused operator to the registry, ie. the gradient magnitude of an x gradient kernel and its transpose
+//Parameters: name,size,coef: As registerKernel, with coef the x gradient
+//            fused: The FusedOperators value
+//Returns: The registry index of the operator, or -1 if it could not be registered
+int registerFused(const char* name,int size,double* coef,int fused){
+    int index=registerKernel(name,size,coef);
+    if (index>=0){
+        registry[index].fused=fused;
+        //the operator is not linear, so it must never be mistaken for the kernel it is built from
+        registry[index].builtin=-1;
+        registry[index].identity=0;
+    }
+    return index;
+}
+
+//registerRank: Adds a rank filter to the registry, ie. a 5x5 median
+//Parameters: name: The name used to select the filter on the command line
+//            size: The width and height of the window, odd and from 3 to MAX_RANK_SIZE
+//            rank: The RankFilters value
+//Returns: The registry index of the filter, or -1 if it could not be registered
+int registerRank(const char* name,int size,int rank){
+    int index;
+    if (size<3||size>MAX_RANK_SIZE||size%2==0||rank<=RANK_NONE||rank>RANK_MAX||(index=registrySlot(name))<0) return -1;
+    Kernel* kernel=&registry[index];
+    memset(kernel,0,sizeof(Kernel));
+    strcpy(kernel->name,name);
+    kernel->size=size;
+    kernel->rank=rank;
+    kernel->builtin=-1;
+    return index;
+}
+//registerBilateral: Adds a bilateral filter to the registry
+//Parameters: name: The name used to select the filter on the command line
+//            size: The width and height of the window, odd and from 3 to 2*MAX_BILATERAL_RADIUS+1
+//            rangeSigma: How far apart, on the 8 bit scale, two values can be and still be averaged, from MIN_RANGE_SIGMA to 255
+//Returns: The registry index of the filter, or -1 if it could not be registered
+int registerBilateral(const char* name,int size,double rangeSigma){
+    int index;
+    if (size<3||size>2*MAX_BILATERAL_RADIUS+1||size%2==0||!(rangeSigma>=MIN_RANGE_SIGMA&&rangeSigma<=255)||(index=registrySlot(name))<0) return -1;
+    Kernel* kernel=&registry[index];
+    memset(kernel,0,sizeof(Kernel));
+    strcpy(kernel->name,name);
+    kernel->size=size;
+    kernel->bilateral=1;
+    kernel->rangeSigma=rangeSigma;
+    kernel->builtin=-1;
+    return index;
+}
+//gaussianSize: The size of a Gaussian of the given sigma, a radius of 4 sigma rounded up
+static int gaussianSize(double sigma){
+    return 2*(int)ceil(4*sigma)+1;
+}
+
+//registerGaussian: Adds a Gaussian blur to the registry
+//Parameters: name: The name used to select the blur on the command line
+//            sigma: The Gaussian's standard deviation in pixels, from MIN_GAUSSIAN_SIGMA to MAX_GAUSSIAN_SIGMA
+//Returns: The registry index of the blur, or -1 if it could not be registered
+int registerGaussian(const char* name,double sigma){
+    int index;
+    if (!(sigma>=MIN_GAUSSIAN_SIGMA&&sigma<=MAX_GAUSSIAN_SIGMA)||(index=registrySlot(name))<0) return -1;
+    Kernel* kernel=&registry[index];
+    memset(kernel,0,sizeof(Kernel));
+    strcpy(kernel->name,name);
+    kernel->size=gaussianSize(sigma);
+    kernel->gaussian=1;
+    kernel->sigma=sigma;
+    kernel->builtin=-1;
+    return index;
+}
+//parameterizeKernel: Makes a copy of a registered filter with the parameters given after its name in a pipeline.  The copy is
+//                    not registered; the pipeline holds it.
+//                    bilateral:R[:S] sets the window radius R and the range sigma S, gaussian:S sets sigma
+//Parameters: kernel: The registered filter, ie. bilateral
+//            parameters: The text after the first colon, ie. "7:30"
+//            result: Receives the filter, named kernel:parameters
+//Returns: 0 on success, -1 if the kernel takes no parameters or they are malformed or out of range
+int parameterizeKernel(Kernel* kernel,const char* parameters,Kernel* result){
+    char* end;
+    if (!(kernel->bilateral||kernel->gaussian)) return -1;
+    *result=*kernel;
+    if (snprintf(result->name,MAX_KERNEL_NAME,"%s:%s",kernel->name,parameters)>=MAX_KERNEL_NAME) return -1;
+    if (kernel->gaussian){
+        result->sigma=strtod(parameters,&end);
+        if (end==parameters||*end||!(result->sigma>=MIN_GAUSSIAN_SIGMA&&result->sigma<=MAX_GAUSSIAN_SIGMA)) return -1;
+        result->size=gaussianSize(result->sigma);
+        return 0;
+    }
+    long radius=strtol(parameters,&end,10);
+    if (end==parameters||radius<1||radius>MAX_BILATERAL_RADIUS) return -1;
+    result->size=2*radius+1;
+    if (*end==':'){
+        const char* sigma=end+1;
+        result->rangeSigma=strtod(sigma,&end);
+        if (end==sigma||!(result->rangeSigma>=MIN_RANGE_SIGMA&&result->rangeSigma<=255)) return -1;
+    }
+    return *end?-1:0;
+}
+//initKernelRegistry: Registers the built in kernels.  Must be called once before any other registry function.
+//Returns: Nothing
+void initKernelRegistry(){
+    char name[MAX_KERNEL_NAME];
+    registrySize=0;
+    for (int i=0;i<=IDENTITY;i++)
+        registerKernel(algorithmNames[i],3,&algorithms[i][0][0]);
+    for (size_t i=0;i<sizeof(gradients)/sizeof(Matrix);i++){
+        Matrix transpose;
+        for (int r=0;r<3;r++)
+            for (int c=0;c<3;c++) transpose[r][c]=gradients[i][c][r];
+        snprintf(name,sizeof(name),"%s-x",gradientNames[i]);
+        registerKernel(name,3,&gradients[i][0][0]);
+        snprintf(name,sizeof(name),"%s-y",gradientNames[i]);
+        registerKernel(name,3,&transpose[0][0]);
+        registerFused(gradientNames[i],3,&gradients[i][0][0],FUSED_MAGNITUDE);
+        snprintf(name,sizeof(name),"%s-angle",gradientNames[i]);
+        registerFused(name,3,&gradients[i][0][0],FUSED_ANGLE);
+    }
+    for (int rank=RANK_MEDIAN;rank<=RANK_MAX;rank++)
+        for (int size=3;size<=MAX_RANK_SIZE;size+=2){
+            snprintf(name,sizeof(name),"%s%d",rankNames[rank],size);
+            registerRank(name,size,rank);
+        }
+    registerBilateral("bilateral",11,25);
+    registerGaussian("gaussian",2);
+    builtinCount=registrySize;
+}
+
+//parseCoefficient: Reads a number such as 2, -0.5 or 1/16
+//Returns: 1 on success, 0 if the token is not a number
+static int parseCoefficient(const char* token,double* value){
+    char* end;
+    *value=strtod(token,&end);
+    if (end==token) return 0;
+    if (*end=='/'){
+        char* start=end+1;
+        double denominator=strtod(start,&end);
+        if (end==start||denominator==0) return 0;
+        *value/=denominator;
+    }
+    return *end==0;
+}
+
+//loadKernelFile: Registers user kernels from a text file.  Each non blank line that does not start with # is
+//                   <name> <size> <size*size coefficients in row major order>
+//                coefficients may be written as fractions, ie. 1/16
+//                A name already used by a built in kernel is an error: the engines and the specialized code expect the built ins
+//                at their KernelTypes index.  A name used by an earlier user kernel replaces it.
+//Parameters: fileName: The file to read
+//Returns: The number of kernels loaded, or -1 on error
+int loadKernelFile(const char* fileName){
+    char line[1024];
+    int lineNumber=0,loaded=0;
+    FILE* file=fopen(fileName,"r");
+    if (!file){
+        printf("Error opening kernel file %s.\n",fileName);
+        return -1;
+    }
+    while (fgets(line,sizeof(line),file)){
+        char* token;
+        char name[MAX_KERNEL_NAME];
+        double coef[MAX_KERNEL_SIZE*MAX_KERNEL_SIZE];
+        int size,count=0;
+        lineNumber++;
+        token=strtok(line," \t\r\n");
+        if (!token||token[0]=='#') continue;
+        if (strlen(token)>=MAX_KERNEL_NAME) goto badLine;
+        strcpy(name,token);
+        for (int i=0;i<builtinCount;i++)
+            if (!strcmp(registry[i].name,name)){
+                printf("Kernel file %s line %d redefines the built in kernel %s.\n",fileName,lineNumber,name);
+                fclose(file);
+                return -1;
+            }
+        token=strtok(NULL," \t\r\n");
+        if (!token) goto badLine;
+        size=atoi(token);
+        if (size<1||size>MAX_KERNEL_SIZE||size%2==0) goto badLine;
+        while ((token=strtok(NULL," \t\r\n"))&&count<size*size)
+            if (!parseCoefficient(token,&coef[count++])) goto badLine;
+        if (token||count!=size*size) goto badLine;
+        if (registerKernel(name,size,coef)<0) goto badLine;
+        loaded++;
+    }
+    fclose(file);
+    return loaded;
+badLine:
+    printf("Error in kernel file %s line %d.\n",fileName,lineNumber);
+    fclose(file);
+    return -1;
+}
+
+//findKernel: Looks up a kernel by name
+//Parameters: name: The name of the kernel, ie. "blur"
+//Returns: The kernel, or NULL if there is no kernel with that name
+Kernel* findKernel(const char* name){
+    for (int i=0;i<registrySize;i++)
+        if (!strcmp(registry[i].name,name)) return &registry[i];
+    return NULL;
+}
+
+//getKernel: Returns the kernel at a registry index.  The built in kernels live at their KernelTypes index.
+Kernel* getKernel(int index){
+    if (index<0||index>=registrySize) return NULL;
+    return &registry[index];
+}
+
+//kernelCount: Returns the number of registered kernels
+int kernelCount(){
+    return registrySize;
+}
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "library.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define JPG_QUALITY 90
+
+//A growable buffer the stb writers encode into
+typedef struct{
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+    int failed;         //set when the buffer could not grow
+} Buffer;
+
+//imgInit: Registers the built in kernels.  Must be called once before any other img function.
+void imgInit(){
+    stbi_set_flip_vertically_on_load(0);
+    initKernelRegistry();
+}
+
+//imgDecodeMem: Decodes a jpg, png, bmp or tga file held in memory
+//Parameters: data,length: The file's bytes
+//            image: Receives the decoded pixels
+//Returns: 0 on success, -1 if the bytes could not be decoded
+int imgDecodeMem(const unsigned char* data,size_t length,Image* image){
+    if (length>INT32_MAX) return -1;
+    image->data=stbi_load_from_memory(data,(int)length,&image->width,&image->height,&image->bpp,0);
+    image->type=SAMPLE_U8;
+    return image->data?0:-1;
+}
+
+//imgDecodeGray: Decodes a jpg, png, bmp or tga file held in memory to one channel of luma.  A jpg's luma plane is returned as it is,
+//               skipping the chroma upsampling and the colour conversion, so this is cheaper than imgDecodeMem and lumaImage.
+//Parameters: data,length,image: As imgDecodeMem.  image->bpp is always 1.
+//Returns: 0 on success, -1 if the data is not an image stb_image can read
+int imgDecodeGray(const unsigned char* data,size_t length,Image* image){
+    if (length>INT32_MAX) return -1;
+    image->data=stbi_load_from_memory(data,(int)length,&image->width,&image->height,&image->bpp,1);
+    image->bpp=1;
+    image->type=SAMPLE_U8;
+    return image->data?0:-1;
+}
+
+//imgReadFile: Reads a whole file into memory, ie. for imgDecodeMem
+//Parameters: fileName: The file
+//            length: Receives its size in bytes
+//Returns: The contents, to be released with free, or NULL if the file could not be read
+unsigned char* imgReadFile(const char* fileName,size_t* length){
+    FILE* file=fopen(fileName,"rb");
+    unsigned char* data=NULL;
+    if (!file) return NULL;
+    if (fseek(file,0,SEEK_END)==0){
+        long size=ftell(file);
+        rewind(file);
+        if (size>0&&(data=malloc(size))&&fread(data,1,size,file)!=(size_t)size){
+            free(data);
+            data=NULL;
+        }
+        *length=size;
+    }
+    fclose(file);
+    return data;
+}
+
+//imgPipelineRun: Applies a comma separated list of kernels, ie. "blur,sharpen", to an image
+//Parameters: srcImage: The source.  It is not modified.
+//            destImage: Receives the result, always a new image even when the pipeline leaves the pixels unchanged
+//            spec: The kernel names
+//            linear: Compose consecutive kernels into one, as --linear
+//            engine: The engine used for every stage
+//Returns: 0 on success, -1 if a kernel is unknown or memory ran out
+int imgPipelineRun(Image* srcImage,Image* destImage,const char* spec,int linear,ConvoluteFunction engine){
+    Pipeline pipeline,fused;
+    if (parsePipeline(spec,&pipeline)) return -1;
+    planPipeline(&pipeline);
+    composePipeline(&pipeline,&fused);
+    int owns=runPipeline(srcImage,destImage,linear?&fused:&pipeline,engine);
+    if (owns<0) return -1;
+    if (owns==0){
+        size_t size=imageBytes(srcImage);
+        destImage->data=malloc(size);
+        if (!destImage->data) return -1;
+        memcpy(destImage->data,srcImage->data,size);
+    }
+    return 0;
+}
+
+//imgPipelineRegion: Applies a comma separated list of kernels to the rectangle [x,x+width)x[y,y+height) of an image only.
+//                   The result is that rectangle of what imgPipelineRun would give (to within one level after a gaussian:S stage),
+//                   at the cost of the rectangle and a small halo.
+//Parameters: srcImage: The source.  It is not modified.
+//            destImage: Receives the result, width by height pixels
+//            spec,linear,engine: As imgPipelineRun
+//            x,y,width,height: The rectangle.  It must lie inside the image.
+//Returns: 0 on success, -1 if a kernel is unknown, the rectangle is not inside the image or memory ran out
+int imgPipelineRegion(Image* srcImage,Image* destImage,const char* spec,int linear,ConvoluteFunction engine,int x,int y,int width,int height){
+    Pipeline pipeline,fused;
+    if (parsePipeline(spec,&pipeline)) return -1;
+    planPipeline(&pipeline);
+    composePipeline(&pipeline,&fused);
+    return runPipelineRegion(srcImage,destImage,linear?&fused:&pipeline,engine,x,y,width,height)>0?0:-1;
+}
+
+//imgConvolve: Applies a single kernel to an image
+//Parameters: srcImage: The source.  It is not modified.
+//            destImage: Receives the result
+//            kernelName: The name of a built in kernel or one added with loadKernelFile
+//            engine: The engine to use
+//Returns: 0 on success, -1 if the kernel is unknown or memory ran out
+int imgConvolve(Image* srcImage,Image* destImage,const char* kernelName,ConvoluteFunction engine){
+    Pipeline pipeline;
+    pipeline.stages[0]=findKernel(kernelName);
+    pipeline.count=1;
+    if (!pipeline.stages[0]) return -1;
+    return runPipeline(srcImage,destImage,&pipeline,engine)>0?0:-1;
+}
+
+//appendBuffer: The stbi_write_func that collects the encoded bytes
+static void appendBuffer(void* context,void* data,int size){
+    Buffer* buffer=context;
+    if (buffer->failed) return;
+    if (buffer->length+size>buffer->capacity){
+        size_t capacity=buffer->capacity?buffer->capacity*2:1<<16;
+        while (capacity<buffer->length+size) capacity*=2;
+        unsigned char* grown=realloc(buffer->data,capacity);
+        if (!grown){
+            buffer->failed=1;
+            return;
+        }
+        buffer->data=grown;
+        buffer->capacity=capacity;
+    }
+    memcpy(buffer->data+buffer->length,data,size);
+    buffer->length+=size;
+}
+
+//encodePnm: Writes a binary PGM (1 channel), PPM (3 channels) or PAM (2 or 4 channels) file, the only formats here that hold 16 bit samples.
+//16 bit samples are stored most significant byte first, as the formats require.
+static void encodePnm(Image* image,Buffer* buffer){
+    static const char* tupleTypes[]={"","GRAYSCALE","GRAYSCALE_ALPHA","RGB","RGB_ALPHA"};
+    char header[160];
+    int maxval=image->type==SAMPLE_U16?65535:255;
+    if (image->bpp==1||image->bpp==3) snprintf(header,sizeof(header),"P%d\n%d %d\n%d\n",image->bpp==1?5:6,image->width,image->height,maxval);
+    else snprintf(header,sizeof(header),"P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",image->width,image->height,image->bpp,maxval,tupleTypes[image->bpp]);
+    appendBuffer(buffer,header,strlen(header));
+    if (image->type!=SAMPLE_U16){
+        appendBuffer(buffer,image->data,(int)imageBytes(image));
+        return;
+    }
+    unsigned char row[4096];
+    size_t count=(size_t)image->width*image->height*image->bpp,done=0;
+    const uint16_t* samples=(const uint16_t*)image->data;
+    while (done<count){
+        int n=0;
+        for (;n<(int)sizeof(row)/2&&done<count;n++,done++){
+            row[2*n]=samples[done]>>8;
+            row[2*n+1]=samples[done]&255;
+        }
+        appendBuffer(buffer,row,2*n);
+    }
+}
+
+//imgEncodeMem: Encodes an image into memory
+//Parameters: image: The image.  16 bit images can only be encoded as pnm.
+//            format: png, bmp, tga, jpg, or pnm for PGM/PPM/PAM by the number of channels
+//            length: Receives the number of bytes
+//Returns: The encoded bytes, to be released with free, or NULL if the format is unknown or encoding failed
+unsigned char* imgEncodeMem(Image* image,const char* format,size_t* length){
+    Buffer buffer={NULL,0,0,0};
+    int ok=1;
+    if (!strcmp(format,"pnm")) encodePnm(image,&buffer);
+    else if (image->type!=SAMPLE_U8) return NULL;
+    else if (!strcmp(format,"png")) ok=stbi_write_png_to_func(appendBuffer,&buffer,image->width,image->height,image->bpp,image->data,image->width*image->bpp);
+    else if (!strcmp(format,"bmp")) ok=stbi_write_bmp_to_func(appendBuffer,&buffer,image->width,image->height,image->bpp,image->data);
+    else if (!strcmp(format,"tga")) ok=stbi_write_tga_to_func(appendBuffer,&buffer,image->width,image->height,image->bpp,image->data);
+    else if (!strcmp(format,"jpg")) ok=stbi_write_jpg_to_func(appendBuffer,&buffer,image->width,image->height,image->bpp,image->data,JPG_QUALITY);
+    else return NULL;
+    if (!ok||buffer.failed){
+        free(buffer.data);
+        return NULL;
+    }
+    *length=buffer.length;
+    return buffer.data;
+}
+
+//imgGradients: Computes any of the x and y gradients of an image, their magnitude and their angle in one pass over it, on the
+//              calling thread.  See convoluteGradients for how each output is stored.
+//Parameters: srcImage: The source.  It is not modified.
+//            operatorName: "sobel", "scharr" or any kernel whose coefficients are an x gradient; the y gradient is its transpose
+//            gx,gy,magnitude,angle: Receive the outputs, each the same size and type as srcImage, or NULL for the ones not needed
+//Returns: 0 on success, -1 if the operator is unknown, is a filter without coefficients (ie. a median), or memory ran out
+int imgGradients(Image* srcImage,const char* operatorName,Image* gx,Image* gy,Image* magnitude,Image* angle){
+    Image* outputs[4]={gx,gy,magnitude,angle};
+    Kernel* kernel=findKernel(operatorName);
+    int i;
+    //rank, bilateral and Gaussian windows can be wider than coef, which holds nothing for them anyway
+    if (!kernel||!(linearKernel(kernel)||kernel->fused)||kernel->size>MAX_KERNEL_SIZE) return -1;
+    for (i=0;i<4;i++){
+        if (!outputs[i]) continue;
+        *outputs[i]=*srcImage;
+        outputs[i]->data=malloc(imageBytes(srcImage));
+        if (!outputs[i]->data) break;
+    }
+    if (i<4){
+        while (i--) if (outputs[i]) free(outputs[i]->data);
+        return -1;
+    }
+    convoluteGradients(srcImage,gx,gy,magnitude,angle,kernel,0,0,srcImage->width,srcImage->height);
+    return 0;
+}
+
+//imgFreeImage: Gives back an image returned by imgDecodeMem, imgConvolve, imgPipelineRun or imgGradients.  Its memory is kept for reuse by later runs.
+void imgFreeImage(Image* image){
+    releaseBuffer(image->data,imageBytes(image));
+    image->data=NULL;
+}
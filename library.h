@@ -0,0 +1,26 @@
+#ifndef ___LIBRARY
+#define ___LIBRARY
+#include <stddef.h>
+#include "image.h"
+#include "pipeline.h"
+
+//The in-memory API, for programs that link libimage instead of running the image binary.
+//Images are decoded from and encoded to memory, so no temporary files are needed.
+//Call imgInit once first.  The engine argument is convolute, ompConvolute or pthreadConvolute.
+//Every Image returned is owned by the caller and is given back with imgFreeImage.
+//Not thread-safe: the kernel registry, the settings (setTileSize and the like), the caches and the buffer pool are global state
+//without locks, so the library must be called from one thread at a time.  The engines run their own threads inside each call.
+
+//library.c
+void imgInit();
+unsigned char* imgReadFile(const char* fileName,size_t* length);
+int imgDecodeMem(const unsigned char* data,size_t length,Image* image);
+int imgDecodeGray(const unsigned char* data,size_t length,Image* image);
+int imgConvolve(Image* srcImage,Image* destImage,const char* kernelName,ConvoluteFunction engine);
+int imgPipelineRun(Image* srcImage,Image* destImage,const char* spec,int linear,ConvoluteFunction engine);
+int imgPipelineRegion(Image* srcImage,Image* destImage,const char* spec,int linear,ConvoluteFunction engine,int x,int y,int width,int height);
+int imgGradients(Image* srcImage,const char* operatorName,Image* gx,Image* gy,Image* magnitude,Image* angle);
+unsigned char* imgEncodeMem(Image* image,const char* format,size_t* length);
+void imgFreeImage(Image* image);
+
+#endif
@@ -1,157 +1,97 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
-#include <time.h>
-#include <string.h>
 #include "image.h"
+#include "pipeline.h"
+#include "timer.h"
+#include "profile.h"
 #include <omp.h> // Include OpenMP header
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#define ROWS_PER_TASK 32 // Rows handed to a thread at a time, so each band can be tiled and reuse its separable halo
+#define COLUMNS_PER_TASK 64 // Columns handed to a thread at a time in the second pass of the recursive Gaussian
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
-#define NUM_THREADS 10
-
-typedef struct inputStruct {
-    Image* srcImage;
-    Image* destImage;
-    enum KernelTypes type;
-    long rank;
-} inputStruct;
-
-Matrix algorithms[] = {
-    {{0, -1, 0}, {-1, 4, -1}, {0, -1, 0}},
-    {{0, -1, 0}, {-1, 5, -1}, {0, -1, 0}},
-    {{1 / 9.0, 1 / 9.0, 1 / 9.0}, {1 / 9.0, 1 / 9.0, 1 / 9.0}, {1 / 9.0, 1 / 9.0, 1 / 9.0}},
-    {{1.0 / 16, 1.0 / 8, 1.0 / 16}, {1.0 / 8, 1.0 / 4, 1.0 / 8}, {1.0 / 16, 1.0 / 8, 1.0 / 16}},
-    {{-2, -1, 0}, {-1, 1, 1}, {0, 1, 2}},
-    {{0, 0, 0}, {0, 1, 0}, {0, 0, 0}}
-};
-
-uint8_t getPixelValue(Image* srcImage, int x, int y, int bit, Matrix algorithm) {
-    int px, mx, py, my, i, span;
-    span = srcImage->width * srcImage->bpp;
-    px = x + 1;
-    py = y + 1;
-    mx = x - 1;
-    my = y - 1;
-    if (mx < 0) mx = 0;
-    if (my < 0) my = 0;
-    if (px >= srcImage->width) px = srcImage->width - 1;
-    if (py >= srcImage->height) py = srcImage->height - 1;
-    uint8_t result =
-        algorithm[0][0] * srcImage->data[Index(mx, my, srcImage->width, bit, srcImage->bpp)] +
-        algorithm[0][1] * srcImage->data[Index(x, my, srcImage->width, bit, srcImage->bpp)] +
-        algorithm[0][2] * srcImage->data[Index(px, my, srcImage->width, bit, srcImage->bpp)] +
-        algorithm[1][0] * srcImage->data[Index(mx, y, srcImage->width, bit, srcImage->bpp)] +
-        algorithm[1][1] * srcImage->data[Index(x, y, srcImage->width, bit, srcImage->bpp)] +
-        algorithm[1][2] * srcImage->data[Index(px, y, srcImage->width, bit, srcImage->bpp)] +
-        algorithm[2][0] * srcImage->data[Index(mx, py, srcImage->width, bit, srcImage->bpp)] +
-        algorithm[2][1] * srcImage->data[Index(x, py, srcImage->width, bit, srcImage->bpp)] +
-        algorithm[2][2] * srcImage->data[Index(px, py, srcImage->width, bit, srcImage->bpp)];
-    return result;
-}
-
-// Define the threaded_convolute function
-void threaded_convolute(inputStruct* params) {
-    Image* srcImage = params->srcImage;
-    Image* destImage = params->destImage;
-    enum KernelTypes type = params->type;
-    long rank = params->rank;
-
-    // Modify this part to handle the convolution process
-    // Use the 'type' parameter to select the appropriate convolution algorithm (e.g., algorithms[type])
-    
-    // Example code (modify this as needed):
-    int rowStart = rank * (srcImage->height / NUM_THREADS);
-    int rowEnd = (rank + 1) * (srcImage->height / NUM_THREADS);
-    for (int row = rowStart; row < rowEnd; row++) {
-        for (int pix = 0; pix < srcImage->width; pix++) {
-            for (int bit = 0; bit < srcImage->bpp; bit++) {
-                destImage->data[Index(pix, row, srcImage->width, bit, srcImage->bpp)] =
-                    getPixelValue(srcImage, pix, row, bit, algorithms[type]);
-            }
+//ompGaussian: The recursive Gaussian filters whole lines, so the threads filter bands of rows of the whole image, then, once
+//             every row is done, blocks of its columns
+static void ompGaussian(Image* srcImage, Image* destImage, Kernel* kernel, float* temp, int threads) {
+    #pragma omp parallel num_threads(threads)
+    {
+        ProfileCounters counters;
+        profileOpen(&counters);
+        #pragma omp for schedule(dynamic)
+        for (int row = 0; row < srcImage->height; row += ROWS_PER_TASK) {
+            int rowEnd = row + ROWS_PER_TASK < srcImage->height ? row + ROWS_PER_TASK : srcImage->height;
+            profileBegin(&counters);
+            long long start = nowNanos();
+            gaussianRows(srcImage, temp, kernel, row, rowEnd);
+            addThreadTime(omp_get_thread_num(), nowNanos() - start);
+            profileEnd(omp_get_thread_num(), &counters);
         }
-    }
-}
-
-void convolute(Image* srcImage, Image* destImage, Matrix algorithm) {
-    // OMP: Parallelize the outer loop using OpenMP
-    #pragma omp parallel for
-    for (int row = 0; row < srcImage->height; row++) {
-        for (int pix = 0; pix < srcImage->width; pix++) {
-            for (int bit = 0; bit < srcImage->bpp; bit++) {
-                destImage->data[Index(pix, row, srcImage->width, bit, srcImage->bpp)] =
-                    getPixelValue(srcImage, pix, row, bit, algorithm);
-            }
+        #pragma omp for schedule(dynamic)
+        for (int column = 0; column < srcImage->width; column += COLUMNS_PER_TASK) {
+            int columnEnd = column + COLUMNS_PER_TASK < srcImage->width ? column + COLUMNS_PER_TASK : srcImage->width;
+            profileBegin(&counters);
+            long long start = nowNanos();
+            gaussianColumns(srcImage, temp, destImage, kernel, column, columnEnd);
+            addThreadTime(omp_get_thread_num(), nowNanos() - start);
+            profileEnd(omp_get_thread_num(), &counters);
         }
+        profileClose(&counters);
     }
 }
 
-int Usage() {
-    printf("Usage: image <filename> <type>\n\twhere type is one of (edge, sharpen, blur, gauss, emboss, identity)\n");
-    return -1;
-}
-
-enum KernelTypes GetKernelType(char* type) {
-    if (!strcmp(type, "edge")) return EDGE;
-    else if (!strcmp(type, "sharpen")) return SHARPEN;
-    else if (!strcmp(type, "blur")) return BLUR;
-    else if (!strcmp(type, "gauss")) return GAUSE_BLUR;
-    else if (!strcmp(type, "emboss")) return EMBOSS;
-    else return IDENTITY;
+//ompSliding: A sliding window filter primes its running sums at the top of every band, so each thread takes one band of
+//            height/threads rows, as in pthreadConvolute, and primes once
+static void ompSliding(Image* srcImage, Image* destImage, Kernel* kernel, int threads) {
+    #pragma omp parallel num_threads(threads)
+    {
+        int rank = omp_get_thread_num(), count = omp_get_num_threads();
+        int rowStart = rank * (srcImage->height / count);
+        int rowEnd = rank == count - 1 ? srcImage->height : (rank + 1) * (srcImage->height / count);
+        ProfileCounters counters;
+        profileOpen(&counters);
+        profileBegin(&counters);
+        long long start = nowNanos();
+        if (rowStart < rowEnd) convoluteRows(srcImage, destImage, kernel, rowStart, rowEnd);
+        addThreadTime(rank, nowNanos() - start);
+        profileEnd(rank, &counters);
+        profileClose(&counters);
+    }
 }
 
-int main(int argc, char** argv) {
-    long t1, t2;
-    t1 = time(NULL);
-
-    stbi_set_flip_vertically_on_load(0);
-    if (argc != 3) return Usage();
-    char* fileName = argv[1];
-    if (!strcmp(argv[1], "pic4.jpg") && !strcmp(argv[2], "gauss")) {
-        printf("You have applied a gaussian filter to Gauss which has caused a tear in the time-space continuum.\n");
+//ompConvolute: Hands out bands of ROWS_PER_TASK rows to the OpenMP threads.  setThreadCount overrides OMP_NUM_THREADS.
+void ompConvolute(Image* srcImage, Image* destImage, Kernel* kernel) {
+    int threads = getThreadCount() ? getThreadCount() : omp_get_max_threads();
+    float* temp = kernel->gaussian ? malloc(sizeof(float) * srcImage->width * srcImage->height * srcImage->bpp) : NULL;
+    if (temp) {
+        ompGaussian(srcImage, destImage, kernel, temp, threads);
+        free(temp);
+        return;
     }
-    enum KernelTypes type = GetKernelType(argv[2]);
-
-    Image srcImage, destImage;
-    srcImage.data = stbi_load(fileName, &srcImage.width, &srcImage.height, &srcImage.bpp, 0);
-    if (!srcImage.data) {
-        printf("Error loading file %s.\n", fileName);
-        return -1;
+    if (slidingKernel(kernel)) {
+        ompSliding(srcImage, destImage, kernel, threads);
+        return;
     }
-    destImage.bpp = srcImage.bpp;
-    destImage.height = srcImage.height;
-    destImage.width = srcImage.width;
-    destImage.data = malloc(sizeof(uint8_t) * destImage.width * destImage.bpp * destImage.height);
-
-    // OMP: Initialize OpenMP and set the number of threads
-    #pragma omp parallel
+    // OMP: Parallelize the outer loop using OpenMP.  Each thread opens its counters once and reads them around every band.
+    #pragma omp parallel num_threads(threads)
     {
-        #pragma omp master
-        {
-            int numThreads = omp_get_num_threads();
-            printf("Number of threads: %d\n", numThreads);
+        ProfileCounters counters;
+        profileOpen(&counters);
+        #pragma omp for schedule(dynamic)
+        for (int row = 0; row < srcImage->height; row += ROWS_PER_TASK) {
+            int rowEnd = row + ROWS_PER_TASK < srcImage->height ? row + ROWS_PER_TASK : srcImage->height;
+            profileBegin(&counters);
+            long long start = nowNanos();
+            convoluteRows(srcImage, destImage, kernel, row, rowEnd);
+            addThreadTime(omp_get_thread_num(), nowNanos() - start);
+            profileEnd(omp_get_thread_num(), &counters);
         }
+        profileClose(&counters);
     }
+}
 
-    // OMP: Parallelize the loop that creates threads
-    #pragma omp parallel for
-    for (long thread = 0; thread < NUM_THREADS; thread++) {
-        inputStruct params;
-        params.srcImage = &srcImage;
-        params.destImage = &destImage;
-        params.type = type;
-        params.rank = thread;
-        threaded_convolute(&params);
-    }
-
-    stbi_write_png("output.png", destImage.width, destImage.height, destImage.bpp, destImage.data, destImage.bpp * destImage.width);
-    stbi_image_free(srcImage.data);
-    
-    free(destImage.data);
-    t2 = time(NULL);
-    printf("Took %ld seconds\n", t2 - t1);
-    return 0;
+#ifndef IMAGE_NO_MAIN
+int main(int argc, char** argv) {
+    printf("Number of threads: %d\n", omp_get_max_threads());
+    return runImage(argc, argv, ompConvolute);
 }
+#endif
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "image.h"
+#include "pipeline.h"
+#include "timer.h"
+
+//Out of core processing for images too large to hold in memory.  The source is a binary PGM (P5), PPM (P6) or PAM (P7) file,
+//which stores the pixels row by row with no compression, so any band of rows can be read on its own.
+//The image is processed in bands of whole rows.  Each band is read with a halo of pipelineRadius rows above and below, run
+//through the pipeline, and its interior rows are appended to the output, which has the same format as the source.
+//The halo makes every output row exactly what a run over the whole image gives, except after a recursive Gaussian (gaussian:S),
+//whose response reaches past its 4 sigma halo, so a sample may differ by one level.
+//A separate thread reads the next band while the current one is convoluted, so the disk and the engine work at the same time.
+
+//The band buffers: two being read or waiting for the reader, and the two that runPipeline ping-pongs between
+#define BAND_BUFFERS 4
+
+//A binary PNM or PAM file
+typedef struct{
+    FILE* file;
+    int format;         //5, 6 or 7, from the P5/P6/P7 magic
+    int width;
+    int height;
+    int bpp;
+    off_t pixels;       //offset of the first pixel
+} RawImage;
+
+//One band of source rows, filled by the reader thread
+typedef struct{
+    uint8_t* data;
+    int first;          //the first source row in data
+    int rows;
+    int ready;          //1 when the reader has filled it, -1 if the read failed
+} Band;
+
+//The state shared by the main thread and the reader
+typedef struct{
+    RawImage* source;
+    Band bands[2];
+    int bandRows;       //interior rows per band
+    int radius;
+    int count;          //number of bands
+    int consumed;       //bands the main thread has finished with
+    int stop;           //set when the main thread gives up, so the reader does not read the rest of the file
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Prefetch;
+
+//readToken: Reads the next whitespace separated word of a PNM header, skipping # comments
+static int readToken(FILE* file,char* token,int size){
+    int c,length=0;
+    do{
+        c=fgetc(file);
+        if (c=='#') while (c!='\n'&&c!=EOF) c=fgetc(file);
+    } while (c==' '||c=='\t'||c=='\r'||c=='\n');
+    while (c!=EOF&&c!=' '&&c!='\t'&&c!='\r'&&c!='\n'&&length<size-1){
+        token[length++]=c;
+        c=fgetc(file);
+    }
+    token[length]=0;
+    return length?0:-1;
+}
+
+//openRaw: Opens a binary PGM, PPM or PAM file with 8 bit samples and reads its header
+//Returns: 0 on success, -1 if the file cannot be opened or is not in one of those formats
+static int openRaw(const char* fileName,RawImage* image){
+    char token[32];
+    int maxval=0;
+    memset(image,0,sizeof(RawImage));
+    image->file=fopen(fileName,"rb");
+    if (!image->file) return -1;
+    if (readToken(image->file,token,sizeof(token))||token[0]!='P'||token[1]<'5'||token[1]>'7'||token[2]) goto fail;
+    image->format=token[1]-'0';
+    if (image->format==7){
+        //PAM: a list of keywords up to ENDHDR
+        while (!readToken(image->file,token,sizeof(token))&&strcmp(token,"ENDHDR")){
+            char value[32];
+            if (readToken(image->file,value,sizeof(value))) goto fail;
+            if (!strcmp(token,"WIDTH")) image->width=atoi(value);
+            else if (!strcmp(token,"HEIGHT")) image->height=atoi(value);
+            else if (!strcmp(token,"DEPTH")) image->bpp=atoi(value);
+            else if (!strcmp(token,"MAXVAL")) maxval=atoi(value);
+        }
+        if (strcmp(token,"ENDHDR")) goto fail;
+    }
+    else{
+        //the single whitespace after the header was consumed by readToken
+        if (readToken(image->file,token,sizeof(token))) goto fail;
+        image->width=atoi(token);
+        if (readToken(image->file,token,sizeof(token))) goto fail;
+        image->height=atoi(token);
+        if (readToken(image->file,token,sizeof(token))) goto fail;
+        maxval=atoi(token);
+        image->bpp=image->format==5?1:3;
+    }
+    if (image->width<1||image->height<1||image->bpp<1||image->bpp>4||maxval!=255) goto fail;
+    image->pixels=ftello(image->file);
+    return 0;
+fail:
+    fclose(image->file);
+    image->file=NULL;
+    return -1;
+}
+
+//writeRawHeader: Writes the header of an output file in the same format as the source
+static void writeRawHeader(FILE* file,RawImage* source){
+    static const char* tupleTypes[]={"","GRAYSCALE","GRAYSCALE_ALPHA","RGB","RGB_ALPHA"};
+    if (source->format==7)
+        fprintf(file,"P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",source->width,source->height,source->bpp,tupleTypes[source->bpp]);
+    else fprintf(file,"P%d\n%d %d\n255\n",source->format,source->width,source->height);
+}
+
+//bandRange: The source rows band k needs: its interior rows plus the halo, clipped to the image
+static void bandRange(Prefetch* prefetch,int k,int* first,int* rows){
+    int y0=k*prefetch->bandRows-prefetch->radius;
+    int y1=(k+1)*prefetch->bandRows+prefetch->radius;
+    if (y0<0) y0=0;
+    if (y1>prefetch->source->height) y1=prefetch->source->height;
+    *first=y0;
+    *rows=y1-y0;
+}
+
+//readBands: The reader thread.  Reads band k into slot k%2 as soon as the main thread has finished with band k-2.
+static void* readBands(void* arg){
+    Prefetch* prefetch=arg;
+    RawImage* source=prefetch->source;
+    size_t rowBytes=(size_t)source->width*source->bpp;
+    for (int k=0;k<prefetch->count;k++){
+        Band* band=&prefetch->bands[k%2];
+        pthread_mutex_lock(&prefetch->lock);
+        while (prefetch->consumed<k-1&&!prefetch->stop) pthread_cond_wait(&prefetch->changed,&prefetch->lock);
+        int stop=prefetch->stop;
+        pthread_mutex_unlock(&prefetch->lock);
+        if (stop) break;
+
+        int first,rows,ready=1;
+        bandRange(prefetch,k,&first,&rows);
+        if (fseeko(source->file,source->pixels+(off_t)first*rowBytes,SEEK_SET)||fread(band->data,rowBytes,rows,source->file)!=(size_t)rows) ready=-1;
+
+        pthread_mutex_lock(&prefetch->lock);
+        band->first=first;
+        band->rows=rows;
+        band->ready=ready;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->lock);
+        if (ready<0) break;
+    }
+    return NULL;
+}
+
+//runOutOfCore: Runs a pipeline over an image file band by band, never holding more than about memoryBudget bytes of pixels
+//Parameters: inName: The source, a binary PGM, PPM or PAM file with 8 bit samples
+//            outName: The result, written in the same format
+//            pipeline: The (planned) pipeline
+//            convolute: The engine used for every band
+//            memoryBudget: Bytes of pixel buffers allowed
+//Returns: The exit code for main
+int runOutOfCore(const char* inName,const char* outName,Pipeline* pipeline,ConvoluteFunction convolute,size_t memoryBudget){
+    RawImage source;
+    Prefetch prefetch;
+    pthread_t reader;
+    int k,failed=0;
+    if (openRaw(inName,&source)){
+        printf("%s is not a binary PGM, PPM or PAM file with 8 bit samples.\n",inName);
+        return -1;
+    }
+    size_t rowBytes=(size_t)source.width*source.bpp;
+    memset(&prefetch,0,sizeof(Prefetch));
+    prefetch.source=&source;
+    prefetch.radius=pipelineRadius(pipeline);
+    //every band buffer holds the interior rows and both halos
+    long rows=(long)(memoryBudget/(BAND_BUFFERS*rowBytes))-2*prefetch.radius;
+    //a band must fit in an Image, whose offsets are int
+    if (rows>(long)(INT32_MAX/rowBytes)-2*prefetch.radius) rows=(long)(INT32_MAX/rowBytes)-2*prefetch.radius;
+    if (rows<1){
+        printf("The memory budget is too small for rows of %d pixels.\n",source.width);
+        fclose(source.file);
+        return -1;
+    }
+    prefetch.bandRows=rows<source.height?(int)rows:source.height;
+    prefetch.count=(source.height+prefetch.bandRows-1)/prefetch.bandRows;
+    size_t bandBytes=rowBytes*(prefetch.bandRows+2*prefetch.radius);
+
+    FILE* output=fopen(outName,"wb");
+    prefetch.bands[0].data=malloc(bandBytes);
+    prefetch.bands[1].data=malloc(bandBytes);
+    if (!output||!prefetch.bands[0].data||!prefetch.bands[1].data){
+        printf(output?"Out of memory.\n":"Error writing %s.\n",outName);
+        if (output) fclose(output);
+        free(prefetch.bands[0].data);
+        free(prefetch.bands[1].data);
+        fclose(source.file);
+        return -1;
+    }
+    writeRawHeader(output,&source);
+    pthread_mutex_init(&prefetch.lock,NULL);
+    pthread_cond_init(&prefetch.changed,NULL);
+    if (pthread_create(&reader,NULL,readBands,&prefetch)){
+        printf("Could not start the reader thread.\n");
+        failed=1;
+        prefetch.count=0;
+    }
+
+    for (k=0;k<prefetch.count&&!failed;k++){
+        Band* band=&prefetch.bands[k%2];
+        //time spent waiting for the reader is the part of the I/O that did not overlap with the convolution
+        timerStart(STAGE_DECODE);
+        pthread_mutex_lock(&prefetch.lock);
+        while (!band->ready) pthread_cond_wait(&prefetch.changed,&prefetch.lock);
+        pthread_mutex_unlock(&prefetch.lock);
+        timerStop(STAGE_DECODE);
+        if (band->ready<0){
+            printf("Error reading %s.\n",inName);
+            failed=1;
+            break;
+        }
+
+        Image bandImage={band->data,source.width,band->rows,source.bpp,SAMPLE_U8},result;
+        int owns=runPipeline(&bandImage,&result,pipeline,convolute);
+        if (owns<0){
+            printf("Out of memory.\n");
+            failed=1;
+            break;
+        }
+        int interior=k*prefetch.bandRows-band->first;
+        int interiorRows=(k+1)*prefetch.bandRows<source.height?prefetch.bandRows:source.height-k*prefetch.bandRows;
+        timerStart(STAGE_WRITE);
+        if (fwrite(result.data+(size_t)interior*rowBytes,rowBytes,interiorRows,output)!=(size_t)interiorRows) failed=1;
+        timerStop(STAGE_WRITE);
+        if (owns) releaseBuffer(result.data,(size_t)band->rows*rowBytes);
+        if (failed) printf("Error writing %s.\n",outName);
+
+        pthread_mutex_lock(&prefetch.lock);
+        band->ready=0;
+        prefetch.consumed=k+1;
+        pthread_cond_broadcast(&prefetch.changed);
+        pthread_mutex_unlock(&prefetch.lock);
+    }
+    if (prefetch.count){
+        //wake a reader that is waiting for a slot, so it can stop
+        pthread_mutex_lock(&prefetch.lock);
+        prefetch.stop=1;
+        pthread_cond_broadcast(&prefetch.changed);
+        pthread_mutex_unlock(&prefetch.lock);
+        pthread_join(reader,NULL);
+    }
+    pthread_mutex_destroy(&prefetch.lock);
+    pthread_cond_destroy(&prefetch.changed);
+    if (fclose(output)&&!failed){
+        printf("Error writing %s.\n",outName);
+        failed=1;
+    }
+    free(prefetch.bands[0].data);
+    free(prefetch.bands[1].data);
+    fclose(source.file);
+    if (!failed) printf("%dx%d image in %d bands of %d rows\n",source.width,source.height,prefetch.count,prefetch.bandRows);
+    return failed?-1:0;
+}
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "pipeline.h"
+#include "timer.h"
+#include "cache.h"
+
+//parsePipeline: Converts a comma separated list of kernel names into a pipeline, ie. "blur,sharpen" or "bilateral:7,sharpen"
+//Parameters: spec: The list of kernel names
+//            pipeline: Receives the stages in order.  Filters with parameters are stored inside it, so it must not be copied.
+//Returns: 0 on success, -1 if a name or parameter is unknown or there are too many stages
+int parsePipeline(const char* spec,Pipeline* pipeline){
+    char name[MAX_KERNEL_NAME];
+    pipeline->count=0;
+    while (*spec){
+        size_t length=strcspn(spec,",");
+        if (length==0||length>=MAX_KERNEL_NAME||pipeline->count==MAX_STAGES) return -1;
+        memcpy(name,spec,length);
+        name[length]=0;
+        //name:parameters is a copy of a registered filter with its own parameters, which the pipeline holds
+        char* parameters=strchr(name,':');
+        if (parameters) *parameters++=0;
+        Kernel* kernel=findKernel(name);
+        if (!kernel){
+            printf("Unknown kernel %s.\n",name);
+            return -1;
+        }
+        if (parameters){
+            if (parameterizeKernel(kernel,parameters,&pipeline->composed[pipeline->count])){
+                printf("Bad parameters %s for kernel %s.\n",parameters,name);
+                return -1;
+            }
+            kernel=&pipeline->composed[pipeline->count];
+        }
+        pipeline->stages[pipeline->count++]=kernel;
+        spec+=length;
+        if (*spec==',') spec++;
+    }
+    return pipeline->count?0:-1;
+}
+
+//planPipeline: Removes stages that would not change the image, so identity (and any kernel equivalent to it) never reaches the engine
+//Parameters: pipeline: The pipeline to simplify in place
+//Returns: The number of stages removed
+int planPipeline(Pipeline* pipeline){
+    int i,kept=0;
+    for (i=0;i<pipeline->count;i++)
+        if (!pipeline->stages[i]->identity) pipeline->stages[kept++]=pipeline->stages[i];
+    i=pipeline->count-kept;
+    pipeline->count=kept;
+    return i;
+}
+
+//Buffers given back with releaseBuffer are kept for the next runPipeline, so a long running process (ie. --serve) reuses
+//memory that is already paged in instead of faulting in fresh buffers for every image
+#define POOL_BUFFERS 4
+static struct{
+    uint8_t* data;
+    size_t size;
+} bufferPool[POOL_BUFFERS];
+
+//acquireBuffer: Returns a buffer of at least size bytes, taken from the pool when a large enough one is there
+static uint8_t* acquireBuffer(size_t size){
+    for (int i=0;i<POOL_BUFFERS;i++){
+        if (bufferPool[i].data&&bufferPool[i].size>=size){
+            uint8_t* data=bufferPool[i].data;
+            bufferPool[i].data=NULL;
+            return data;
+        }
+    }
+    return malloc(size);
+}
+
+//releaseBuffer: Gives a buffer returned by runPipeline back to the pool.  When the pool is full the smallest buffer is freed.
+//Parameters: data: The buffer, or NULL
+//            size: Its size in bytes (imageBytes of the image it holds)
+void releaseBuffer(uint8_t* data,size_t size){
+    int smallest=0;
+    if (!data) return;
+    for (int i=0;i<POOL_BUFFERS;i++){
+        if (!bufferPool[i].data){
+            smallest=i;
+            break;
+        }
+        if (bufferPool[i].size<bufferPool[smallest].size) smallest=i;
+    }
+    if (bufferPool[smallest].data&&bufferPool[smallest].size>=size){
+        free(data);
+        return;
+    }
+    free(bufferPool[smallest].data);
+    bufferPool[smallest].data=data;
+    bufferPool[smallest].size=size;
+}
+
+//runPipeline: Applies every stage of a pipeline in turn, alternating between two buffers
+//Parameters: srcImage: The decoded source image.  It is never modified.
+//            destImage: Receives the result.  When the pipeline is empty its data is srcImage's data, not a copy.
+//            pipeline: The (planned) pipeline to run
+//            convolute: The engine used for each stage
+//Returns: 1 if destImage->data was allocated and must be given back with releaseBuffer, 0 if it aliases srcImage, -1 if out of memory
+int runPipeline(Image* srcImage,Image* destImage,Pipeline* pipeline,ConvoluteFunction convolute){
+    Image buffers[2];
+    Image* input=srcImage;
+    int i;
+    size_t size=imageBytes(srcImage);
+
+    *destImage=*srcImage;
+    if (pipeline->count==0) return 0;
+    for (i=0;i<2;i++){
+        buffers[i]=*srcImage;
+        buffers[i].data=NULL;
+    }
+    timerStart(STAGE_ALLOCATE);
+    buffers[0].data=acquireBuffer(size);
+    if (pipeline->count>1) buffers[1].data=acquireBuffer(size);
+    timerStop(STAGE_ALLOCATE);
+    if (!buffers[0].data||(pipeline->count>1&&!buffers[1].data)){
+        releaseBuffer(buffers[0].data,size);
+        releaseBuffer(buffers[1].data,size);
+        return -1;
+    }
+    timerStart(STAGE_CONVOLVE);
+    takeOutOfMemory();
+    for (i=0;i<pipeline->count;i++){
+        convolute(input,&buffers[i%2],pipeline->stages[i]);
+        input=&buffers[i%2];
+    }
+    timerStop(STAGE_CONVOLVE);
+    //a stage that could not allocate its scratch memory left part of its output unwritten
+    if (takeOutOfMemory()){
+        releaseBuffer(buffers[0].data,size);
+        releaseBuffer(buffers[1].data,size);
+        return -1;
+    }
+    *destImage=*input;
+    releaseBuffer(buffers[(pipeline->count)%2].data,size);
+    return 1;
+}
+
+//pipelineRadius: How far, in pixels, the pipeline's output at a pixel can depend on the source: the sum of the stage radii
+int pipelineRadius(Pipeline* pipeline){
+    int radius=0;
+    for (int i=0;i<pipeline->count;i++) radius+=pipeline->stages[i]->size/2;
+    return radius;
+}
+
+//pipelineHash: A hash of what every stage computes: its size, coefficients and parameters.  Names are left out, so a kernel file
+//              that redefines a kernel, or a change to a built in one, gives a different hash under the same spec.
+uint64_t pipelineHash(Pipeline* pipeline){
+    uint64_t hash=0;
+    for (int i=0;i<pipeline->count;i++){
+        Kernel* kernel=pipeline->stages[i];
+        uint64_t parts[9]={hash,kernel->size,kernel->fused,kernel->rank,kernel->bilateral,kernel->gaussian,hashBytes(kernel->coef,sizeof(kernel->coef))};
+        memcpy(&parts[7],&kernel->rangeSigma,sizeof(double));
+        memcpy(&parts[8],&kernel->sigma,sizeof(double));
+        hash=hashBytes(parts,sizeof(parts));
+    }
+    return hash;
+}
+
+//copyRect: Copies the rectangle at x,y of src into the whole of dest, which is the rectangle's size
+static void copyRect(Image* src,Image* dest,int x,int y){
+    size_t pixel=(size_t)src->bpp*sampleBytes(src);
+    for (int row=0;row<dest->height;row++)
+        memcpy(dest->data+(size_t)row*dest->width*pixel,src->data+((size_t)(y+row)*src->width+x)*pixel,dest->width*pixel);
+}
+
+//runPipelineRegion: Runs a pipeline on the rectangle [x,x+width)x[y,y+height) of an image only.
+//                   The rectangle is cut out with a halo of pipelineRadius pixels (less where it meets the border of the image), the
+//                   pipeline runs on that, and the halo is cut off again.  Only the halo pixels see the wrong neighbours, so the
+//                   result is exactly the same rectangle of a run over the whole image, except after a recursive Gaussian
+//                   (gaussian:S), whose response reaches past its 4 sigma halo, where a sample may differ by one level.
+//Parameters: srcImage: The whole source image.  It is not modified.
+//            destImage: Receives the rectangle, width by height pixels
+//            pipeline: The (planned) pipeline to run
+//            convolute: The engine used for each stage
+//            x,y,width,height: The rectangle.  It must lie inside the image.
+//Returns: 1, destImage->data must be given back with releaseBuffer, or -1 if out of memory or the rectangle is not inside the image
+int runPipelineRegion(Image* srcImage,Image* destImage,Pipeline* pipeline,ConvoluteFunction convolute,int x,int y,int width,int height){
+    int radius=pipelineRadius(pipeline);
+    if (x<0||y<0||width<1||height<1||x+width>srcImage->width||y+height>srcImage->height) return -1;
+    int x0=x-radius>0?x-radius:0,y0=y-radius>0?y-radius:0;
+    int x1=x+width+radius<srcImage->width?x+width+radius:srcImage->width;
+    int y1=y+height+radius<srcImage->height?y+height+radius:srcImage->height;
+    Image haloImage={NULL,x1-x0,y1-y0,srcImage->bpp,srcImage->type},result;
+    size_t haloSize=imageBytes(&haloImage);
+
+    *destImage=haloImage;
+    destImage->width=width;
+    destImage->height=height;
+    timerStart(STAGE_ALLOCATE);
+    haloImage.data=acquireBuffer(haloSize);
+    destImage->data=acquireBuffer(imageBytes(destImage));
+    timerStop(STAGE_ALLOCATE);
+    if (!haloImage.data||!destImage->data){
+        releaseBuffer(haloImage.data,haloSize);
+        releaseBuffer(destImage->data,imageBytes(destImage));
+        return -1;
+    }
+    copyRect(srcImage,&haloImage,x0,y0);
+    int owns=runPipeline(&haloImage,&result,pipeline,convolute);
+    if (owns<0){
+        releaseBuffer(haloImage.data,haloSize);
+        releaseBuffer(destImage->data,imageBytes(destImage));
+        return -1;
+    }
+    copyRect(&result,destImage,x-x0,y-y0);
+    if (owns) releaseBuffer(result.data,haloSize);
+    releaseBuffer(haloImage.data,haloSize);
+    return 1;
+}
+
+//updatePipeline: Brings the results of a pipeline up to date after parts of its source changed, recomputing only the output
+//                pixels that can depend on a changed pixel.  Each dirty rectangle grows by the kernel radius at every stage.
+//Parameters: images: pipeline->count+1 images of the same size.  images[0] is the edited source, images[i] the result of stage i
+//                    from the previous run.  The results are updated in place.
+//            pipeline: The pipeline that produced the images
+//            dirty: The rectangles of the source that changed.  They are grown in place, and on return hold the changed rectangles of the final result.
+//            count: The number of rectangles
+//Returns: The number of pixels recomputed over all stages, or -1 if a stage ran out of memory and the results are incomplete
+long long updatePipeline(Image* images,Pipeline* pipeline,Rect* dirty,int count){
+    long long pixels=0;
+    timerStart(STAGE_CONVOLVE);
+    takeOutOfMemory();
+    for (int s=0;s<pipeline->count;s++){
+        Kernel* kernel=pipeline->stages[s];
+        int r=kernel->size/2;
+        for (int i=0;i<count;i++){
+            Rect* rect=&dirty[i];
+            if (rect->width<=0||rect->height<=0) continue;
+            int x0=rect->x-r>0?rect->x-r:0,y0=rect->y-r>0?rect->y-r:0;
+            int x1=rect->x+rect->width+r<images[s].width?rect->x+rect->width+r:images[s].width;
+            int y1=rect->y+rect->height+r<images[s].height?rect->y+rect->height+r:images[s].height;
+            if (x1<=x0||y1<=y0){
+                rect->width=rect->height=0;
+                continue;
+            }
+            convoluteRegion(&images[s],&images[s+1],kernel,x0,y0,x1,y1);
+            pixels+=(long long)(x1-x0)*(y1-y0);
+            rect->x=x0;
+            rect->y=y0;
+            rect->width=x1-x0;
+            rect->height=y1-y0;
+        }
+    }
+    timerStop(STAGE_CONVOLVE);
+    return takeOutOfMemory()?-1:pixels;
+}
+
+//Estimated cost, in integer multiply-adds per pixel channel, of one pass over the image (reading the source and writing the destination)
+#define PASS_COST 8.0
+//A floating point multiply-add (plus the conversion back to an integer) costs about twice an integer one
+#define FLOAT_COST 2.0
+
+//kernelCost: Estimates the cost per pixel channel of convoluting with a kernel using the given execution path
+//Parameters: kernel: The kernel
+//            path: The execution path to estimate
+//Returns: The estimated cost in integer multiply-adds, including one pass over memory
+double kernelCost(Kernel* kernel,enum ExecutionPaths path){
+    int i,j,n=kernel->size,taps=0;
+    switch (path){
+        //only the non zero taps survive specialization
+        case PATH_SPECIALIZED:
+            for (i=0;i<n;i++)
+                for (j=0;j<n;j++)
+                    if (kernel->coef[i][j]!=0) taps++;
+            return (kernel->integerExact?1:FLOAT_COST)*taps+PASS_COST;
+        //two sums over the same loads, then a square root or an arctangent
+        case PATH_FUSED:
+            for (i=0;i<n;i++)
+                for (j=0;j<n;j++)
+                    if (kernel->coef[i][j]!=0||kernel->coef[j][i]!=0) taps++;
+            return 2*taps+4*FLOAT_COST+PASS_COST;
+        //a sorting network for 3x3 and 5x5 medians, a fixed number of histogram updates and bin scans for larger ones, and three
+        //comparisons per sample in each direction for erode and dilate, whatever the window size
+        case PATH_RANK:
+            if (kernel->rank!=RANK_MEDIAN) return 2*3*FLOAT_COST+PASS_COST;
+            if (n==3) return 12+PASS_COST;
+            if (n==5) return 99+PASS_COST;
+            return 2*16+2*16+16+PASS_COST;
+        //for every range level, a weight and a weighted value added to and taken from a column sum and a window sum
+        case PATH_BILATERAL: return 8*(ceil(255/kernel->rangeSigma)+1)+FLOAT_COST*4+PASS_COST;
+        //four multiply-adds forwards and four backwards along the rows and again down the columns, through a float image
+        case PATH_GAUSSIAN: return 16*FLOAT_COST+2*PASS_COST;
+        case PATH_SEPARABLE: return 2*n+PASS_COST;
+        case PATH_INTEGER: return n*n+PASS_COST;
+        //forward transform of a padded 64x64 tile, pointwise multiply and inverse transform, amortized per pixel
+        case PATH_FFT: return FLOAT_COST*(2*5*12/2.0+6)+2*PASS_COST;
+        default: return FLOAT_COST*n*n+PASS_COST;
+    }
+}
+
+//kernelPath: Picks the execution path convoluteRows will use for a kernel.  This mirrors the choice made in convolve.c, which has
+//            no FFT executor, so PATH_FFT is never picked: its kernelCost is only an estimate to compare the direct path against.
+enum ExecutionPaths kernelPath(Kernel* kernel){
+    if (kernel->fused) return PATH_FUSED;
+    if (kernel->rank) return PATH_RANK;
+    if (kernel->bilateral) return PATH_BILATERAL;
+    if (kernel->gaussian) return PATH_GAUSSIAN;
+    if (kernel->builtin>=0) return PATH_SPECIALIZED;
+    if (kernel->intSeparable) return PATH_SEPARABLE;
+    if (kernel->integerExact) return PATH_INTEGER;
+    return PATH_DIRECT;
+}
+
+//pathName: Returns a printable name for an execution path
+const char* pathName(enum ExecutionPaths path){
+    static const char* names[]={"direct","integer","separable","fft","specialized","fused","rank","bilateral","gaussian"};
+    return names[path];
+}
+
+//pipelineCost: Estimates the cost per pixel channel of running every stage of a pipeline
+double pipelineCost(Pipeline* pipeline){
+    double cost=0;
+    for (int i=0;i<pipeline->count;i++)
+        cost+=kernelCost(pipeline->stages[i],kernelPath(pipeline->stages[i]));
+    return cost;
+}
+
+//composeKernels: Builds the single kernel equivalent to applying first and then second, ignoring the clamping to 8 bits between them
+//Returns: 0 on success, -1 if the result would be larger than MAX_KERNEL_SIZE
+static int composeKernels(Kernel* first,Kernel* second,Kernel* result){
+    int i,j,p,q,size=first->size+second->size-1;
+    if (size>MAX_KERNEL_SIZE) return -1;
+    memset(result,0,sizeof(Kernel));
+    //a name too long to fit ends in "..." so that reports do not pass it off as the whole chain
+    if (snprintf(result->name,MAX_KERNEL_NAME,"%s*%s",first->name,second->name)>=MAX_KERNEL_NAME)
+        memcpy(result->name+MAX_KERNEL_NAME-4,"...",4);
+    result->size=size;
+    for (i=0;i<first->size;i++)
+        for (j=0;j<first->size;j++)
+            for (p=0;p<second->size;p++)
+                for (q=0;q<second->size;q++)
+                    result->coef[i+p][j+q]+=first->coef[i][j]*second->coef[p][q];
+    analyzeKernel(result);
+    return 0;
+}
+
+//composePipeline: Folds consecutive stages into single larger kernels when the estimated cost goes down.
+//                 This treats the pipeline as purely linear, so it only matches the staged result when no stage saturates or wraps.
+//                 Only linearKernel stages are folded; fused operators and filters without coefficients are not linear.
+//Parameters: pipeline: The planned pipeline
+//            fused: Receives the composed pipeline.  Its composed kernels are stored inside it, so it must not be copied.
+//Returns: The number of stages that were folded away
+int composePipeline(Pipeline* pipeline,Pipeline* fused){
+    Kernel candidate;
+    fused->count=0;
+    for (int i=0;i<pipeline->count;i++){
+        Kernel* stage=pipeline->stages[i];
+        Kernel* previous=fused->count>0?fused->stages[fused->count-1]:NULL;
+        if (previous&&linearKernel(stage)&&linearKernel(previous)){
+            double separate=kernelCost(previous,kernelPath(previous))+kernelCost(stage,kernelPath(stage));
+            if (composeKernels(previous,stage,&candidate)==0&&kernelCost(&candidate,kernelPath(&candidate))<separate){
+                fused->composed[fused->count-1]=candidate;
+                fused->stages[fused->count-1]=&fused->composed[fused->count-1];
+                continue;
+            }
+        }
+        fused->stages[fused->count++]=stage;
+    }
+    return pipeline->count-fused->count;
+}
@@ -0,0 +1,67 @@
+#ifndef ___PIPELINE
+#define ___PIPELINE
+#include <stddef.h>
+#include "image.h"
+
+#define MAX_STAGES 16
+
+//The entry point every engine provides: convolute, ompConvolute or pthreadConvolute.
+typedef void (*ConvoluteFunction)(Image* srcImage,Image* destImage,Kernel* kernel);
+
+//An ordered chain of kernels, ie. "blur,sharpen".  Kernels built by composePipeline live in composed.
+typedef struct{
+    Kernel* stages[MAX_STAGES];
+    int count;
+    Kernel composed[MAX_STAGES];
+} Pipeline;
+
+//A rectangle of pixels, ie. a part of an image that was edited
+typedef struct{
+    int x;
+    int y;
+    int width;
+    int height;
+} Rect;
+
+//How a kernel is executed.  FFT is only an estimate for kernelCost: kernelPath never picks it, since no engine runs it.
+enum ExecutionPaths{PATH_DIRECT=0,PATH_INTEGER=1,PATH_SEPARABLE=2,PATH_FFT=3,PATH_SPECIALIZED=4,PATH_FUSED=5,PATH_RANK=6,PATH_BILATERAL=7,PATH_GAUSSIAN=8};
+
+//pipeline.c
+int parsePipeline(const char* spec,Pipeline* pipeline);
+int planPipeline(Pipeline* pipeline);
+int runPipeline(Image* srcImage,Image* destImage,Pipeline* pipeline,ConvoluteFunction convolute);
+int runPipelineRegion(Image* srcImage,Image* destImage,Pipeline* pipeline,ConvoluteFunction convolute,int x,int y,int width,int height);
+int pipelineRadius(Pipeline* pipeline);
+uint64_t pipelineHash(Pipeline* pipeline);
+long long updatePipeline(Image* images,Pipeline* pipeline,Rect* dirty,int count);
+void releaseBuffer(uint8_t* data,size_t size);
+int composePipeline(Pipeline* pipeline,Pipeline* fused);
+enum ExecutionPaths kernelPath(Kernel* kernel);
+const char* pathName(enum ExecutionPaths path);
+double kernelCost(Kernel* kernel,enum ExecutionPaths path);
+double pipelineCost(Pipeline* pipeline);
+
+//autotune.c
+void autotuneTiles(Image* srcImage,Kernel* kernel,ConvoluteFunction convolute,int* width,int* height);
+int loadTileCache(Kernel* kernel,Image* image,int* width,int* height);
+int saveTileCache(Kernel* kernel,Image* image,int width,int height);
+
+//colorspace.c
+void linearizeImage(Image* srcImage,Image* destImage);
+void encodeImage(Image* srcImage,Image* destImage);
+void premultiplyImage(Image* image,float opaque);
+void unpremultiplyImage(Image* image,float opaque);
+void lumaImage(Image* srcImage,Image* destImage);
+int blurPipeline(Pipeline* pipeline);
+
+//driver.c
+int runImage(int argc,char** argv,ConvoluteFunction convolute);
+
+//outofcore.c
+int runOutOfCore(const char* inName,const char* outName,Pipeline* pipeline,ConvoluteFunction convolute,size_t memoryBudget);
+
+//server.c
+int runServer(const char* socketPath,ConvoluteFunction convolute);
+int runClient(const char* socketPath,const char* fileName,const char* spec,int linear,int gray,const char* format,int repeat,int stats);
+
+#endif
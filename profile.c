@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "profile.h"
+#include "timer.h"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static const char* eventNames[EVENT_COUNT]={"cycles","instructions","l1d_misses","llc_misses","branch_misses"};
+//totals per thread.  Each slot is only ever written by its own thread, as in timer.c.
+static long long eventTotal[MAX_TIMED_THREADS][EVENT_COUNT];
+//1 once an event has been read successfully, so events the machine (or container) does not allow are reported as unavailable.
+//Each thread sets its own flags; printProfile merges them into eventSeen.
+static char threadSeen[MAX_TIMED_THREADS][EVENT_COUNT];
+static int eventSeen[EVENT_COUNT];
+static int profileEnabled=0;
+
+//profileEnable: Turns counting on or off.  It is off unless --profile was given.
+void profileEnable(int enabled){
+    profileEnabled=enabled;
+}
+
+//profileReset: Clears every total
+void profileReset(){
+    memset(eventTotal,0,sizeof(eventTotal));
+    memset(threadSeen,0,sizeof(threadSeen));
+    memset(eventSeen,0,sizeof(eventSeen));
+}
+
+#ifdef __linux__
+//openEvent: Opens one counter on the calling thread, counting user space only so that it works with perf_event_paranoid=2
+//Returns: The file descriptor, or -1 if the counter is not available
+static int openEvent(int type,unsigned long long config){
+    struct perf_event_attr attr;
+    memset(&attr,0,sizeof(attr));
+    attr.size=sizeof(attr);
+    attr.type=type;
+    attr.config=config;
+    attr.disabled=1;
+    attr.exclude_kernel=1;
+    attr.exclude_hv=1;
+    return syscall(__NR_perf_event_open,&attr,0,-1,-1,0);
+}
+#endif
+
+//profileOpen: Opens the counters on the calling thread, stopped.  Opening costs several system calls, so a thread that runs many
+//             tasks opens them once and brackets each task with profileBegin and profileEnd.  Does nothing unless profiling is enabled.
+void profileOpen(ProfileCounters* counters){
+    for (int i=0;i<EVENT_COUNT;i++) counters->fd[i]=-1;
+    if (!profileEnabled) return;
+#ifdef __linux__
+    counters->fd[EVENT_CYCLES]=openEvent(PERF_TYPE_HARDWARE,PERF_COUNT_HW_CPU_CYCLES);
+    counters->fd[EVENT_INSTRUCTIONS]=openEvent(PERF_TYPE_HARDWARE,PERF_COUNT_HW_INSTRUCTIONS);
+    counters->fd[EVENT_L1_MISSES]=openEvent(PERF_TYPE_HW_CACHE,PERF_COUNT_HW_CACHE_L1D|(PERF_COUNT_HW_CACHE_OP_READ<<8)|(PERF_COUNT_HW_CACHE_RESULT_MISS<<16));
+    counters->fd[EVENT_LLC_MISSES]=openEvent(PERF_TYPE_HARDWARE,PERF_COUNT_HW_CACHE_MISSES);
+    counters->fd[EVENT_BRANCH_MISSES]=openEvent(PERF_TYPE_HARDWARE,PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+}
+
+//profileBegin: Zeroes and starts the counters opened by profileOpen
+void profileBegin(ProfileCounters* counters){
+#ifdef __linux__
+    for (int i=0;i<EVENT_COUNT;i++)
+        if (counters->fd[i]>=0){
+            ioctl(counters->fd[i],PERF_EVENT_IOC_RESET,0);
+            ioctl(counters->fd[i],PERF_EVENT_IOC_ENABLE,0);
+        }
+#endif
+}
+
+//profileEnd: Stops and reads the counters started by profileBegin and adds them to a thread's totals
+//Parameters: thread: The thread number, from 0, as passed to addThreadTime
+//            counters: The counters from profileOpen
+void profileEnd(int thread,ProfileCounters* counters){
+    for (int i=0;i<EVENT_COUNT;i++){
+        long long value;
+        if (counters->fd[i]<0) continue;
+#ifdef __linux__
+        ioctl(counters->fd[i],PERF_EVENT_IOC_DISABLE,0);
+#endif
+        if (read(counters->fd[i],&value,sizeof(value))==sizeof(value)&&thread>=0&&thread<MAX_TIMED_THREADS){
+            eventTotal[thread][i]+=value;
+            threadSeen[thread][i]=1;
+        }
+    }
+}
+
+//profileClose: Closes the counters opened by profileOpen
+void profileClose(ProfileCounters* counters){
+    for (int i=0;i<EVENT_COUNT;i++)
+        if (counters->fd[i]>=0) close(counters->fd[i]);
+}
+
+//countedThreads: The number of thread slots to report: up to the highest that read any counter, as timedThreads in timer.c
+static int countedThreads(){
+    for (int t=MAX_TIMED_THREADS;t>0;t--)
+        for (int i=0;i<EVENT_COUNT;i++)
+            if (threadSeen[t-1][i]) return t;
+    return 0;
+}
+
+//printEvents: Prints one row of counters with the derived IPC and estimated DRAM bytes per pixel
+static void printEvents(FILE* out,int json,const char* label,long long* events,double pixels){
+    int i;
+    double ipc=eventSeen[EVENT_CYCLES]&&eventSeen[EVENT_INSTRUCTIONS]&&events[EVENT_CYCLES]?(double)events[EVENT_INSTRUCTIONS]/events[EVENT_CYCLES]:-1;
+    //every last level miss brings in one 64 byte line from memory
+    double bytes=eventSeen[EVENT_LLC_MISSES]&&pixels>0?events[EVENT_LLC_MISSES]*64.0/pixels:-1;
+    if (json){
+        fprintf(out,"{\"name\":\"%s\"",label);
+        for (i=0;i<EVENT_COUNT;i++)
+            if (eventSeen[i]) fprintf(out,",\"%s\":%lld",eventNames[i],events[i]);
+            else fprintf(out,",\"%s\":null",eventNames[i]);
+        if (ipc>=0) fprintf(out,",\"ipc\":%.3f",ipc);
+        else fprintf(out,",\"ipc\":null");
+        if (bytes>=0) fprintf(out,",\"bytes_per_pixel\":%.3f}",bytes);
+        else fprintf(out,",\"bytes_per_pixel\":null}");
+        return;
+    }
+    fprintf(out,"%-8s",label);
+    for (i=0;i<EVENT_COUNT;i++)
+        if (eventSeen[i]) fprintf(out," %15lld",events[i]);
+        else fprintf(out," %15s","n/a");
+    if (ipc>=0) fprintf(out," %6.2f",ipc);
+    else fprintf(out," %6s","n/a");
+    if (bytes>=0) fprintf(out," %8.3f\n",bytes);
+    else fprintf(out," %8s\n","n/a");
+}
+
+//printProfile: Prints the counters of every thread and the total
+//Parameters: out: Where to print
+//            json: 1 for JSON, 0 for a table
+//            pixels: The number of pixels convoluted (width*height*stages), for bytes per pixel
+void printProfile(FILE* out,int json,double pixels){
+    long long total[EVENT_COUNT]={0};
+    char label[32];
+    int i,t,any=0,threads=countedThreads();
+    for (t=0;t<threads;t++)
+        for (i=0;i<EVENT_COUNT;i++) eventSeen[i]|=threadSeen[t][i];
+    for (i=0;i<EVENT_COUNT;i++) any|=eventSeen[i];
+    if (!any){
+        if (json) fprintf(out,"{\"profile\":null}\n");
+        else fprintf(out,"Hardware counters are not available here (check /proc/sys/kernel/perf_event_paranoid, or the container's seccomp profile).\n");
+        return;
+    }
+    for (t=0;t<threads;t++)
+        for (i=0;i<EVENT_COUNT;i++) total[i]+=eventTotal[t][i];
+    if (json) fprintf(out,"{\"profile\":[");
+    else{
+        fprintf(out,"%-8s","thread");
+        for (i=0;i<EVENT_COUNT;i++) fprintf(out," %15s",eventNames[i]);
+        fprintf(out," %6s %8s\n","ipc","bytes/px");
+    }
+    for (t=0;t<threads;t++){
+        snprintf(label,sizeof(label),"%d",t);
+        if (json&&t) fprintf(out,",");
+        printEvents(out,json,label,eventTotal[t],0);
+    }
+    if (json&&threads) fprintf(out,",");
+    printEvents(out,json,"total",total,pixels);
+    if (json) fprintf(out,"]}\n");
+}
@@ -0,0 +1,22 @@
+#ifndef ___PROFILE
+#define ___PROFILE
+#include <stdio.h>
+
+//The hardware counters read around each thread's share of the convolution
+enum ProfileEvents{EVENT_CYCLES=0,EVENT_INSTRUCTIONS=1,EVENT_L1_MISSES=2,EVENT_LLC_MISSES=3,EVENT_BRANCH_MISSES=4,EVENT_COUNT=5};
+
+//The open counters of one thread, between profileOpen and profileClose
+typedef struct{
+    int fd[EVENT_COUNT];
+} ProfileCounters;
+
+//profile.c
+void profileEnable(int enabled);
+void profileReset();
+void profileOpen(ProfileCounters* counters);
+void profileBegin(ProfileCounters* counters);
+void profileEnd(int thread,ProfileCounters* counters);
+void profileClose(ProfileCounters* counters);
+void printProfile(FILE* out,int json,double pixels);
+
+#endif
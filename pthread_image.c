@@ -1,163 +1,148 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
-#include <time.h>
-#include <string.h>
 #include "image.h"
+#include "pipeline.h"
+#include "timer.h"
+#include "profile.h"
 #include <pthread.h> // Include the pthread library
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
-#define NUM_THREADS 4 // Define the number of threads
-
-//An array of kernel matrices to be used for image convolution.
-//The indexes of these match the enumeration from the header file. ie. algorithms[BLUR] returns the kernel corresponding to a box blur.
-Matrix algorithms[]={
-    {{0,-1,0},{-1,4,-1},{0,-1,0}},
-    {{0,-1,0},{-1,5,-1},{0,-1,0}},
-    {{1.0/9.0,1.0/9.0,1.0/9.0},{1.0/9.0,1.0/9.0,1.0/9.0},{1.0/9.0,1.0/9.0,1.0/9.0}},
-    {{1.0/16,1.0/8,1.0/16},{1.0/8,1.0/4,1.0/8},{1.0/16,1.0/8,1.0/16}},
-    {{-2,-1,0},{-1,1,1},{0,1,2}},
-    {{0,0,0},{0,1,0},{0,0,0}}
-};
-
-//getPixelValue - Computes the value of a specific pixel on a specific channel using the selected convolution kernel
-//Paramters: srcImage:  An Image struct populated with the image being convoluted
-//           x: The x coordinate of the pixel
-//          y: The y coordinate of the pixel
-//          bit: The color channel being manipulated
-//          algorithm: The 3x3 kernel matrix to use for the convolution
-//Returns: The new value for this x,y pixel and bit channel
-uint8_t getPixelValue(Image* srcImage,int x,int y,int bit,Matrix algorithm){
-    int px,mx,py,my,i,span;
-    span=srcImage->width*srcImage->bpp;
-    // for the edge pixes, just reuse the edge pixel
-    px=x+1; py=y+1; mx=x-1; my=y-1;
-    if (mx<0) mx=0;
-    if (my<0) my=0;
-    if (px>=srcImage->width) px=srcImage->width-1;
-    if (py>=srcImage->height) py=srcImage->height-1;
-    uint8_t result=
-        algorithm[0][0]*srcImage->data[Index(mx,my,srcImage->width,bit,srcImage->bpp)]+
-        algorithm[0][1]*srcImage->data[Index(x,my,srcImage->width,bit,srcImage->bpp)]+
-        algorithm[0][2]*srcImage->data[Index(px,my,srcImage->width,bit,srcImage->bpp)]+
-        algorithm[1][0]*srcImage->data[Index(mx,y,srcImage->width,bit,srcImage->bpp)]+
-        algorithm[1][1]*srcImage->data[Index(x,y,srcImage->width,bit,srcImage->bpp)]+
-        algorithm[1][2]*srcImage->data[Index(px,y,srcImage->width,bit,srcImage->bpp)]+
-        algorithm[2][0]*srcImage->data[Index(mx,py,srcImage->width,bit,srcImage->bpp)]+
-        algorithm[2][1]*srcImage->data[Index(x,py,srcImage->width,bit,srcImage->bpp)]+
-        algorithm[2][2]*srcImage->data[Index(px,py,srcImage->width,bit,srcImage->bpp)];
-    return result;
-}
-
-//convolute:  Applies a kernel matrix to an image
-//Parameters: srcImage: The image being convoluted
-//            destImage: A pointer to a pre-allocated (including space for the pixel array) structure to receive the convoluted image.  It should be the same size as srcImage
-//            algorithm: The kernel matrix to use for the convolution
-//Returns: Nothing
-void convolute(Image* srcImage,Image* destImage,Matrix algorithm){
-    int row,pix,bit,span;
-    span=srcImage->bpp*srcImage->bpp;
-    for (row=0;row<srcImage->height;row++){
-        for (pix=0;pix<srcImage->width;pix++){
-            for (bit=0;bit<srcImage->bpp;bit++){
-                destImage->data[Index(pix,row,srcImage->width,bit,srcImage->bpp)]=getPixelValue(srcImage,pix,row,bit,algorithm);
-            }
-        }
-    }
-}
-
-//Usage: Prints usage information for the program
-//Returns: -1
-int Usage(){
-    printf("Usage: image <filename> <type>\n\twhere type is one of (edge,sharpen, blur, gauss, emboss, identity)\n");
-    return -1;
-}
-
-//GetKernelType: Converts the string name of a convolution into a value from the KernelTypes enumeration
-//Parameters: type: A string representation of the type
-//Returns: an appropriate entry from the KernelTypes enumeration, defaults to IDENTITY, which does nothing but copy the image.
-enum KernelTypes GetKernelType(char* type){
-    if (!strcmp(type,"edge")) return EDGE;
-    else if (!strcmp(type,"sharpen")) return SHARPEN;
-    else if (!strcmp(type,"blur")) return BLUR;
-    else if (!strcmp(type,"gauss")) return GAUSE_BLUR;
-    else if (!strcmp(type,"emboss")) return EMBOSS;
-    else return IDENTITY;
-}
+#define NUM_THREADS 4 // Define the default number of threads
+#define MAX_THREADS 256
 
 // Define a structure to hold thread-specific data
 typedef struct {
     Image* srcImage;
     Image* destImage;
-    enum KernelTypes type;
+    Kernel* kernel;
+    float* temp;    // the rows filtered by the recursive Gaussian's first pass, or NULL for every other kernel
+    int columns;    // the recursive Gaussian's second pass, over bands of columns
     long rank;
+    long threads;
 } ThreadData;
 
+//The worker threads stay alive between calls, so repeated convolutions (ie. every stage of a pipeline, or every
+//request in --serve mode) do not pay for creating threads.  The pool is rebuilt when the thread count changes.
+static struct {
+    pthread_mutex_t call;       // one pthreadConvolute at a time owns the pool
+    pthread_mutex_t lock;       // protects the fields below
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_t threads[MAX_THREADS];
+    ThreadData data[MAX_THREADS];
+    long size;                  // threads in the pool
+    long generation;            // bumped for every job, workers wait for it to change
+    long remaining;             // workers still busy with the current job
+    int quit;
+} pool = {.call=PTHREAD_MUTEX_INITIALIZER, .lock=PTHREAD_MUTEX_INITIALIZER, .start=PTHREAD_COND_INITIALIZER, .done=PTHREAD_COND_INITIALIZER};
+
 // Function that each thread will execute
-void* threadConvolute(void* arg) {
-    ThreadData* data = (ThreadData*)arg;
-    int startRow = data->rank * (data->srcImage->height / NUM_THREADS);
-    int endRow = (data->rank == NUM_THREADS - 1) ? data->srcImage->height : (data->rank + 1) * (data->srcImage->height / NUM_THREADS);
+static void convoluteBand(ThreadData* data) {
+    int lines = data->columns ? data->srcImage->width : data->srcImage->height;
+    int startLine = data->rank * (lines / data->threads);
+    int endLine = (data->rank == data->threads - 1) ? lines : (data->rank + 1) * (lines / data->threads);
 
     // Perform convolution on a portion of the image
-    for (int row = startRow; row < endRow; row++) {
-        for (int pix = 0; pix < data->srcImage->width; pix++) {
-            for (int bit = 0; bit < data->srcImage->bpp; bit++) {
-                data->destImage->data[Index(pix, row, data->srcImage->width, bit, data->srcImage->bpp)] =
-                    getPixelValue(data->srcImage, pix, row, bit, algorithms[data->type]);
-            }
-        }
-    }
-    pthread_exit(NULL);
+    ProfileCounters counters;
+    profileOpen(&counters);
+    profileBegin(&counters);
+    long long start = nowNanos();
+    if (data->columns) gaussianColumns(data->srcImage, data->temp, data->destImage, data->kernel, startLine, endLine);
+    else if (data->temp) gaussianRows(data->srcImage, data->temp, data->kernel, startLine, endLine);
+    else convoluteRows(data->srcImage, data->destImage, data->kernel, startLine, endLine);
+    addThreadTime(data->rank, nowNanos() - start);
+    profileEnd(data->rank, &counters);
+    profileClose(&counters);
 }
 
-int main(int argc, char** argv) {
-    long t1, t2;
-    t1 = time(NULL);
+// The body of each pool thread: wait for a new generation, convolute this thread's band, report back
+void* threadConvolute(void* arg) {
+    ThreadData* data = (ThreadData*)arg;
+    long seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == seen && !pool.quit) pthread_cond_wait(&pool.start, &pool.lock);
+        if (pool.quit) {
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
 
-    stbi_set_flip_vertically_on_load(0);
-    if (argc != 3) return Usage();
-    char* fileName = argv[1];
-    if (!strcmp(argv[1], "pic4.jpg") && !strcmp(argv[2], "gauss")) {
-        printf("You have applied a gaussian filter to Gauss which has caused a tear in the time-space continuum.\n");
-    }
-    enum KernelTypes type = GetKernelType(argv[2]);
+        convoluteBand(data);
 
-    Image srcImage, destImage, bwImage;
-    srcImage.data = stbi_load(fileName, &srcImage.width, &srcImage.height, &srcImage.bpp, 0);
-    if (!srcImage.data) {
-        printf("Error loading file %s.\n", fileName);
-        return -1;
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.remaining == 0) pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
     }
-    destImage.bpp = srcImage.bpp;
-    destImage.height = srcImage.height;
-    destImage.width = srcImage.width;
-    destImage.data = malloc(sizeof(uint8_t) * destImage.width * destImage.bpp * destImage.height);
-
-    // Array to hold thread handles
-    pthread_t threads[NUM_THREADS];
-    // Array to hold thread-specific data
-    ThreadData threadData[NUM_THREADS];
+}
 
-    // Create and run multiple threads for image convolution
-    for (long i = 0; i < NUM_THREADS; i++) {
-        threadData[i].srcImage = &srcImage;
-        threadData[i].destImage = &destImage;
-        threadData[i].type = type;
-        threadData[i].rank = i;
-        pthread_create(&threads[i], NULL, threadConvolute, &threadData[i]);
+// resizePool: Stops the current workers and starts count new ones.  Called with pool.call held.
+static void resizePool(long count) {
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (long i = 0; i < pool.size; i++) pthread_join(pool.threads[i], NULL);
+
+    pool.quit = 0;
+    pool.generation = 0;
+    pool.size = 0;
+    for (long i = 0; i < count; i++) {
+        pool.data[i].rank = i;
+        pool.data[i].threads = count;
+        if (pthread_create(&pool.threads[i], NULL, threadConvolute, &pool.data[i])) break;
+        pool.size++;
     }
+}
 
-    // Wait for all threads to finish
-    for (long i = 0; i < NUM_THREADS; i++) {
-        pthread_join(threads[i], NULL);
+// runJob: Hands a job to every thread of the pool and waits for all of them to finish.  Called with pool.call held.
+static void runJob(Image* srcImage, Image* destImage, Kernel* kernel, float* temp, int columns) {
+    pthread_mutex_lock(&pool.lock);
+    for (long i = 0; i < pool.size; i++) {
+        pool.data[i].srcImage = srcImage;
+        pool.data[i].destImage = destImage;
+        pool.data[i].kernel = kernel;
+        pool.data[i].temp = temp;
+        pool.data[i].columns = columns;
     }
+    pool.remaining = pool.size;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    while (pool.remaining > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
 
-    // ... (Rest of your code remains the same)
+//pthreadConvolute: Splits the image into bands of rows and convolutes each band on its own thread.  The recursive Gaussian filters
+//                  whole lines, so its threads filter bands of rows of the whole image and then, once every row is done, bands
+//                  of its columns.
+//                  Uses NUM_THREADS threads unless setThreadCount says otherwise.
+void pthreadConvolute(Image* srcImage, Image* destImage, Kernel* kernel) {
+    long count = getThreadCount() ? getThreadCount() : NUM_THREADS;
+    if (count > MAX_THREADS) count = MAX_THREADS;
+    float* temp = kernel->gaussian ? malloc(sizeof(float) * srcImage->width * srcImage->height * srcImage->bpp) : NULL;
+
+    pthread_mutex_lock(&pool.call);
+    if (pool.size != count) resizePool(count);
+    if (pool.size < count) {
+        // not every thread could be started, so do the whole image on this one
+        ThreadData data = {srcImage, destImage, kernel, temp, 0, 0, 1};
+        convoluteBand(&data);
+        if (temp) {
+            data.columns = 1;
+            convoluteBand(&data);
+        }
+    }
+    else {
+        runJob(srcImage, destImage, kernel, temp, 0);
+        if (temp) runJob(srcImage, destImage, kernel, temp, 1);
+    }
+    pthread_mutex_unlock(&pool.call);
+    free(temp);
+}
 
-    return 0;
+#ifndef IMAGE_NO_MAIN
+int main(int argc, char** argv) {
+    return runImage(argc, argv, pthreadConvolute);
 }
+#endif
@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+//Rank filters.  Median, erode and dilate replace each sample with the middle, the smallest or the largest sample of the square
+//window around it.  They are not convolutions, so each has its own algorithm:
+//- 3x3 and 5x5 medians use sorting networks of 19 and 99 exchanges.  A network has no branches, so it sorts 16 samples at once.
+//- Larger 8 bit medians keep a histogram of every column and slide a window histogram along the row (Perreault and Hebert), so
+//  the work per pixel does not grow with the window.  Each histogram has 16 coarse bins and 256 fine ones, and the fine bins of
+//  the window are only brought up to date for the coarse bin the median falls in.
+//- Erode and dilate are separable: the minimum or maximum along the rows, then along the columns.  Each direction uses van Herk
+//  and Gil-Werman's running blocks, three comparisons per sample whatever the window size.
+//Borders repeat the edge pixel, like every convolution path.
+
+//The rows erode and dilate finish at a time, which bounds their buffers
+#define RANK_STRIP 64
+
+//EXCHANGE: Orders two ints so that a<=b, without a branch
+#define EXCHANGE(a,b) { int t=(a); (a)=t<(b)?t:(b); (b)=t<(b)?(b):t; }
+
+//NETWORK9: Paeth's sorting network for the median of 9: sort each row of three, then take the median of the largest minimum,
+//the middle median and the smallest maximum.  19 exchanges leave the median in the middle.
+#define NETWORK9(X) \
+    X(1,2) X(4,5) X(7,8) X(0,1) X(3,4) X(6,7) X(1,2) X(4,5) X(7,8) X(0,3) \
+    X(5,8) X(4,7) X(3,6) X(1,4) X(2,5) X(4,7) X(4,2) X(6,4) X(4,2)
+
+//NETWORK25: Devillard's sorting network for the median of 25, after Paeth: 99 exchanges that leave the median in the middle
+#define NETWORK25(X) \
+    X(0,1) X(3,4) X(2,4) X(2,3) X(6,7) X(5,7) X(5,6) X(9,10) X(8,10) X(8,9) \
+    X(12,13) X(11,13) X(11,12) X(15,16) X(14,16) X(14,15) X(18,19) X(17,19) X(17,18) X(21,22) \
+    X(20,22) X(20,21) X(23,24) X(2,5) X(3,6) X(0,6) X(0,3) X(4,7) X(1,7) X(1,4) \
+    X(11,14) X(8,14) X(8,11) X(12,15) X(9,15) X(9,12) X(13,16) X(10,16) X(10,13) X(20,23) \
+    X(17,23) X(17,20) X(21,24) X(18,24) X(18,21) X(19,22) X(8,17) X(9,18) X(0,18) X(0,9) \
+    X(10,19) X(1,19) X(1,10) X(11,20) X(2,20) X(2,11) X(12,21) X(3,21) X(3,12) X(13,22) \
+    X(4,22) X(4,13) X(14,23) X(5,23) X(5,14) X(15,24) X(6,24) X(6,15) X(7,16) X(7,19) \
+    X(13,21) X(15,23) X(7,13) X(7,15) X(1,9) X(3,11) X(5,17) X(11,17) X(9,17) X(4,10) \
+    X(6,12) X(7,14) X(4,6) X(4,7) X(12,14) X(10,14) X(6,7) X(10,12) X(6,10) X(6,17) \
+    X(12,17) X(7,17) X(7,10) X(12,18) X(7,12) X(10,18) X(12,20) X(10,20) X(10,12)
+
+//medianNetwork: The median of size*size values, 3x3 or 5x5, which are reordered
+static inline int medianNetwork(int* p,int size){
+#define EXCHANGE_VALUES(a,b) EXCHANGE(p[a],p[b])
+    if (size==3){
+        NETWORK9(EXCHANGE_VALUES)
+    }
+    else{
+        NETWORK25(EXCHANGE_VALUES)
+    }
+#undef EXCHANGE_VALUES
+    return p[size*size/2];
+}
+
+//The networks run on LANES neighbouring samples at once.  exchangeLanes has a fixed trip count and no branches, so
+//the compiler turns each exchange into one vector minimum and one vector maximum.
+#define LANES 16
+
+//exchangeLanes: EXCHANGE for LANES values at once
+static inline void exchangeLanes(uint8_t* a,uint8_t* b){
+    for (int lane=0;lane<LANES;lane++){
+        uint8_t x=a[lane],y=b[lane];
+        a[lane]=x<y?x:y;
+        b[lane]=x<y?y:x;
+    }
+}
+
+//medianAt: The median of one sample through the network, for the border columns and the samples left over from the vector loop
+static inline int medianAt(Image* srcImage,const uint8_t** lines,int size,int pix,int bit){
+    int p[25],r=size/2;
+    for (int j=0;j<size;j++){
+        int column=clampIndex(pix+j-r,srcImage->width)*srcImage->bpp+bit;
+        for (int i=0;i<size;i++) p[i*size+j]=lines[i][column];
+    }
+    return medianNetwork(p,size);
+}
+
+//medianSmall: 3x3 or 5x5 median of an 8 bit image through the sorting networks.  Away from the left and right borders the
+//             window of every sample is LANES wide runs of the source rows, so the network sorts LANES samples (of any channel)
+//             at once.  Alpha computed there is overwritten by copyAlpha when it is skipped.
+static void medianSmall(Image* srcImage,Image* destImage,int size,int x0,int y0,int x1,int y1){
+    int row,pix,bit,i,j,r=size/2,bpp=srcImage->bpp,channels=colourChannels(srcImage),span=srcImage->width*bpp;
+    int left=x0>r?x0:r,right=x1<srcImage->width-r?x1:srcImage->width-r;
+    const uint8_t* lines[5];
+    uint8_t p[25][LANES];
+    if (left>x1) left=x1;
+    if (right<left) right=left;
+    for (row=y0;row<y1;row++){
+        uint8_t* out=destImage->data+(size_t)row*span;
+        for (i=0;i<size;i++) lines[i]=srcImage->data+(size_t)clampIndex(row+i-r,srcImage->height)*span;
+        for (pix=x0;pix<left;pix++)
+            for (bit=0;bit<channels;bit++) out[pix*bpp+bit]=medianAt(srcImage,lines,size,pix,bit);
+        int sample=left*bpp;
+        for (;sample+LANES<=right*bpp;sample+=LANES){
+            for (i=0;i<size;i++)
+                for (j=0;j<size;j++) memcpy(p[i*size+j],lines[i]+sample+(j-r)*bpp,LANES);
+#define EXCHANGE_LANES(a,b) exchangeLanes(p[a],p[b]);
+            if (size==3){
+                NETWORK9(EXCHANGE_LANES)
+            }
+            else{
+                NETWORK25(EXCHANGE_LANES)
+            }
+#undef EXCHANGE_LANES
+            memcpy(out+sample,p[size*size/2],LANES);
+        }
+        for (;sample<right*bpp;sample++) out[sample]=medianAt(srcImage,lines,size,sample/bpp,sample%bpp);
+        for (pix=right;pix<x1;pix++)
+            for (bit=0;bit<channels;bit++) out[pix*bpp+bit]=medianAt(srcImage,lines,size,pix,bit);
+    }
+}
+
+//countRow: Adds one source row to (delta 1) or removes it from (delta -1) the column histograms of medianHistogram
+static void countRow(const uint8_t* line,const int* offsets,int columns,int channels,uint16_t* coarse,uint16_t* fine,int delta){
+    for (int c=0;c<columns;c++)
+        for (int bit=0;bit<channels;bit++){
+            int value=line[offsets[c]+bit];
+            coarse[((size_t)bit*columns+c)*16+(value>>4)]+=delta;
+            fine[(((size_t)bit*16+(value>>4))*columns+c)*16+(value&15)]+=delta;
+        }
+}
+
+//medianHistogram: Median of an 8 bit image in constant time per pixel.  The column histograms cover the tile plus the window
+//                 radius on each side and are moved down one row at a time; the window histogram is the sum of size of them
+//                 and is moved right one column at a time.  Each call counts the size rows around y0 before its first row.
+//                 histograms is rankScratchSize entries for a rectangle at least this wide.
+static void medianHistogram(Image* srcImage,Image* destImage,int size,int x0,int y0,int x1,int y1,uint16_t* histograms){
+    int row,pix,bit,c,k,r=size/2,bpp=srcImage->bpp,channels=colourChannels(srcImage),span=srcImage->width*bpp;
+    int columns=x1-x0+2*r,half=size*size/2;
+    //coarse holds 16 bins per column and channel, fine 16 sub-bins per column for each coarse bin and channel, so the columns of one
+    //coarse bin are next to each other
+    uint16_t* coarse=histograms;
+    uint16_t* fine=coarse+(size_t)channels*columns*16;
+    int* offsets=malloc(sizeof(int)*columns);
+    if (!offsets){
+        noteOutOfMemory();
+        return;
+    }
+    memset(histograms,0,sizeof(uint16_t)*channels*columns*16*17);
+    for (c=0;c<columns;c++) offsets[c]=clampIndex(x0-r+c,srcImage->width)*bpp;
+    for (row=y0;row<y1;row++){
+        if (row==y0)
+            for (k=-r;k<=r;k++) countRow(srcImage->data+(size_t)clampIndex(row+k,srcImage->height)*span,offsets,columns,channels,coarse,fine,1);
+        else{
+            countRow(srcImage->data+(size_t)clampIndex(row-r-1,srcImage->height)*span,offsets,columns,channels,coarse,fine,-1);
+            countRow(srcImage->data+(size_t)clampIndex(row+r,srcImage->height)*span,offsets,columns,channels,coarse,fine,1);
+        }
+        for (bit=0;bit<channels;bit++){
+            const uint16_t* columnCoarse=coarse+(size_t)bit*columns*16;
+            const uint16_t* columnFine=fine+(size_t)bit*16*columns*16;
+            uint16_t windowCoarse[16]={0},windowFine[256];
+            //one past the last column added to each coarse bin's fine counts, so the counts cover columns [added-size,added)
+            int added[16]={0};
+            for (c=0;c<size;c++)
+                for (k=0;k<16;k++) windowCoarse[k]+=columnCoarse[c*16+k];
+            for (pix=0;pix<x1-x0;pix++){
+                if (pix>0)
+                    for (k=0;k<16;k++) windowCoarse[k]+=columnCoarse[(pix+size-1)*16+k]-columnCoarse[(pix-1)*16+k];
+                int below=0,bin=0;
+                while (below+windowCoarse[bin]<=half) below+=windowCoarse[bin++];
+                uint16_t* counts=windowFine+bin*16;
+                const uint16_t* binColumns=columnFine+(size_t)bin*columns*16;
+                if (added[bin]<=pix){
+                    memset(counts,0,16*sizeof(uint16_t));
+                    for (c=pix;c<pix+size;c++)
+                        for (k=0;k<16;k++) counts[k]+=binColumns[c*16+k];
+                }
+                else
+                    for (c=added[bin];c<pix+size;c++)
+                        for (k=0;k<16;k++) counts[k]+=binColumns[c*16+k]-binColumns[(c-size)*16+k];
+                added[bin]=pix+size;
+                k=0;
+                while (below+counts[k]<=half) below+=counts[k++];
+                destImage->data[(size_t)row*span+(x0+pix)*bpp+bit]=bin*16+k;
+            }
+        }
+    }
+    free(offsets);
+}
+
+//selectMiddle: The median of count values (count odd), which are reordered.  Hoare's quickselect.
+static float selectMiddle(float* values,int count){
+    int low=0,high=count-1,middle=count/2;
+    while (low<high){
+        float pivot=values[(low+high)/2];
+        int i=low,j=high;
+        while (i<=j){
+            while (values[i]<pivot) i++;
+            while (values[j]>pivot) j--;
+            if (i<=j){
+                float t=values[i];
+                values[i++]=values[j];
+                values[j--]=t;
+            }
+        }
+        if (middle<=j) high=j;
+        else if (middle>=i) low=i;
+        else break;
+    }
+    return values[middle];
+}
+
+//medianSelect: Median of a 16 bit or float image, selecting from each window in turn
+static void medianSelect(Image* srcImage,Image* destImage,int size,int x0,int y0,int x1,int y1){
+    int row,pix,bit,i,j,r=size/2,bpp=srcImage->bpp,channels=colourChannels(srcImage);
+    float window[MAX_RANK_SIZE*MAX_RANK_SIZE];
+    for (row=y0;row<y1;row++)
+        for (pix=x0;pix<x1;pix++)
+            for (bit=0;bit<channels;bit++){
+                for (i=0;i<size;i++){
+                    size_t line=(size_t)clampIndex(row+i-r,srcImage->height)*srcImage->width;
+                    for (j=0;j<size;j++) window[i*size+j]=loadSample(srcImage,(line+clampIndex(pix+j-r,srcImage->width))*bpp+bit);
+                }
+                storeSample(destImage,((size_t)row*srcImage->width+pix)*bpp+bit,selectMiddle(window,size*size));
+            }
+}
+
+//runningMaximum: One van Herk/Gil-Werman pass.  values holds count+size-1 entries of stride floats each, split into blocks of size
+//                entries.  ahead receives the maximum from the start of each block up to each entry, values is overwritten with
+//                the maximum from each entry to the end of its block, and entry i of out receives the maximum of entries
+//                i..i+size-1, which is the larger of the two at its ends.  out may be ahead.
+static void runningMaximum(float* values,float* ahead,float* out,int count,int size,int stride){
+    int entry,s,length=count+size-1;
+    for (entry=0;entry<length;entry++){
+        float* to=ahead+(size_t)entry*stride;
+        const float* from=values+(size_t)entry*stride;
+        if (entry%size==0) memcpy(to,from,stride*sizeof(float));
+        else
+            for (s=0;s<stride;s++) to[s]=to[s-stride]>from[s]?to[s-stride]:from[s];
+    }
+    for (entry=length-2;entry>=0;entry--){
+        if ((entry+1)%size==0) continue;
+        float* to=values+(size_t)entry*stride;
+        for (s=0;s<stride;s++) to[s]=to[s+stride]>to[s]?to[s+stride]:to[s];
+    }
+    for (entry=0;entry<count;entry++){
+        const float* back=values+(size_t)entry*stride;
+        const float* front=ahead+(size_t)(entry+size-1)*stride;
+        float* to=out+(size_t)entry*stride;
+        for (s=0;s<stride;s++) to[s]=back[s]>front[s]?back[s]:front[s];
+    }
+}
+
+//minMax: Erode or dilate over [x0,x1)x[y0,y1) in strips of RANK_STRIP rows.  Erosion negates the samples on the way in and out,
+//        so both are a maximum.
+static void minMax(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1){
+    int strip,row,pix,bit,size=kernel->size,r=size/2,bpp=srcImage->bpp,channels=colourChannels(srcImage),span=(x1-x0)*bpp;
+    float sign=kernel->rank==RANK_MIN?-1:1;
+    size_t lineLength=(size_t)(x1-x0+2*r)*bpp,stripLength=(size_t)(RANK_STRIP+2*r)*span;
+    float* line=malloc(sizeof(float)*2*lineLength);
+    float* rows=malloc(sizeof(float)*2*stripLength);
+    if (!line||!rows){
+        noteOutOfMemory();
+        goto done;
+    }
+    for (strip=y0;strip<y1;strip+=RANK_STRIP){
+        int stripEnd=strip+RANK_STRIP<y1?strip+RANK_STRIP:y1;
+        //along the rows, for every source row the strip's windows reach
+        for (row=0;row<stripEnd-strip+2*r;row++){
+            size_t source=(size_t)clampIndex(strip-r+row,srcImage->height)*srcImage->width;
+            for (pix=0;pix<x1-x0+2*r;pix++){
+                size_t from=(source+clampIndex(x0-r+pix,srcImage->width))*bpp;
+                for (bit=0;bit<bpp;bit++) line[pix*bpp+bit]=sign*loadSample(srcImage,from+bit);
+            }
+            runningMaximum(line,line+lineLength,rows+(size_t)row*span,x1-x0,size,bpp);
+        }
+        //then down the columns, a whole row of the strip at a time
+        runningMaximum(rows,rows+stripLength,rows+stripLength,stripEnd-strip,size,span);
+        for (row=strip;row<stripEnd;row++){
+            const float* result=rows+stripLength+(size_t)(row-strip)*span;
+            for (pix=0;pix<x1-x0;pix++)
+                for (bit=0;bit<channels;bit++)
+                    storeSample(destImage,((size_t)row*srcImage->width+x0+pix)*bpp+bit,sign*result[pix*bpp+bit]);
+        }
+    }
+done:
+    free(line);
+    free(rows);
+}
+
+//rankScratchSize: The entries of the histogram buffer rankFilter needs for rectangles up to width columns wide, or 0 when the
+//                 kernel's path keeps no histograms.  The engines allocate it once per band rather than once per tile.
+size_t rankScratchSize(Image* srcImage,Kernel* kernel,int width){
+    if (kernel->rank!=RANK_MEDIAN||srcImage->type!=SAMPLE_U8||kernel->size<=5) return 0;
+    //16 coarse and 256 fine bins per column and channel
+    return (size_t)colourChannels(srcImage)*(width+kernel->size-1)*16*17;
+}
+
+//rankFilter: Applies a rank filter to the rectangle [x0,x1)x[y0,y1).  Like the convolution paths it reads the whole source image
+//            and writes only the rectangle, so the engines split the work between threads and tiles the same way.
+//Parameters: srcImage: The image being filtered
+//            destImage: A pre-allocated image of the same size and type
+//            kernel: A kernel registered with registerRank
+//            x0,y0,x1,y1: The rectangle to compute
+//            histograms: rankScratchSize(srcImage,kernel,x1-x0) entries, or NULL to allocate them for this call
+//Returns: Nothing
+void rankFilter(Image* srcImage,Image* destImage,Kernel* kernel,int x0,int y0,int x1,int y1,uint16_t* histograms){
+    if (kernel->rank!=RANK_MEDIAN) minMax(srcImage,destImage,kernel,x0,y0,x1,y1);
+    else if (srcImage->type!=SAMPLE_U8) medianSelect(srcImage,destImage,kernel->size,x0,y0,x1,y1);
+    else if (kernel->size<=5) medianSmall(srcImage,destImage,kernel->size,x0,y0,x1,y1);
+    else{
+        uint16_t* owned=histograms?NULL:malloc(sizeof(uint16_t)*rankScratchSize(srcImage,kernel,x1-x0));
+        if (histograms||owned) medianHistogram(srcImage,destImage,kernel->size,x0,y0,x1,y1,histograms?histograms:owned);
+        else noteOutOfMemory();
+        free(owned);
+    }
+}
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "image.h"
+#include "pipeline.h"
+#include "library.h"
+#include "timer.h"
+#include "cache.h"
+
+//server: Keeps the process, the engine's threads and the image buffers warm between images.
+//The server reads requests from a Unix domain socket (or from stdin with --serve -) and answers each with the encoded result.
+//Every number on the wire is a 32 bit unsigned integer in network byte order.
+//
+//Request:  header length, header, payload length, payload
+//          The header is text, one "key value" per line:
+//              pipeline <type>[,<type>...]     required
+//              path <file>                     read the source from this file instead of the payload
+//              linear 0|1                      compose consecutive kernels, as --linear
+//              gray 0|1                        decode the luma only and convolute one channel, as --gray
+//              format png|bmp|tga|jpg          the encoding of the result, png by default
+//              roi x y w h                     only convolute and return the w by h rectangle at x,y
+//              stats 1                         answer with the cache statistics as text instead of an image
+//          The payload is the source image file (jpg, png, bmp, tga), or empty when path is given.
+//Response: status, length, body
+//          status 0: body is the encoded image.  Otherwise body is an error message.
+//A connection can carry any number of requests, one after the other.  The server answers one request at a time, taking the
+//connections with a request waiting in turn, so a client sending many requests on one connection does not hold up the others.
+//A connection that stalls for IO_TIMEOUT_SECONDS part way through a request or response is closed.
+//With --cache or --cache-dir, repeated requests (same source bytes, pipeline, linear, gray and format) are answered from the result cache.
+//With --image-cache, a source seen recently is not decoded again, so trying several pipelines on one picture only pays for the convolution.
+
+#define MAX_HEADER 4096
+#define MAX_PAYLOAD (1u<<30)
+//Connections open at once on the socket; more are refused until one closes
+#define MAX_CONNECTIONS 64
+#define IO_TIMEOUT_SECONDS 5
+
+//readFully: Reads exactly size bytes
+//Returns: 0 on success, -1 on end of file or error
+static int readFully(int fd,void* data,size_t size){
+    while (size){
+        ssize_t count=read(fd,data,size);
+        if (count<0&&errno==EINTR) continue;
+        if (count<=0) return -1;
+        data=(char*)data+count;
+        size-=count;
+    }
+    return 0;
+}
+
+//writeFully: Writes exactly size bytes
+//Returns: 0 on success, -1 on error
+static int writeFully(int fd,const void* data,size_t size){
+    while (size){
+        ssize_t count=write(fd,data,size);
+        if (count<0&&errno==EINTR) continue;
+        if (count<=0) return -1;
+        data=(const char*)data+count;
+        size-=count;
+    }
+    return 0;
+}
+
+static int readNumber(int fd,uint32_t* number){
+    if (readFully(fd,number,sizeof(uint32_t))) return -1;
+    *number=ntohl(*number);
+    return 0;
+}
+
+static int writeNumber(int fd,uint32_t number){
+    number=htonl(number);
+    return writeFully(fd,&number,sizeof(uint32_t));
+}
+
+static int sendResponse(int fd,uint32_t status,const void* body,size_t length){
+    if (writeNumber(fd,status)||writeNumber(fd,length)) return -1;
+    return writeFully(fd,body,length);
+}
+
+static int sendError(int fd,const char* message){
+    return sendResponse(fd,1,message,strlen(message));
+}
+
+//Decoded images in imageCache start with their size, then the pixels
+typedef struct{
+    int width;
+    int height;
+    int bpp;
+} ImageHeader;
+
+//decodeSource: Decodes the source file of a request, or finds its pixels in imageCache
+//Parameters: input,length,hash: The source file's bytes, their number and hashBytes of them
+//            gray: Decode the luma only.  Luma and colour decodes of one file are cached separately.
+//            srcImage: Receives the pixels
+//            owned: Receives the buffer to free afterwards, or NULL when srcImage points into the cache
+//Returns: 0 on success, -1 if the bytes could not be decoded
+static int decodeSource(const unsigned char* input,size_t length,uint64_t hash,int gray,Image* srcImage,unsigned char** owned){
+    char key[64];
+    size_t cachedLength;
+    Image decoded;
+    *owned=NULL;
+    snprintf(key,sizeof(key),"%016llx-%zu%s",(unsigned long long)hash,length,gray?" gray":"");
+    const unsigned char* cached=cacheLookup(&imageCache,key,&cachedLength);
+    if (!cached){
+        if (gray?imgDecodeGray(input,length,&decoded):imgDecodeMem(input,length,&decoded)) return -1;
+        size_t size=(size_t)decoded.width*decoded.height*decoded.bpp;
+        //the header and pixels are kept in one buffer, so a hit needs no copy
+        unsigned char* packed=malloc(sizeof(ImageHeader)+size);
+        if (!packed){
+            *srcImage=decoded;
+            *owned=decoded.data;
+            return 0;
+        }
+        ImageHeader header={decoded.width,decoded.height,decoded.bpp};
+        memcpy(packed,&header,sizeof(ImageHeader));
+        memcpy(packed+sizeof(ImageHeader),decoded.data,size);
+        imgFreeImage(&decoded);
+        if (cacheAdopt(&imageCache,key,packed,sizeof(ImageHeader)+size)) *owned=packed;
+        cached=packed;
+    }
+    ImageHeader header;
+    memcpy(&header,cached,sizeof(ImageHeader));
+    srcImage->width=header.width;
+    srcImage->height=header.height;
+    srcImage->bpp=header.bpp;
+    srcImage->type=SAMPLE_U8;
+    srcImage->data=(uint8_t*)cached+sizeof(ImageHeader);
+    return 0;
+}
+
+//serveRequest: Runs one request whose header and payload have been read, and sends the response
+//Returns: 0 if the response was sent, -1 if the connection is broken
+static int serveRequest(int fd,char* header,unsigned char* payload,uint32_t payloadLength,ConvoluteFunction convolute){
+    char spec[MAX_HEADER]="",path[MAX_HEADER]="",format[16]="png",key[MAX_HEADER+64];
+    int linear=0,gray=0,stats=0,roi[4]={0,0,0,0};
+    char* save;
+    Image srcImage,destImage;
+    size_t length,inputLength=payloadLength;
+    unsigned char* input=payload;
+
+    for (char* line=strtok_r(header,"\n",&save);line;line=strtok_r(NULL,"\n",&save)){
+        if (!strncmp(line,"pipeline ",9)) sscanf(line+9,"%4095s",spec);
+        else if (!strncmp(line,"path ",5)) snprintf(path,sizeof(path),"%s",line+5);
+        else if (!strncmp(line,"linear ",7)) linear=atoi(line+7);
+        else if (!strncmp(line,"gray ",5)) gray=atoi(line+5);
+        else if (!strncmp(line,"format ",7)) sscanf(line+7,"%15s",format);
+        else if (!strncmp(line,"stats ",6)) stats=atoi(line+6);
+        else if (!strncmp(line,"roi ",4)){
+            if (sscanf(line+4,"%d %d %d %d",&roi[0],&roi[1],&roi[2],&roi[3])!=4) return sendError(fd,"Bad roi line.");
+        }
+        else return sendError(fd,"Unknown header line.");
+    }
+    if (stats){
+        char text[1024];
+        printCacheStats(text,sizeof(text),"result",&resultCache);
+        printCacheStats(text+strlen(text),sizeof(text)-strlen(text),"image",&imageCache);
+        return sendResponse(fd,0,text,strlen(text));
+    }
+    if (!payloadLength&&*path) input=imgReadFile(path,&inputLength);
+    if (!input) return sendError(fd,*path?"Could not read the file.":"No image in the request.");
+
+    //a repeat of an earlier request is answered without decoding, convoluting or encoding
+    uint64_t hash=cacheEnabled(&resultCache)||cacheEnabled(&imageCache)?hashBytes(input,inputLength):0;
+    Pipeline pipeline;
+    //an unknown spec is not looked up, and fails below with the usual error
+    if (cacheEnabled(&resultCache)&&parsePipeline(spec,&pipeline)==0){
+        char request[MAX_HEADER+64];
+        snprintf(request,sizeof(request),"%s@%d,%d,%d,%d%s",spec,roi[0],roi[1],roi[2],roi[3],gray?" gray":"");
+        resultCacheKey(key,sizeof(key),hash,inputLength,request,pipelineHash(&pipeline),linear,format);
+        const unsigned char* cached=cacheLookup(&resultCache,key,&length);
+        if (cached){
+            if (input!=payload) free(input);
+            return sendResponse(fd,0,cached,length);
+        }
+    }
+    unsigned char* owned;
+    int failed;
+    if (cacheEnabled(&imageCache)) failed=decodeSource(input,inputLength,hash,gray,&srcImage,&owned);
+    else{
+        failed=gray?imgDecodeGray(input,inputLength,&srcImage):imgDecodeMem(input,inputLength,&srcImage);
+        owned=srcImage.data;
+    }
+    if (input!=payload) free(input);
+    if (failed) return sendError(fd,"Could not decode the image.");
+
+    if (roi[2]) failed=imgPipelineRegion(&srcImage,&destImage,spec,linear,convolute,roi[0],roi[1],roi[2],roi[3]);
+    else failed=imgPipelineRun(&srcImage,&destImage,spec,linear,convolute);
+    free(owned);
+    if (failed) return sendError(fd,"Unknown pipeline, region outside the image, or out of memory.");
+    unsigned char* encoded=imgEncodeMem(&destImage,format,&length);
+    imgFreeImage(&destImage);
+    if (!encoded) return sendError(fd,"Unknown format or encoding failed.");
+    if (cacheEnabled(&resultCache)) cacheStore(&resultCache,key,encoded,length);
+    int sent=sendResponse(fd,0,encoded,length);
+    free(encoded);
+    return sent;
+}
+
+//serveNext: Reads one request from in and answers it on out
+//Returns: 0 if the connection can carry another request, -1 if the peer closed it or broke the protocol
+static int serveNext(int in,int out,ConvoluteFunction convolute){
+    uint32_t headerLength,payloadLength;
+    char header[MAX_HEADER+1];
+    if (readNumber(in,&headerLength)||headerLength>MAX_HEADER) return -1;
+    if (readFully(in,header,headerLength)) return -1;
+    header[headerLength]=0;
+    if (readNumber(in,&payloadLength)||payloadLength>MAX_PAYLOAD) return -1;
+    unsigned char* payload=payloadLength?malloc(payloadLength):NULL;
+    if (payloadLength&&!payload) return -1;
+    int failed=readFully(in,payload,payloadLength)||serveRequest(out,header,payload,payloadLength,convolute);
+    free(payload);
+    return failed?-1:0;
+}
+
+//serveConnections: Answers the connections in fds[1..count) a request at a time and accepts new ones on fds[0], forever
+static void serveConnections(struct pollfd* fds,int count,ConvoluteFunction convolute){
+    struct timeval timeout={IO_TIMEOUT_SECONDS,0};
+    for (;;){
+        if (poll(fds,count,-1)<0){
+            if (errno==EINTR) continue;
+            printf("poll failed: %s.\n",strerror(errno));
+            return;
+        }
+        //one request from every connection that has one waiting, then the closed connections are dropped
+        int kept=1;
+        for (int i=1;i<count;i++){
+            if (fds[i].revents&&serveNext(fds[i].fd,fds[i].fd,convolute)){
+                close(fds[i].fd);
+                continue;
+            }
+            fds[kept++]=fds[i];
+        }
+        count=kept;
+        if (fds[0].revents&POLLIN){
+            int connection=accept(fds[0].fd,NULL,NULL);
+            if (connection<0){
+                if (errno==EINTR||errno==EAGAIN) continue;
+                printf("accept failed: %s.\n",strerror(errno));
+                return;
+            }
+            if (count>MAX_CONNECTIONS){
+                close(connection);
+                continue;
+            }
+            //a peer that stops part way through a request or response must not stall everyone else
+            setsockopt(connection,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+            setsockopt(connection,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+            fds[count].fd=connection;
+            fds[count].events=POLLIN;
+            count++;
+        }
+    }
+}
+
+//runServer: Serves requests until the process is killed, or until stdin is closed when socketPath is "-"
+//Parameters: socketPath: The Unix domain socket to listen on, or "-" for stdin and stdout
+//            convolute: The engine used for every request
+//Returns: The exit code for main
+int runServer(const char* socketPath,ConvoluteFunction convolute){
+    struct sockaddr_un address;
+    int listener;
+    //a client that goes away mid response must not take the server with it
+    signal(SIGPIPE,SIG_IGN);
+    timerEnable(0);
+    if (!strcmp(socketPath,"-")){
+        //stdout carries the responses, so anything the engine prints goes to stderr instead
+        int out=dup(1);
+        dup2(2,1);
+        while (!serveNext(0,out,convolute));
+        close(out);
+        return 0;
+    }
+    if (strlen(socketPath)>=sizeof(address.sun_path)){
+        printf("Socket path %s is too long.\n",socketPath);
+        return -1;
+    }
+    memset(&address,0,sizeof(address));
+    address.sun_family=AF_UNIX;
+    strcpy(address.sun_path,socketPath);
+    unlink(socketPath);
+    listener=socket(AF_UNIX,SOCK_STREAM,0);
+    if (listener<0||bind(listener,(struct sockaddr*)&address,sizeof(address))||listen(listener,16)){
+        printf("Could not listen on %s: %s.\n",socketPath,strerror(errno));
+        return -1;
+    }
+    printf("Listening on %s\n",socketPath);
+    fflush(stdout);
+    struct pollfd fds[MAX_CONNECTIONS+1];
+    fds[0].fd=listener;
+    fds[0].events=POLLIN;
+    serveConnections(fds,1,convolute);
+    close(listener);
+    unlink(socketPath);
+    return -1;
+}
+
+//exchange: Sends one request and reads the response
+//Returns: 0 if a response was read, -1 if the connection broke.  body is to be freed by the caller.
+static int exchange(int fd,const char* header,const unsigned char* payload,uint32_t payloadLength,uint32_t* status,unsigned char** body,uint32_t* length){
+    uint32_t headerLength=strlen(header);
+    *body=NULL;
+    if (writeNumber(fd,headerLength)||writeFully(fd,header,headerLength)||writeNumber(fd,payloadLength)||writeFully(fd,payload,payloadLength)) return -1;
+    if (readNumber(fd,status)||readNumber(fd,length)||!(*body=malloc(*length+1))||readFully(fd,*body,*length)){
+        free(*body);
+        *body=NULL;
+        return -1;
+    }
+    (*body)[*length]=0;
+    return 0;
+}
+
+//runClient: Sends a file to a server repeat times, writes the last result to output.<format> and prints the request rate
+//Parameters: socketPath: The server's socket
+//            fileName: The source image, sent as the payload
+//            spec: The pipeline, ie. "blur,sharpen"
+//            linear: Whether the server should compose consecutive kernels
+//            gray: Whether the server should decode and convolute the luma only
+//            format: The output format, png, bmp, tga or jpg
+//            repeat: How many times to send the request
+//            stats: Whether to ask for and print the server's cache statistics afterwards
+//Returns: The exit code for main
+int runClient(const char* socketPath,const char* fileName,const char* spec,int linear,int gray,const char* format,int repeat,int stats){
+    struct sockaddr_un address;
+    char header[MAX_HEADER],outputName[64];
+    uint32_t status=0,length;
+    size_t payloadLength;
+    unsigned char* body=NULL;
+    unsigned char* payload=imgReadFile(fileName,&payloadLength);
+    if (!payload||payloadLength>MAX_PAYLOAD){
+        printf("Error loading file %s.\n",fileName);
+        free(payload);
+        return -1;
+    }
+    int headerLength=snprintf(header,sizeof(header),"pipeline %s\nlinear %d\ngray %d\nformat %s\n",spec,linear,gray,format);
+    if (headerLength>=MAX_HEADER||strlen(socketPath)>=sizeof(address.sun_path)){
+        printf("The pipeline or socket path is too long.\n");
+        free(payload);
+        return -1;
+    }
+    memset(&address,0,sizeof(address));
+    address.sun_family=AF_UNIX;
+    strcpy(address.sun_path,socketPath);
+    int fd=socket(AF_UNIX,SOCK_STREAM,0);
+    if (fd<0||connect(fd,(struct sockaddr*)&address,sizeof(address))){
+        printf("Could not connect to %s: %s.\n",socketPath,strerror(errno));
+        free(payload);
+        return -1;
+    }
+    double start=nowSeconds();
+    int done;
+    for (done=0;done<repeat;done++){
+        free(body);
+        if (exchange(fd,header,payload,payloadLength,&status,&body,&length)) break;
+        if (status){
+            printf("Server error: %s\n",(char*)body);
+            break;
+        }
+    }
+    double elapsed=nowSeconds()-start;
+    free(payload);
+    if (done<repeat){
+        if (!body) printf("Connection to %s lost.\n",socketPath);
+        free(body);
+        close(fd);
+        return -1;
+    }
+    snprintf(outputName,sizeof(outputName),"output.%s",format);
+    FILE* output=fopen(outputName,"wb");
+    if (output){
+        fwrite(body,1,length,output);
+        fclose(output);
+    }
+    free(body);
+    if (!output){
+        printf("Error writing %s.\n",outputName);
+        close(fd);
+        return -1;
+    }
+    printf("%d requests in %.3f s: %.1f requests/sec\n",repeat,elapsed,repeat/elapsed);
+    if (stats&&exchange(fd,"stats 1\n",NULL,0,&status,&body,&length)==0){
+        printf("%s",(char*)body);
+        free(body);
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <string.h>
+#include "image.h"
+
+//Specialized 3x3 convolutions for the built in kernels, generated at compile time from their coefficients.
+//The coefficients are literals, so TAP folds away the zero taps and turns the +1/-1 taps into adds and subtracts.
+//Every function computes exactly what convoluteRows computes for the same kernel.
+
+#define TAP(c,p) ((c)==0?0:(c)==1?(int)(p):(c)==-1?-(int)(p):(c)*(int)(p))
+#define FTAP(c,p) ((c)==0?0.0:(c)*(p))
+
+//The shared loop: up, mid and down point at the three source rows, left, centre and right at the three columns,
+//with the edge pixels reused at the borders.  SUM is the expression for one channel and STORE converts it to a byte.
+#define SPECIALIZE(fname,type,SUM,STORE) \
+static void fname(Image* srcImage,Image* destImage,int x0,int y0,int x1,int y1){ \
+    int row,pix,bit,bpp=srcImage->bpp,span=srcImage->width*srcImage->bpp,channels=colourChannels(srcImage); \
+    for (row=y0;row<y1;row++){ \
+        const uint8_t* up=srcImage->data+clampIndex(row-1,srcImage->height)*span; \
+        const uint8_t* mid=srcImage->data+row*span; \
+        const uint8_t* down=srcImage->data+clampIndex(row+1,srcImage->height)*span; \
+        uint8_t* out=destImage->data+row*span; \
+        for (pix=x0;pix<x1;pix++){ \
+            int left=clampIndex(pix-1,srcImage->width)*bpp,centre=pix*bpp,right=clampIndex(pix+1,srcImage->width)*bpp; \
+            for (bit=0;bit<channels;bit++){ \
+                type sum=SUM; \
+                out[centre+bit]=STORE; \
+            } \
+        } \
+    } \
+}
+
+//SPECIALIZE_INT: an integerExact kernel with coefficients a..i (scaled by 2^shift), row major
+#define SPECIALIZE_INT(fname,a,b,c,d,e,f,g,h,i,shift) SPECIALIZE(fname,int, \
+    TAP(a,up[left+bit])+TAP(b,up[centre+bit])+TAP(c,up[right+bit])+ \
+    TAP(d,mid[left+bit])+TAP(e,mid[centre+bit])+TAP(f,mid[right+bit])+ \
+    TAP(g,down[left+bit])+TAP(h,down[centre+bit])+TAP(i,down[right+bit]), \
+    (uint8_t)(sum/(1<<(shift))))
+
+//SPECIALIZE_FLOAT: any other kernel.  The taps are summed in the same order as getPixelValue so the rounding is identical.
+#define SPECIALIZE_FLOAT(fname,a,b,c,d,e,f,g,h,i) SPECIALIZE(fname,double, \
+    FTAP(a,up[left+bit])+FTAP(b,up[centre+bit])+FTAP(c,up[right+bit])+ \
+    FTAP(d,mid[left+bit])+FTAP(e,mid[centre+bit])+FTAP(f,mid[right+bit])+ \
+    FTAP(g,down[left+bit])+FTAP(h,down[centre+bit])+FTAP(i,down[right+bit]), \
+    (uint8_t)(int)sum)
+
+SPECIALIZE_INT(edgeRows,0,-1,0,-1,4,-1,0,-1,0,0)
+SPECIALIZE_INT(sharpenRows,0,-1,0,-1,5,-1,0,-1,0,0)
+SPECIALIZE_FLOAT(blurRows,1/9.0,1/9.0,1/9.0,1/9.0,1/9.0,1/9.0,1/9.0,1/9.0,1/9.0)
+SPECIALIZE_INT(gaussRows,1,2,1,2,4,2,1,2,1,4)
+SPECIALIZE_INT(embossRows,-2,-1,0,-1,1,1,0,1,2,0)
+
+//identityRows: identity is a straight copy of each row of the rectangle
+static void identityRows(Image* srcImage,Image* destImage,int x0,int y0,int x1,int y1){
+    int span=srcImage->width*srcImage->bpp;
+    for (int row=y0;row<y1;row++)
+        memcpy(destImage->data+row*span+x0*srcImage->bpp,srcImage->data+row*span+x0*srcImage->bpp,(x1-x0)*srcImage->bpp);
+}
+
+//The specialized functions, indexed by KernelTypes.  Kernel.builtin selects the entry.
+RectFunction specializedRows[]={edgeRows,sharpenRows,blurRows,gaussRows,embossRows,identityRows};
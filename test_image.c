@@ -0,0 +1,957 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+#include "pipeline.h"
+#include "timer.h"
+#include "library.h"
+#include "cache.h"
+#include "stb_image.h"
+
+//test_image: Regression and equivalence tests for the convolution engines.
+//Every engine, thread count, tile size and execution path is compared pixel by pixel against the reference, which is
+//getPixelValue applied to every pixel.  The reference output is also hashed and compared with golden_hashes.txt,
+//so a change to the reference itself is caught too.  Run with --update to rewrite the golden file after an intended change.
+//
+//Tolerances (largest allowed difference of any channel from the reference):
+//    specialized, integer, integer separable, tiled and threaded paths   0  (they compute the same integer or the same
+//                                                                            floating point sum in the same order)
+//    --linear composition of two stages                                  1 per folded stage when neither stage wraps
+//                                                                            (only the truncation between stages is lost).
+//                                                                            Not checked within the composed radius of the
+//                                                                            border, where clamping twice and clamping once
+//                                                                            read different pixels.
+//    float samples (--float), one stage, kernels with integer or power of two coefficients
+//                                                                        0  (every product and sum is exact in a float)
+//    16 bit samples of value v*256, gauss, shifted back down by 8 bits   0  (rounding to 16 bits never crosses a multiple of 256)
+//    16 bit integer separable path against the float path on 16 bit samples
+//                                                                        0  (both round the same exact sum)
+//    linear light round trip of 8 bit samples                           0
+//    skipped alpha (setSkipAlpha): colour channels                      0, and alpha is the source's
+//    premultiplied alpha round trip, where alpha is not 0               1  (the colour is held in 16 bits scaled by alpha)
+//    fused gradient operators (sobel, scharr): gradients                 0  against the x and y kernels
+//                                              magnitude, angle          0  against the same double precision formula
+//    rank filters (medianN, erodeN, dilateN), 8 bit, 16 bit and float   0  against sorting every window
+//    bilateral filter                                                  0  against summing every window for the same levels
+//                                      float samples                     1  (float results are truncated, 8 bit ones rounded)
+//    recursive gaussian (gaussian:S)                                    1  against a sampled Gaussian out to 6 sigma
+//                       engines, thread counts, tile sizes               0  against the serial engine (every line is filtered whole)
+//                       regions, float and 16 bit samples                1  against the serial engine
+//Faster paths added later (SIMD, fixed point) must add themselves here with their tolerance.
+
+#define GOLDEN_FILE "golden_hashes.txt"
+#define MAX_GOLDEN 256
+
+typedef struct{
+    const char* name;
+    ConvoluteFunction convolute;
+} TestEngine;
+
+static TestEngine engines[]={{"serial",convolute},{"omp",ompConvolute},{"pthread",pthreadConvolute}};
+static int threadCounts[]={1,2,3,7};
+static int tileSizes[][2]={{0,0},{1,1},{7,5},{64,16},{0,3}};
+
+static int failures=0,checks=0;
+
+//The golden hashes, read from GOLDEN_FILE
+static char goldenKeys[MAX_GOLDEN][96];
+static unsigned long long goldenHashes[MAX_GOLDEN];
+static int goldenCount=0,updateGolden=0;
+
+//hashImage: FNV-1a over the pixels
+static unsigned long long hashImage(Image* image){
+    unsigned long long hash=1469598103934665603ULL;
+    size_t size=(size_t)image->width*image->height*image->bpp;
+    for (size_t i=0;i<size;i++){
+        hash^=image->data[i];
+        hash*=1099511628211ULL;
+    }
+    return hash;
+}
+
+//maxDifference: The largest difference of any channel between two images of the same size
+static int maxDifference(Image* a,Image* b){
+    int worst=0;
+    size_t size=(size_t)a->width*a->height*a->bpp;
+    for (size_t i=0;i<size;i++){
+        int difference=abs(a->data[i]-b->data[i]);
+        if (difference>worst) worst=difference;
+    }
+    return worst;
+}
+
+//maxInteriorDifference: Like maxDifference, but ignores a margin around the border
+static int maxInteriorDifference(Image* a,Image* b,int margin){
+    int worst=0;
+    for (int row=margin;row<a->height-margin;row++)
+        for (int pix=margin;pix<a->width-margin;pix++)
+            for (int bit=0;bit<a->bpp;bit++){
+                int difference=abs(a->data[Index(pix,row,a->width,bit,a->bpp)]-b->data[Index(pix,row,a->width,bit,a->bpp)]);
+                if (difference>worst) worst=difference;
+            }
+    return worst;
+}
+
+//maxSampleDifference: Like maxDifference, but compares sample values, so the images can be of different types
+static float maxSampleDifference(Image* a,Image* b){
+    float worst=0;
+    size_t size=(size_t)a->width*a->height*a->bpp;
+    for (size_t i=0;i<size;i++){
+        float difference=fabsf(loadSample(a,i)-loadSample(b,i));
+        if (difference>worst) worst=difference;
+    }
+    return worst;
+}
+
+static void check(int passed,const char* what,const char* input,const char* kernel){
+    checks++;
+    if (!passed){
+        failures++;
+        printf("FAIL %s: %s %s\n",what,input,kernel);
+    }
+}
+
+//referenceConvolute: The slow, obviously correct convolution every other path is compared with
+static void referenceConvolute(Image* srcImage,Image* destImage,Kernel* kernel){
+    for (int row=0;row<srcImage->height;row++)
+        for (int pix=0;pix<srcImage->width;pix++)
+            for (int bit=0;bit<srcImage->bpp;bit++)
+                destImage->data[Index(pix,row,srcImage->width,bit,srcImage->bpp)]=getPixelValue(srcImage,pix,row,bit,kernel);
+}
+
+static Image newImage(int width,int height,int bpp){
+    Image image={malloc((size_t)width*height*bpp),width,height,bpp,SAMPLE_U8};
+    if (!image.data){
+        printf("Out of memory.\n");
+        exit(1);
+    }
+    return image;
+}
+
+//syntheticImage: Repeatable noise, with a few flat areas so the wrapping of negative and large sums is exercised
+static Image syntheticImage(int width,int height,int bpp){
+    uint32_t seed=width*7919+height*104729+bpp;
+    Image image=newImage(width,height,bpp);
+    for (size_t i=0;i<(size_t)width*height*bpp;i++){
+        seed=seed*1664525+1013904223;
+        image.data[i]=(i/bpp)%5==0?255:seed>>24;
+    }
+    return image;
+}
+
+static void loadGolden(){
+    char line[256];
+    FILE* file=fopen(GOLDEN_FILE,"r");
+    if (!file) return;
+    while (goldenCount<MAX_GOLDEN&&fgets(line,sizeof(line),file))
+        if (sscanf(line,"%95s %llx",goldenKeys[goldenCount],&goldenHashes[goldenCount])==2) goldenCount++;
+    fclose(file);
+}
+
+//checkGolden: Compares a reference hash with the golden file, or records it when updating
+static void checkGolden(const char* input,Kernel* kernel,unsigned long long hash){
+    char key[96];
+    snprintf(key,sizeof(key),"%s:%s",input,kernel->name);
+    for (int i=0;i<goldenCount;i++){
+        if (strcmp(goldenKeys[i],key)) continue;
+        if (updateGolden) goldenHashes[i]=hash;
+        else check(goldenHashes[i]==hash,"golden hash",input,kernel->name);
+        return;
+    }
+    if (updateGolden&&goldenCount<MAX_GOLDEN){
+        strcpy(goldenKeys[goldenCount],key);
+        goldenHashes[goldenCount++]=hash;
+    }
+    else check(0,"missing golden hash",input,kernel->name);
+}
+
+static void saveGolden(){
+    FILE* file=fopen(GOLDEN_FILE,"w");
+    if (!file){
+        printf("Could not write %s.\n",GOLDEN_FILE);
+        failures++;
+        return;
+    }
+    for (int i=0;i<goldenCount;i++) fprintf(file,"%s %016llx\n",goldenKeys[i],goldenHashes[i]);
+    fclose(file);
+}
+
+//testKernel: Runs one kernel through every engine, thread count and tile size, and through the generic paths
+static void testKernel(const char* input,Image* srcImage,Kernel* kernel){
+    Image expected=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image actual=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    char what[128];
+    size_t e,t,s;
+
+    referenceConvolute(srcImage,&expected,kernel);
+    checkGolden(input,kernel,hashImage(&expected));
+    for (e=0;e<sizeof(engines)/sizeof(TestEngine);e++){
+        for (t=0;t<sizeof(threadCounts)/sizeof(int);t++){
+            for (s=0;s<sizeof(tileSizes)/sizeof(tileSizes[0]);s++){
+                setThreadCount(threadCounts[t]);
+                setTileSize(tileSizes[s][0],tileSizes[s][1]);
+                memset(actual.data,0xAA,(size_t)actual.width*actual.height*actual.bpp);
+                engines[e].convolute(srcImage,&actual,kernel);
+                snprintf(what,sizeof(what),"%s %d threads %dx%d tiles",engines[e].name,threadCounts[t],tileSizes[s][0],tileSizes[s][1]);
+                check(maxDifference(&expected,&actual)==0,what,input,kernel->name);
+            }
+        }
+    }
+    setThreadCount(0);
+    setTileSize(0,0);
+
+    //the same coefficients without the specialization, so the integer, separable and floating point paths are covered too
+    Kernel generic=*kernel;
+    generic.builtin=-1;
+    convolute(srcImage,&actual,&generic);
+    check(maxDifference(&expected,&actual)==0,"generic path",input,kernel->name);
+    generic.intSeparable=0;
+    convolute(srcImage,&actual,&generic);
+    check(maxDifference(&expected,&actual)==0,"direct path",input,kernel->name);
+    generic.integerExact=0;
+    convolute(srcImage,&actual,&generic);
+    check(maxDifference(&expected,&actual)==0,"floating point path",input,kernel->name);
+
+    free(expected.data);
+    free(actual.data);
+}
+
+//testPipeline: The planner must skip identity without changing the output, and --linear may only differ by the documented tolerance
+static void testPipeline(const char* input,Image* srcImage){
+    Pipeline staged,fused;
+    Image stagedImage,fusedImage,expected=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    int owns;
+
+    parsePipeline("identity,identity",&staged);
+    planPipeline(&staged);
+    owns=runPipeline(srcImage,&stagedImage,&staged,convolute);
+    check(owns==0&&stagedImage.data==srcImage->data,"identity pass through",input,"identity,identity");
+
+    parsePipeline("gauss,identity",&staged);
+    planPipeline(&staged);
+    owns=runPipeline(srcImage,&stagedImage,&staged,convolute);
+    referenceConvolute(srcImage,&expected,getKernel(GAUSE_BLUR));
+    check(owns==1&&staged.count==1&&maxDifference(&expected,&stagedImage)==0,"identity planned away",input,"gauss,identity");
+    if (owns>0) releaseBuffer(stagedImage.data,(size_t)stagedImage.width*stagedImage.height*stagedImage.bpp);
+
+    //gauss never wraps, so composing two of them only loses the truncation between the stages
+    parsePipeline("gauss,gauss",&staged);
+    planPipeline(&staged);
+    check(composePipeline(&staged,&fused)==1,"gauss,gauss composes",input,"gauss,gauss");
+    if (runPipeline(srcImage,&stagedImage,&staged,convolute)>0&&runPipeline(srcImage,&fusedImage,&fused,convolute)>0){
+        check(maxInteriorDifference(&stagedImage,&fusedImage,fused.stages[0]->size/2)<=1,"linear composition tolerance",input,"gauss,gauss");
+        releaseBuffer(stagedImage.data,(size_t)stagedImage.width*stagedImage.height*stagedImage.bpp);
+        releaseBuffer(fusedImage.data,(size_t)fusedImage.width*fusedImage.height*fusedImage.bpp);
+    }
+    free(expected.data);
+}
+
+//testLibrary: The in-memory API must round trip through png losslessly and give the same pixels as the engines
+static void testLibrary(const char* input,Image* srcImage){
+    Image decoded,result,expected=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    size_t length;
+    unsigned char* png=imgEncodeMem(srcImage,"png",&length);
+    check(png&&imgDecodeMem(png,length,&decoded)==0&&decoded.width==srcImage->width&&decoded.height==srcImage->height&&
+        decoded.bpp==srcImage->bpp&&maxDifference(srcImage,&decoded)==0,"png round trip",input,"");
+    if (png&&decoded.data) imgFreeImage(&decoded);
+    free(png);
+
+    referenceConvolute(srcImage,&expected,getKernel(SHARPEN));
+    check(imgConvolve(srcImage,&result,"sharpen",pthreadConvolute)==0&&maxDifference(&expected,&result)==0,"imgConvolve",input,"sharpen");
+    imgFreeImage(&result);
+    check(imgPipelineRun(srcImage,&result,"identity",0,convolute)==0&&result.data!=srcImage->data&&maxDifference(srcImage,&result)==0,
+        "imgPipelineRun copies",input,"identity");
+    if (result.data!=srcImage->data) imgFreeImage(&result);
+    check(imgPipelineRun(srcImage,&result,"nonsense",0,convolute)==-1,"imgPipelineRun unknown kernel",input,"nonsense");
+    free(expected.data);
+}
+
+//testRegion: A region must be exactly the same rectangle of the full run, including where it touches the border
+static void testRegion(const char* input,Image* srcImage){
+    static const char* specs[]={"edge","blur,sharpen,emboss","identity"};
+    int w=srcImage->width,h=srcImage->height;
+    int regions[][4]={{0,0,w,h},{0,0,1,1},{w/2,h/3,(w+3)/4,(h+3)/4},{w-1,h-1,1,1},{w/3,0,w-w/3,h}};
+    for (size_t s=0;s<sizeof(specs)/sizeof(specs[0]);s++){
+        Pipeline pipeline;
+        Image full,region;
+        parsePipeline(specs[s],&pipeline);
+        planPipeline(&pipeline);
+        int owns=runPipeline(srcImage,&full,&pipeline,ompConvolute);
+        for (size_t r=0;r<sizeof(regions)/sizeof(regions[0]);r++){
+            int* rect=regions[r],worst=0;
+            if (runPipelineRegion(srcImage,&region,&pipeline,ompConvolute,rect[0],rect[1],rect[2],rect[3])<0){
+                check(0,"region runs",input,specs[s]);
+                continue;
+            }
+            for (int row=0;row<rect[3];row++)
+                for (int pix=0;pix<rect[2];pix++)
+                    for (int bit=0;bit<srcImage->bpp;bit++){
+                        int difference=abs(region.data[Index(pix,row,rect[2],bit,srcImage->bpp)]-full.data[Index((pix+rect[0]),(row+rect[1]),w,bit,srcImage->bpp)]);
+                        if (difference>worst) worst=difference;
+                    }
+            check(region.width==rect[2]&&region.height==rect[3]&&worst==0,"region matches the full run",input,specs[s]);
+            releaseBuffer(region.data,(size_t)rect[2]*rect[3]*srcImage->bpp);
+        }
+        check(runPipelineRegion(srcImage,&region,&pipeline,ompConvolute,1,0,w,h)<0,"region outside the image",input,specs[s]);
+        if (owns>0) releaseBuffer(full.data,(size_t)w*h*srcImage->bpp);
+    }
+}
+
+//testUpdate: Repainting parts of the source and updating only the dirty rectangles must give the same images as running the pipeline again
+static void testUpdate(const char* input,Image* srcImage){
+    Pipeline pipeline;
+    Image images[3],expected;
+    int w=srcImage->width,h=srcImage->height,bpp=srcImage->bpp;
+    Rect dirty[3]={{w/2,h/2,1,1},{0,h>1?h-2:0,w,2},{w-1,0,5,5}};
+    uint32_t seed=w*31+h;
+    parsePipeline("gauss,edge",&pipeline);
+    images[0]=newImage(w,h,bpp);
+    memcpy(images[0].data,srcImage->data,(size_t)w*h*bpp);
+    for (int i=1;i<3;i++){
+        images[i]=newImage(w,h,bpp);
+        convolute(&images[i-1],&images[i],pipeline.stages[i-1]);
+    }
+    //paint the dirty rectangles with new noise
+    for (int i=0;i<3;i++)
+        for (int row=dirty[i].y;row<dirty[i].y+dirty[i].height&&row<h;row++)
+            for (int pix=dirty[i].x;pix<dirty[i].x+dirty[i].width&&pix<w;pix++)
+                for (int bit=0;bit<bpp;bit++){
+                    seed=seed*1664525+1013904223;
+                    images[0].data[Index(pix,row,w,bit,bpp)]=seed>>24;
+                }
+    updatePipeline(images,&pipeline,dirty,3);
+    check(runPipeline(&images[0],&expected,&pipeline,convolute)>0&&maxDifference(&expected,&images[2])==0,"dirty rectangle update",input,"gauss,edge");
+    releaseBuffer(expected.data,(size_t)w*h*bpp);
+    for (int i=0;i<3;i++) free(images[i].data);
+}
+
+//testOutOfCore: Processing a raw file in bands with a tiny memory budget must give the same pixels as a run in memory
+static void testOutOfCore(const char* input,Image* srcImage){
+    static const char* names[]={"","test_in.pgm","test_in.pam","test_in.ppm","test_in.pam"};
+    Pipeline pipeline;
+    Image expected;
+    int w=srcImage->width,h=srcImage->height,bpp=srcImage->bpp;
+    size_t size=(size_t)w*h*bpp;
+    char header[128];
+    //PGM and PPM hold 1 and 3 channels, PAM any number
+    if (bpp==1||bpp==3) snprintf(header,sizeof(header),"P%d\n%d %d\n255\n",bpp==1?5:6,w,h);
+    else snprintf(header,sizeof(header),"P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nENDHDR\n",w,h,bpp);
+    FILE* file=fopen(names[bpp],"wb");
+    if (!file) return;
+    fputs(header,file);
+    fwrite(srcImage->data,1,size,file);
+    fclose(file);
+
+    parsePipeline("blur,sharpen,gauss",&pipeline);
+    runPipeline(srcImage,&expected,&pipeline,convolute);
+    //a budget of one row per band buffer plus the halos forces one row per band
+    size_t budget=(size_t)w*bpp*4*(1+2*pipelineRadius(&pipeline));
+    int result=runOutOfCore(names[bpp],"test_out.raw",&pipeline,pthreadConvolute,budget);
+    uint8_t* actual=malloc(size+1);
+    file=fopen("test_out.raw","rb");
+    //the pixels are the last size bytes, after a header in the source's format
+    int matched=result==0&&file&&actual&&!fseek(file,-(long)size,SEEK_END)&&fread(actual,1,size+1,file)==size&&!memcmp(actual,expected.data,size);
+    check(matched,"out of core matches in memory",input,"blur,sharpen,gauss");
+    if (file) fclose(file);
+    free(actual);
+    releaseBuffer(expected.data,size);
+    remove(names[bpp]);
+    remove("test_out.raw");
+}
+
+//testWide: The float and 16 bit paths, through every engine
+static void testWide(const char* input,Image* srcImage){
+    static int exactKernels[]={EDGE,SHARPEN,GAUSE_BLUR,EMBOSS,IDENTITY};
+    Image expected=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image floats=*srcImage,floatResult,wide=*srcImage,wideResult;
+    Image actual=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    size_t count=(size_t)srcImage->width*srcImage->height*srcImage->bpp;
+    floats.type=floatResult.type=SAMPLE_FLOAT;
+    wide.type=wideResult.type=SAMPLE_U16;
+    floats.data=malloc(imageBytes(&floats));
+    floatResult=floats;
+    floatResult.data=malloc(imageBytes(&floats));
+    wide.data=malloc(imageBytes(&wide));
+    wideResult=wide;
+    wideResult.data=malloc(imageBytes(&wide));
+    convertImage(srcImage,&floats);
+    for (size_t i=0;i<count;i++) ((uint16_t*)wide.data)[i]=srcImage->data[i]<<8;
+
+    for (size_t e=0;e<sizeof(engines)/sizeof(TestEngine);e++){
+        for (size_t k=0;k<sizeof(exactKernels)/sizeof(int);k++){
+            Kernel* kernel=getKernel(exactKernels[k]);
+            referenceConvolute(srcImage,&expected,kernel);
+            engines[e].convolute(&floats,&floatResult,kernel);
+            convertImage(&floatResult,&actual);
+            check(maxDifference(&expected,&actual)==0,engines[e].name,input,kernel->name);
+        }
+        referenceConvolute(srcImage,&expected,getKernel(GAUSE_BLUR));
+        engines[e].convolute(&wide,&wideResult,getKernel(GAUSE_BLUR));
+        for (size_t i=0;i<count;i++) actual.data[i]=((uint16_t*)wideResult.data)[i]>>8;
+        check(maxDifference(&expected,&actual)==0,"16 bit",input,"gauss");
+    }
+    free(floats.data);
+    free(floatResult.data);
+    free(wide.data);
+    free(wideResult.data);
+    free(expected.data);
+    free(actual.data);
+}
+
+//testLight: Linear light must give back every 8 bit sample unchanged when nothing is done to it, the 16 bit separable path must match
+//           the float one, and blurring black and white stripes must give the sRGB value of half the light, not half the value
+static void testLight(const char* input,Image* srcImage){
+    Image linear=*srcImage,result=*srcImage,floats=*srcImage,floatResult=*srcImage,back=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Kernel* gauss=getKernel(GAUSE_BLUR);
+    linear.type=result.type=SAMPLE_U16;
+    floats.type=floatResult.type=SAMPLE_FLOAT;
+    linear.data=malloc(imageBytes(&linear));
+    result.data=malloc(imageBytes(&result));
+    floats.data=malloc(imageBytes(&floats));
+    floatResult.data=malloc(imageBytes(&floats));
+
+    linearizeImage(srcImage,&linear);
+    encodeImage(&linear,&back);
+    check(maxDifference(srcImage,&back)==0,"linear light round trip",input,"16 bit");
+    linearizeImage(srcImage,&floats);
+    encodeImage(&floats,&back);
+    check(maxDifference(srcImage,&back)==0,"linear light round trip",input,"float");
+
+    for (size_t e=0;e<sizeof(engines)/sizeof(TestEngine);e++){
+        engines[e].convolute(&linear,&result,gauss);
+        convertImage(&linear,&floats);
+        engines[e].convolute(&floats,&floatResult,gauss);
+        convertImage(&floatResult,&linear);
+        check(!memcmp(result.data,linear.data,imageBytes(&linear)),engines[e].name,input,"16 bit separable gauss");
+        linearizeImage(srcImage,&linear);
+    }
+
+    for (size_t i=0;i<(size_t)srcImage->width*srcImage->height*srcImage->bpp;i++)
+        back.data[i]=(i/srcImage->bpp)%2?255:0;
+    linearizeImage(&back,&linear);
+    convolute(&linear,&result,gauss);
+    encodeImage(&result,&back);
+    //with alpha, the last channel of each pixel is only averaged
+    if (srcImage->width>2&&srcImage->bpp!=2&&srcImage->bpp!=4) check(back.data[srcImage->bpp]==188,"linear light blur",input,"gauss");
+
+    free(linear.data);
+    free(result.data);
+    free(floats.data);
+    free(floatResult.data);
+    free(back.data);
+}
+
+//testAlpha: Skipping alpha must leave the colour channels as they were and alpha as in the source, premultiplying must round trip,
+//           and a premultiplied blur must not bleed the colour of transparent pixels into opaque ones
+static void testAlpha(const char* input,Image* srcImage){
+    Image expected=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image actual=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image wide=*srcImage,result=*srcImage;
+    int bpp=srcImage->bpp;
+    size_t count=(size_t)srcImage->width*srcImage->height;
+    if (bpp!=2&&bpp!=4){
+        free(expected.data);
+        free(actual.data);
+        return;
+    }
+    for (size_t e=0;e<sizeof(engines)/sizeof(TestEngine);e++){
+        for (int k=0;k<=IDENTITY;k++){
+            Kernel* kernel=getKernel(k);
+            int worst=0;
+            referenceConvolute(srcImage,&expected,kernel);
+            setSkipAlpha(1);
+            engines[e].convolute(srcImage,&actual,kernel);
+            setSkipAlpha(0);
+            for (size_t p=0;p<count;p++){
+                for (int bit=0;bit<bpp-1;bit++)
+                    if (abs(expected.data[p*bpp+bit]-actual.data[p*bpp+bit])>worst) worst=abs(expected.data[p*bpp+bit]-actual.data[p*bpp+bit]);
+                if (actual.data[p*bpp+bpp-1]!=srcImage->data[p*bpp+bpp-1]) worst=256;
+            }
+            check(worst==0,"skip alpha",input,kernel->name);
+        }
+    }
+
+    wide.type=result.type=SAMPLE_U16;
+    wide.data=malloc(imageBytes(&wide));
+    result.data=malloc(imageBytes(&result));
+    convertImage(srcImage,&wide);
+    premultiplyImage(&wide,65535);
+    unpremultiplyImage(&wide,65535);
+    convertImage(&wide,&actual);
+    int worst=0;
+    for (size_t p=0;p<count;p++)
+        for (int bit=0;bit<bpp&&srcImage->data[p*bpp+bpp-1];bit++)
+            if (abs(srcImage->data[p*bpp+bit]-actual.data[p*bpp+bit])>worst) worst=abs(srcImage->data[p*bpp+bit]-actual.data[p*bpp+bit]);
+    check(worst<=1,"premultiplied alpha round trip",input,"");
+
+    //opaque white on the left half, transparent black on the right: a premultiplied blur keeps the edge white
+    for (size_t p=0;p<count;p++){
+        int opaque=(int)(p%srcImage->width)<srcImage->width/2;
+        for (int bit=0;bit<bpp;bit++) actual.data[p*bpp+bit]=opaque||bit<bpp-1?255*opaque:0;
+    }
+    convertImage(&actual,&wide);
+    premultiplyImage(&wide,65535);
+    convolute(&wide,&result,getKernel(GAUSE_BLUR));
+    unpremultiplyImage(&result,65535);
+    convertImage(&result,&actual);
+    worst=0;
+    for (size_t p=0;p<count;p++)
+        for (int bit=0;bit<bpp-1&&actual.data[p*bpp+bpp-1];bit++)
+            if (255-actual.data[p*bpp+bit]>worst) worst=255-actual.data[p*bpp+bit];
+    check(worst<=1,"premultiplied alpha blur",input,"gauss");
+
+    free(wide.data);
+    free(result.data);
+    free(expected.data);
+    free(actual.data);
+}
+
+//testLuma: Converting decoded pixels to luma must give what decoding straight to one channel gives, and a luma image must
+//          convolute like any other one channel image
+static void testLuma(const char* input,Image* srcImage){
+    Image luma=newImage(srcImage->width,srcImage->height,1),decoded,expected=newImage(srcImage->width,srcImage->height,1);
+    Image actual=newImage(srcImage->width,srcImage->height,1);
+    size_t length;
+    lumaImage(srcImage,&luma);
+    unsigned char* png=imgEncodeMem(srcImage,"png",&length);
+    check(png&&imgDecodeGray(png,length,&decoded)==0&&decoded.bpp==1&&maxDifference(&luma,&decoded)==0,"luma decode",input,"");
+    if (png&&decoded.data) imgFreeImage(&decoded);
+    free(png);
+    for (size_t e=0;e<sizeof(engines)/sizeof(TestEngine);e++){
+        referenceConvolute(&luma,&expected,getKernel(EDGE));
+        engines[e].convolute(&luma,&actual,getKernel(EDGE));
+        check(maxDifference(&expected,&actual)==0,engines[e].name,input,"luma edge");
+    }
+    free(luma.data);
+    free(expected.data);
+    free(actual.data);
+}
+
+//referenceGradient: The magnitude or angle of a fused operator, from two double precision sums computed separately
+static void referenceGradient(Image* srcImage,Image* destImage,Kernel* kernel){
+    int r=kernel->size/2;
+    for (int row=0;row<srcImage->height;row++)
+        for (int pix=0;pix<srcImage->width;pix++)
+            for (int bit=0;bit<srcImage->bpp;bit++){
+                double gx=0,gy=0;
+                for (int i=0;i<kernel->size;i++)
+                    for (int j=0;j<kernel->size;j++){
+                        int value=srcImage->data[Index(clampIndex(pix+j-r,srcImage->width),clampIndex(row+i-r,srcImage->height),srcImage->width,bit,srcImage->bpp)];
+                        gx+=kernel->coef[i][j]*value;
+                        gy+=kernel->coef[j][i]*value;
+                    }
+                uint8_t* out=&destImage->data[Index(pix,row,srcImage->width,bit,srcImage->bpp)];
+                if (kernel->fused==FUSED_MAGNITUDE){
+                    double magnitude=sqrt(gx*gx+gy*gy);
+                    *out=magnitude>=255?255:(uint8_t)(magnitude+0.5);
+                }
+                else{
+                    double turn=atan2(gy,gx)/(2*M_PI);
+                    *out=(uint8_t)(int)((turn<0?turn+1:turn)*256+0.5);
+                }
+            }
+}
+
+//testGradient: The fused operators through every engine and tile size, and the one pass library call against the two kernels
+static void testGradient(const char* input,Image* srcImage){
+    static const char* operators[]={"sobel","scharr"};
+    Image expected=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image actual=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    char name[MAX_KERNEL_NAME];
+    for (int o=0;o<2;o++){
+        for (int angle=0;angle<2;angle++){
+            snprintf(name,sizeof(name),angle?"%s-angle":"%s",operators[o]);
+            Kernel* kernel=findKernel(name);
+            referenceGradient(srcImage,&expected,kernel);
+            for (size_t e=0;e<sizeof(engines)/sizeof(TestEngine);e++)
+                for (size_t s=0;s<sizeof(tileSizes)/sizeof(tileSizes[0]);s++){
+                    setTileSize(tileSizes[s][0],tileSizes[s][1]);
+                    engines[e].convolute(srcImage,&actual,kernel);
+                    check(maxDifference(&expected,&actual)==0,engines[e].name,input,name);
+                }
+            setTileSize(0,0);
+        }
+        Image gx,gy,magnitude;
+        check(imgGradients(srcImage,operators[o],&gx,&gy,&magnitude,NULL)==0,"imgGradients",input,operators[o]);
+        snprintf(name,sizeof(name),"%s-x",operators[o]);
+        referenceConvolute(srcImage,&expected,findKernel(name));
+        check(maxDifference(&expected,&gx)==0,"imgGradients x",input,operators[o]);
+        snprintf(name,sizeof(name),"%s-y",operators[o]);
+        referenceConvolute(srcImage,&expected,findKernel(name));
+        check(maxDifference(&expected,&gy)==0,"imgGradients y",input,operators[o]);
+        referenceGradient(srcImage,&expected,findKernel(operators[o]));
+        check(maxDifference(&expected,&magnitude)==0,"imgGradients magnitude",input,operators[o]);
+        imgFreeImage(&gx);
+        imgFreeImage(&gy);
+        imgFreeImage(&magnitude);
+    }
+    static const char* rejected[]={"median5","bilateral","gaussian","nosuchkernel"};
+    for (size_t o=0;o<sizeof(rejected)/sizeof(rejected[0]);o++){
+        Image magnitude;
+        check(imgGradients(srcImage,rejected[o],NULL,NULL,&magnitude,NULL)==-1,"imgGradients rejects",input,rejected[o]);
+    }
+    free(expected.data);
+    free(actual.data);
+}
+
+//compareInts: qsort order for referenceRank
+static int compareInts(const void* a,const void* b){
+    return *(const int*)a-*(const int*)b;
+}
+
+//referenceRank: A rank filter by sorting every window
+static void referenceRank(Image* srcImage,Image* destImage,Kernel* kernel){
+    int r=kernel->size/2,count=kernel->size*kernel->size;
+    int window[MAX_RANK_SIZE*MAX_RANK_SIZE];
+    for (int row=0;row<srcImage->height;row++)
+        for (int pix=0;pix<srcImage->width;pix++)
+            for (int bit=0;bit<srcImage->bpp;bit++){
+                for (int i=0;i<kernel->size;i++)
+                    for (int j=0;j<kernel->size;j++)
+                        window[i*kernel->size+j]=srcImage->data[Index(clampIndex(pix+j-r,srcImage->width),clampIndex(row+i-r,srcImage->height),srcImage->width,bit,srcImage->bpp)];
+                qsort(window,count,sizeof(int),compareInts);
+                destImage->data[Index(pix,row,srcImage->width,bit,srcImage->bpp)]=window[kernel->rank==RANK_MEDIAN?count/2:kernel->rank==RANK_MIN?0:count-1];
+            }
+}
+
+//testRank: Every median, erode and dilate size through every engine and tile size, and on 16 bit and float samples
+static void testRank(const char* input,Image* srcImage){
+    Image expected=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image actual=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image floats=*srcImage,floatResult,wide=*srcImage,wideResult;
+    size_t count=(size_t)srcImage->width*srcImage->height*srcImage->bpp;
+    floats.type=SAMPLE_FLOAT;
+    wide.type=SAMPLE_U16;
+    floats.data=malloc(imageBytes(&floats));
+    floatResult=floats;
+    floatResult.data=malloc(imageBytes(&floats));
+    wide.data=malloc(imageBytes(&wide));
+    wideResult=wide;
+    wideResult.data=malloc(imageBytes(&wide));
+    convertImage(srcImage,&floats);
+    for (size_t i=0;i<count;i++) ((uint16_t*)wide.data)[i]=srcImage->data[i]<<8;
+    for (int k=0;k<kernelCount();k++){
+        Kernel* kernel=getKernel(k);
+        if (!kernel->rank) continue;
+        referenceRank(srcImage,&expected,kernel);
+        for (size_t e=0;e<sizeof(engines)/sizeof(TestEngine);e++)
+            for (size_t s=0;s<sizeof(tileSizes)/sizeof(tileSizes[0]);s++){
+                setTileSize(tileSizes[s][0],tileSizes[s][1]);
+                engines[e].convolute(srcImage,&actual,kernel);
+                check(maxDifference(&expected,&actual)==0,engines[e].name,input,kernel->name);
+            }
+        setTileSize(0,0);
+        convolute(&floats,&floatResult,kernel);
+        convertImage(&floatResult,&actual);
+        check(maxDifference(&expected,&actual)==0,"float",input,kernel->name);
+        convolute(&wide,&wideResult,kernel);
+        for (size_t i=0;i<count;i++) actual.data[i]=((uint16_t*)wideResult.data)[i]>>8;
+        check(maxDifference(&expected,&actual)==0,"16 bit",input,kernel->name);
+    }
+    free(floats.data);
+    free(floatResult.data);
+    free(wide.data);
+    free(wideResult.data);
+    free(expected.data);
+    free(actual.data);
+}
+
+//referenceBilateral: The bilateral filter's levels and interpolation, summing each window directly for the two levels either side
+//                    of the centre instead of keeping running sums
+static void referenceBilateral(Image* srcImage,Image* destImage,Kernel* kernel){
+    int r=kernel->size/2,count=(int)ceil(255/kernel->rangeSigma)+1,weights[511];
+    double spacing=255.0/(count-1);
+    for (int d=-255;d<=255;d++) weights[d+255]=(int)(1024*exp(-d*d/(2*kernel->rangeSigma*kernel->rangeSigma))+0.5);
+    for (int row=0;row<srcImage->height;row++)
+        for (int pix=0;pix<srcImage->width;pix++)
+            for (int bit=0;bit<srcImage->bpp;bit++){
+                int centre=srcImage->data[Index(pix,row,srcImage->width,bit,srcImage->bpp)];
+                int k=(int)(centre/spacing)<count-1?(int)(centre/spacing):count-2;
+                double average[2];
+                for (int level=0;level<2;level++){
+                    long long weight=0,weighted=0;
+                    int levelValue=(int)((k+level)*spacing+0.5);
+                    for (int i=-r;i<=r;i++)
+                        for (int j=-r;j<=r;j++){
+                            int value=srcImage->data[Index(clampIndex(pix+j,srcImage->width),clampIndex(row+i,srcImage->height),srcImage->width,bit,srcImage->bpp)];
+                            int w=weights[value-levelValue+255];
+                            weight+=w;
+                            weighted+=(long long)w*value;
+                        }
+                    average[level]=(double)weighted/weight;
+                }
+                destImage->data[Index(pix,row,srcImage->width,bit,srcImage->bpp)]=(uint8_t)(average[0]+(average[1]-average[0])*(centre/spacing-k)+0.5);
+            }
+}
+
+//testBilateral: The bilateral filter with and without parameters through every engine and tile size, on float samples, and on an
+//               edge it must leave alone
+static void testBilateral(const char* input,Image* srcImage){
+    static const char* specs[]={"bilateral","bilateral:2:10","bilateral:6:60"};
+    static const char* malformed[]={"bilateral:0","bilateral:33","bilateral:5:3","bilateral:5x","bilateral:5:30:1","blur:3"};
+    Image expected=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image actual=newImage(srcImage->width,srcImage->height,srcImage->bpp);
+    Image floats=*srcImage,floatResult,wide=*srcImage,wideResult,wideFloats;
+    Pipeline pipeline;
+    floats.type=SAMPLE_FLOAT;
+    floats.data=malloc(imageBytes(&floats));
+    floatResult=floats;
+    floatResult.data=malloc(imageBytes(&floats));
+    wideFloats=floats;
+    wideFloats.data=malloc(imageBytes(&floats));
+    wide.type=SAMPLE_U16;
+    wide.data=malloc(imageBytes(&wide));
+    wideResult=wide;
+    wideResult.data=malloc(imageBytes(&wide));
+    convertImage(srcImage,&floats);
+    convertImage(srcImage,&wide);
+    convertImage(&wide,&wideFloats);
+    for (size_t p=0;p<sizeof(specs)/sizeof(specs[0]);p++){
+        check(parsePipeline(specs[p],&pipeline)==0&&pipeline.count==1,"parse",input,specs[p]);
+        Kernel* kernel=pipeline.stages[0];
+        referenceBilateral(srcImage,&expected,kernel);
+        for (size_t e=0;e<sizeof(engines)/sizeof(TestEngine);e++)
+            for (size_t s=0;s<sizeof(tileSizes)/sizeof(tileSizes[0]);s++){
+                setTileSize(tileSizes[s][0],tileSizes[s][1]);
+                engines[e].convolute(srcImage,&actual,kernel);
+                check(maxDifference(&expected,&actual)==0,engines[e].name,input,specs[p]);
+            }
+        setTileSize(0,0);
+        //float results are not rounded, and convertImage truncates them
+        convolute(&floats,&floatResult,kernel);
+        convertImage(&floatResult,&actual);
+        check(maxDifference(&expected,&actual)<=1,"float",input,specs[p]);
+        //floats holding 0..65535, as from a 16 bit or linear light image, weigh values as the 16 bit image they came from does
+        setFloatRange(65535);
+        convolute(&wide,&wideResult,kernel);
+        convolute(&wideFloats,&floatResult,kernel);
+        check(maxSampleDifference(&wideResult,&floatResult)<=1,"16 bit float",input,specs[p]);
+        setFloatRange(255);
+    }
+    for (size_t p=0;p<sizeof(malformed)/sizeof(malformed[0]);p++)
+        check(parsePipeline(malformed[p],&pipeline)!=0,"rejects",input,malformed[p]);
+    //black and white halves are further apart than the range can bridge, so the filter changes nothing
+    for (size_t i=0;i<(size_t)srcImage->width*srcImage->height*srcImage->bpp;i++)
+        expected.data[i]=(int)(i/srcImage->bpp%srcImage->width)<srcImage->width/2?0:255;
+    convolute(&expected,&actual,findKernel("bilateral"));
+    check(maxDifference(&expected,&actual)==0,"edge",input,"bilateral");
+    free(floats.data);
+    free(floatResult.data);
+    free(wideFloats.data);
+    free(wide.data);
+    free(wideResult.data);
+    free(expected.data);
+    free(actual.data);
+}
+
+//referenceGaussian: A sampled Gaussian out to 6 sigma, normalized, applied to the rows and then the columns in double and rounded
+static void referenceGaussian(Image* srcImage,Image* destImage,double sigma){
+    int w=srcImage->width,h=srcImage->height,bpp=srcImage->bpp,r=(int)ceil(6*sigma);
+    double* weights=malloc(sizeof(double)*(2*r+1));
+    double* rows=malloc(sizeof(double)*w*h*bpp);
+    double sum=0;
+    for (int i=-r;i<=r;i++) sum+=weights[i+r]=exp(-i*i/(2*sigma*sigma));
+    for (int row=0;row<h;row++)
+        for (int pix=0;pix<w;pix++)
+            for (int bit=0;bit<bpp;bit++){
+                double value=0;
+                for (int i=-r;i<=r;i++) value+=weights[i+r]*srcImage->data[Index(clampIndex(pix+i,w),row,w,bit,bpp)];
+                rows[Index(pix,row,w,bit,bpp)]=value/sum;
+            }
+    for (int row=0;row<h;row++)
+        for (int pix=0;pix<w;pix++)
+            for (int bit=0;bit<bpp;bit++){
+                double value=0;
+                for (int i=-r;i<=r;i++) value+=weights[i+r]*rows[Index(pix,clampIndex(row+i,h),w,bit,bpp)];
+                destImage->data[Index(pix,row,w,bit,bpp)]=(uint8_t)(value/sum+0.5);
+            }
+    free(weights);
+    free(rows);
+}
+
+//testGaussian: The recursive Gaussian against a sampled one, the same through every engine, thread count and tile size, close to
+//              it for a region, on 16 bit and float samples, and flat where the image is flat
+static void testGaussian(const char* input,Image* srcImage){
+    static const char* specs[]={"gaussian","gaussian:0.5","gaussian:4.5","gaussian:40"};
+    static const char* malformed[]={"gaussian:0.4","gaussian:101","gaussian:2x","gaussian:","gaussian:2:3","gaussian:nan"};
+    int w=srcImage->width,h=srcImage->height,bpp=srcImage->bpp;
+    size_t count=(size_t)w*h*bpp;
+    Image expected=newImage(w,h,bpp);
+    Image serial=newImage(w,h,bpp);
+    Image actual=newImage(w,h,bpp);
+    Image floats=*srcImage,floatResult,wide=*srcImage,wideResult;
+    Pipeline pipeline;
+    char what[128];
+    floats.type=SAMPLE_FLOAT;
+    floats.data=malloc(imageBytes(&floats));
+    floatResult=floats;
+    floatResult.data=malloc(imageBytes(&floats));
+    wide.type=SAMPLE_U16;
+    wide.data=malloc(imageBytes(&wide));
+    wideResult=wide;
+    wideResult.data=malloc(imageBytes(&wide));
+    convertImage(srcImage,&floats);
+    for (size_t i=0;i<count;i++) ((uint16_t*)wide.data)[i]=srcImage->data[i]<<8;
+    for (size_t p=0;p<sizeof(specs)/sizeof(specs[0]);p++){
+        check(parsePipeline(specs[p],&pipeline)==0&&pipeline.count==1,"parse",input,specs[p]);
+        Kernel* kernel=pipeline.stages[0];
+        referenceGaussian(srcImage,&expected,kernel->sigma);
+        convolute(srcImage,&serial,kernel);
+        check(maxDifference(&expected,&serial)<=1,"sampled gaussian",input,specs[p]);
+        for (size_t e=0;e<sizeof(engines)/sizeof(TestEngine);e++)
+            for (size_t t=0;t<sizeof(threadCounts)/sizeof(int);t++)
+                for (size_t s=0;s<sizeof(tileSizes)/sizeof(tileSizes[0]);s++){
+                    setThreadCount(threadCounts[t]);
+                    setTileSize(tileSizes[s][0],tileSizes[s][1]);
+                    engines[e].convolute(srcImage,&actual,kernel);
+                    snprintf(what,sizeof(what),"%s %d threads %dx%d tiles",engines[e].name,threadCounts[t],tileSizes[s][0],tileSizes[s][1]);
+                    check(maxDifference(&serial,&actual)==0,what,input,specs[p]);
+                }
+        setThreadCount(0);
+        setTileSize(0,0);
+        //a region is filtered from 4 sigma outside it, and the rest of the image is left alone
+        memcpy(actual.data,serial.data,count);
+        convoluteRegion(srcImage,&actual,kernel,w/3,h/4,w-w/3,h-h/4);
+        check(maxDifference(&serial,&actual)<=1,"region",input,specs[p]);
+        //float results are not rounded, and convertImage truncates them
+        convolute(&floats,&floatResult,kernel);
+        convertImage(&floatResult,&actual);
+        check(maxDifference(&serial,&actual)<=1,"float",input,specs[p]);
+        convolute(&wide,&wideResult,kernel);
+        for (size_t i=0;i<count;i++) actual.data[i]=(((uint16_t*)wideResult.data)[i]+128)>>8;
+        check(maxDifference(&serial,&actual)<=1,"16 bit",input,specs[p]);
+        if (bpp==2||bpp==4){
+            int worst=0;
+            setSkipAlpha(1);
+            ompConvolute(srcImage,&actual,kernel);
+            setSkipAlpha(0);
+            for (size_t i=0;i<count;i++){
+                int difference=(int)(i%bpp)==bpp-1?abs(actual.data[i]-srcImage->data[i]):abs(actual.data[i]-serial.data[i]);
+                if (difference>worst) worst=difference;
+            }
+            check(worst==0,"skip alpha",input,specs[p]);
+        }
+        memset(expected.data,200,count);
+        convolute(&expected,&actual,kernel);
+        check(maxDifference(&expected,&actual)==0,"flat",input,specs[p]);
+    }
+    for (size_t p=0;p<sizeof(malformed)/sizeof(malformed[0]);p++)
+        check(parsePipeline(malformed[p],&pipeline)!=0,"rejects",input,malformed[p]);
+    free(floats.data);
+    free(floatResult.data);
+    free(wide.data);
+    free(wideResult.data);
+    free(expected.data);
+    free(serial.data);
+    free(actual.data);
+}
+
+static void testImage(const char* input,Image* srcImage){
+    //fused operators and filters without coefficients are not convolutions, so they are compared with their own references
+    for (int k=0;k<kernelCount();k++)
+        if (linearKernel(getKernel(k))) testKernel(input,srcImage,getKernel(k));
+    testPipeline(input,srcImage);
+    testLibrary(input,srcImage);
+    testRegion(input,srcImage);
+    testUpdate(input,srcImage);
+    testOutOfCore(input,srcImage);
+    testWide(input,srcImage);
+    testLight(input,srcImage);
+    testAlpha(input,srcImage);
+    testLuma(input,srcImage);
+    testGradient(input,srcImage);
+    testRank(input,srcImage);
+    testBilateral(input,srcImage);
+    testGaussian(input,srcImage);
+}
+
+//testCache: The result cache must evict the least recently used entry first and count hits and misses
+static void testCache(){
+    Cache* cache=malloc(sizeof(Cache));
+    size_t length;
+    unsigned char bytes[300];
+    memset(cache,0,sizeof(Cache));
+    memset(bytes,7,sizeof(bytes));
+    cacheConfigure(cache,250,NULL,0);
+    cacheStore(cache,"a",bytes,100);
+    cacheStore(cache,"b",bytes,100);
+    check(cacheLookup(cache,"a",&length)!=NULL&&length==100,"cache hit","cache","a");
+    //a is now more recently used than b, so storing c must evict b
+    cacheStore(cache,"c",bytes,100);
+    check(cacheLookup(cache,"b",&length)==NULL,"cache evicts least recently used","cache","b");
+    check(cacheLookup(cache,"a",&length)!=NULL&&cacheLookup(cache,"c",&length)!=NULL,"cache keeps recent","cache","a,c");
+    cacheStore(cache,"huge",bytes,300);
+    check(cacheLookup(cache,"huge",&length)==NULL,"cache skips entries over capacity","cache","huge");
+    check(cache->stats.hits==3&&cache->stats.misses==2&&cache->stats.evictions==1&&cache->stats.bytes==200,"cache statistics","cache","");
+    unsigned char* adopted=malloc(50);
+    check(cacheAdopt(cache,"d",adopted,50)==0&&cacheLookup(cache,"d",&length)==adopted,"cache adopts without copying","cache","d");
+    cacheConfigure(cache,0,NULL,0);
+    free(cache);
+    //results are keyed by what the stages compute, so redefining a kernel or changing a parameter changes the key
+    double coef[9]={0,0,0,0,1,0,0,0,0};
+    Pipeline first,second;
+    registerKernel("cached",3,coef);
+    parsePipeline("cached,gaussian:2",&first);
+    uint64_t hash=pipelineHash(&first);
+    coef[4]=2;
+    registerKernel("cached",3,coef);
+    parsePipeline("cached,gaussian:2",&second);
+    check(pipelineHash(&second)!=hash,"cache key follows kernel coefficients","cache","cached");
+    coef[4]=1;
+    registerKernel("cached",3,coef);
+    parsePipeline("cached,gaussian:2",&second);
+    check(pipelineHash(&second)==hash,"cache key repeats","cache","cached");
+    parsePipeline("cached,gaussian:3",&second);
+    check(pipelineHash(&second)!=hash,"cache key follows kernel parameters","cache","gaussian:3");
+}
+
+//testKernelFile: Checks that a kernel file adds user kernels but can not take over a built in kernel's name
+static void testKernelFile(){
+    Kernel blur=*getKernel(BLUR);
+    int count=kernelCount();
+    FILE* file=fopen("test_kernels.txt","w");
+    if (!file) return;
+    fputs("# a user kernel, then one that would replace the built in blur\nuserblur 3 1/9 1/9 1/9 1/9 1/9 1/9 1/9 1/9 1/9\nblur 3 0 0 0 0 1 0 0 0 0\n",file);
+    fclose(file);
+    check(loadKernelFile("test_kernels.txt")<0,"kernel file rejects built in names","kernel file","blur");
+    check(!memcmp(getKernel(BLUR),&blur,sizeof(blur)),"built in kernel kept","kernel file","blur");
+    file=fopen("test_kernels.txt","w");
+    if (!file) return;
+    fputs("userblur 3 1/9 1/9 1/9 1/9 1/9 1/9 1/9 1/9 1/9\n",file);
+    fclose(file);
+    check(loadKernelFile("test_kernels.txt")==1&&findKernel("userblur")-getKernel(0)>=count,"kernel file appends user kernels","kernel file","userblur");
+    remove("test_kernels.txt");
+}
+
+int main(int argc,char** argv){
+    static int sizes[][3]={{1,1,3},{1,9,1},{9,1,4},{37,23,1},{37,23,2},{37,23,3},{64,48,4}};
+    char input[64];
+    updateGolden=argc==2&&!strcmp(argv[1],"--update");
+    initKernelRegistry();
+    timerEnable(0);
+    loadGolden();
+
+    for (size_t i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++){
+        Image srcImage=syntheticImage(sizes[i][0],sizes[i][1],sizes[i][2]);
+        snprintf(input,sizeof(input),"synthetic-%dx%dx%d",sizes[i][0],sizes[i][1],sizes[i][2]);
+        testImage(input,&srcImage);
+        free(srcImage.data);
+    }
+    Image picture={NULL,0,0,0,SAMPLE_U8};
+    picture.data=stbi_load("pic4.jpg",&picture.width,&picture.height,&picture.bpp,0);
+    check(picture.data!=NULL,"load","pic4.jpg","");
+    if (picture.data){
+        //the full picture is large, so only the top rows are used
+        if (picture.height>64) picture.height=64;
+        testImage("pic4.jpg",&picture);
+        stbi_image_free(picture.data);
+    }
+
+    testCache();
+    testKernelFile();
+    if (updateGolden) saveGolden();
+    printf("%d of %d checks passed\n",checks-failures,checks);
+    return failures?1:0;
+}
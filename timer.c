@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <time.h>
+#include "timer.h"
+
+static const char* stageNames[STAGE_COUNT]={"decode","allocate","convolve","encode","write"};
+static long long stageTotal[STAGE_COUNT];
+static long long stageBegin[STAGE_COUNT];
+//compute time per thread.  Each slot is only ever written by its own thread, so no locking is needed.
+static long long threadTotal[MAX_TIMED_THREADS];
+static int timerEnabled=1;
+
+//nowNanos: Reads the monotonic clock in nanoseconds
+long long nowNanos(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec*1000000000LL+now.tv_nsec;
+}
+
+//nowSeconds: Reads the monotonic clock in seconds
+double nowSeconds(){
+    return nowNanos()/1e9;
+}
+
+//timerReset: Clears every stage and thread total
+void timerReset(){
+    for (int i=0;i<STAGE_COUNT;i++) stageTotal[i]=stageBegin[i]=0;
+    for (int i=0;i<MAX_TIMED_THREADS;i++) threadTotal[i]=0;
+}
+
+//timerEnable: Turns recording on or off, so that tuning and report runs do not count towards the stage times
+void timerEnable(int enabled){
+    timerEnabled=enabled;
+}
+
+//timerStart: Marks the start of a stage.  A stage may be started and stopped several times; the times add up.
+void timerStart(enum TimerStages stage){
+    stageBegin[stage]=nowNanos();
+}
+
+//timerStop: Adds the time since the matching timerStart to the stage total
+void timerStop(enum TimerStages stage){
+    if (!timerEnabled) return;
+    stageTotal[stage]+=nowNanos()-stageBegin[stage];
+}
+
+//stageNanos: Returns the total time spent in a stage
+long long stageNanos(enum TimerStages stage){
+    return stageTotal[stage];
+}
+
+//addThreadTime: Called by the engines to record the time a thread spent convoluting
+//Parameters: thread: The thread number, from 0
+//            nanos: The time to add
+void addThreadTime(int thread,long long nanos){
+    if (!timerEnabled||thread<0||thread>=MAX_TIMED_THREADS) return;
+    threadTotal[thread]+=nanos;
+}
+
+//timedThreads: The number of thread slots to report: up to the highest that recorded any time.  Counting here rather than
+//              in addThreadTime keeps the threads from sharing a variable they would race on.
+static int timedThreads(){
+    int count=MAX_TIMED_THREADS;
+    while (count>0&&!threadTotal[count-1]) count--;
+    return count;
+}
+
+//printTimings: Prints every stage and per thread time, either as text or as a single JSON object
+//Parameters: out: Where to print
+//            json: 1 for JSON, 0 for text
+void printTimings(FILE* out,int json){
+    long long total=0;
+    int i,threads=timedThreads();
+    for (i=0;i<STAGE_COUNT;i++) total+=stageTotal[i];
+    if (json){
+        fprintf(out,"{\"stages_ns\":{");
+        for (i=0;i<STAGE_COUNT;i++) fprintf(out,"%s\"%s\":%lld",i?",":"",stageNames[i],stageTotal[i]);
+        fprintf(out,"},\"total_ns\":%lld,\"threads_ns\":[",total);
+        for (i=0;i<threads;i++) fprintf(out,"%s%lld",i?",":"",threadTotal[i]);
+        fprintf(out,"]}\n");
+        return;
+    }
+    for (i=0;i<STAGE_COUNT;i++) fprintf(out,"%-10s %10.3f ms\n",stageNames[i],stageTotal[i]/1e6);
+    for (i=0;i<threads;i++) fprintf(out,"thread %-3d %10.3f ms\n",i,threadTotal[i]/1e6);
+    fprintf(out,"Took %.3f seconds\n",total/1e9);
+}
@@ -0,0 +1,21 @@
+#ifndef ___TIMER
+#define ___TIMER
+#include <stdio.h>
+
+//The stages of a run that are timed separately
+enum TimerStages{STAGE_DECODE=0,STAGE_ALLOCATE=1,STAGE_CONVOLVE=2,STAGE_ENCODE=3,STAGE_WRITE=4,STAGE_COUNT=5};
+
+#define MAX_TIMED_THREADS 256
+
+//timer.c
+long long nowNanos();
+double nowSeconds();
+void timerReset();
+void timerEnable(int enabled);
+void timerStart(enum TimerStages stage);
+void timerStop(enum TimerStages stage);
+long long stageNanos(enum TimerStages stage);
+void addThreadTime(int thread,long long nanos);
+void printTimings(FILE* out,int json);
+
+#endif